@@ -0,0 +1,87 @@
+#pragma once
+
+/*
+ * Maps the device's micros() onto the host's steady clock (NowNanos()), from round trips.
+ *
+ * The host writes a 'T' (Request()) and a SONAR_TRACE build answers with "#clk" and its
+ * micros() (Reply()). The device read its clock somewhere between the two host times, so
+ * the midpoint is a guess that's off by at most half the round trip. Round trips that got
+ * held up (in a USB frame, by the scheduler) are the ones that mislead, so the mapping is fit
+ * only to those close to the fastest in a window of recent ones: the offset and, once they
+ * span a few seconds, the drift between the two crystals.
+ *
+ * Request() and Reply() come from the thread that talks to the device; ToHostNanos() can be
+ * called from anywhere.
+ *
+ *   sonar::ClockSync sync;
+ *   write(fd, "T", 1);
+ *   sync.Request(sonar::NowNanos());
+ *   ...on "#clk\t<us>": sync.Reply(us, hostNanosOfTheLine);
+ *   ...
+ *   if(sync.Synced()) uint64_t t = sync.ToHostNanos(sample.captureMicros);
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+namespace sonar
+{
+
+class ClockSync
+{
+public:
+  explicit ClockSync(size_t window = 32) : window(window) {}
+
+  //a request has just been sent
+  void Request(uint64_t hostNanos);
+
+  //the answer to the last request arrived; returns false if there wasn't one outstanding
+  bool Reply(uint32_t deviceMicros, uint64_t hostNanos);
+
+  //whether a request is waiting for an answer
+  bool Pending(void) const;
+
+  bool Synced(void) const;
+
+  /*
+   * Host time for a device time. The device's 32-bit micros() wraps every 71 minutes; it's
+   * taken to be within 35 minutes of the latest reply.
+   */
+  int64_t ToHostNanos(uint32_t deviceMicros) const;
+
+  //the fastest round trip in the window, which bounds the error (at half of it)
+  uint64_t BestRoundTripNanos(void) const;
+
+  //how much faster the device clock runs than the host's, in parts per million
+  double DriftPPM(void) const;
+
+private:
+  struct Exchange
+  {
+    int64_t deviceMicros;   //unwrapped
+    double hostNanos;       //midpoint of the round trip
+    uint64_t roundTrip;
+  };
+
+  void Fit(void);
+
+  size_t window;
+  mutable std::mutex mutex;
+
+  uint64_t requestNanos = 0;
+  bool pending = false;
+
+  std::deque<Exchange> exchanges;
+  int64_t lastDevice = 0;
+
+  //host = hostAt + nanosPerMicro * (device - deviceAt)
+  bool synced = false;
+  int64_t deviceAt = 0;
+  double hostAt = 0;
+  double nanosPerMicro = 1000;
+  uint64_t bestRoundTrip = 0;
+};
+
+}
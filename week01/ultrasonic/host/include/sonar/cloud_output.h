@@ -0,0 +1,104 @@
+#pragma once
+
+/*
+ * Getting point batches out to other programs: PLY and PCD files (which most point-cloud
+ * tools read), and a shared-memory buffer that a navigation stack can map and poll.
+ */
+
+#include "sonar/point_cloud.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+namespace sonar
+{
+
+/*
+ * Writes binary little-endian PLY or binary PCD with fields x, y, z (mm), range (mm), and 
+ * sensor. Neither format can be appended to once the header is written, so the header is 
+ * written with a placeholder count that Close() fills in -- the output has to be a seekable 
+ * file, not a pipe.
+ */
+class CloudFile
+{
+public:
+  enum class Format {Ply, Pcd};
+
+  ~CloudFile(void) {Close();}
+
+  bool Open(const std::string& path, Format format);
+  void Write(const PointBatch& batch);
+  void Close(void);
+
+  uint64_t Points(void) const {return points;}
+
+  //guesses the format from the extension (.pcd, or PLY otherwise)
+  static Format FormatFor(const std::string& path);
+
+private:
+  void WriteHeader(void);
+
+  FILE* file = nullptr;
+  Format format = Format::Ply;
+  uint64_t points = 0;
+};
+
+/*
+ * The layout of the shared-memory buffer: a fixed header followed by a ring of points.
+ *
+ * The writer bumps sequence to an odd number before touching the ring and to the next even 
+ * number after, and head counts every point ever written (slot = index % capacity). A reader 
+ * copies what it wants between two reads of sequence, and retries if they differ or are odd.
+ */
+struct SharedCloudPoint
+{
+  float x, y, z;       //mm, world frame if odometry is available, otherwise robot frame
+  float range;         //mm
+  uint32_t deviceMillis;
+  uint32_t sensor;
+};
+
+struct SharedCloudHeader
+{
+  static const uint32_t MAGIC = 0x534F4E52;  //"SONR"
+
+  uint32_t magic;
+  uint32_t capacity;               //points in the ring
+  std::atomic<uint64_t> sequence;  //odd while the writer is busy
+  std::atomic<uint64_t> head;      //points written so far
+
+  SharedCloudPoint* Points(void) {return reinterpret_cast<SharedCloudPoint*>(this + 1);}
+};
+
+class SharedCloud
+{
+public:
+  ~SharedCloud(void);
+
+  //creates (or replaces) a POSIX shared-memory object, e.g. "/sonar_cloud"
+  bool Create(const std::string& name, uint32_t capacity);
+
+  //maps an existing one, for reading
+  bool Attach(const std::string& name);
+
+  void Write(const PointBatch& batch);
+
+  /*
+   * Copies up to max of the newest points written after index `since` into out, oldest first,
+   * and returns how many; since is updated to the new head. Points overwritten before they 
+   * could be read are skipped.
+   */
+  size_t Read(uint64_t& since, SharedCloudPoint* out, size_t max);
+
+  //removes the object (the creator calls this when done)
+  void Unlink(void);
+
+private:
+  std::string name;
+  SharedCloudHeader* header = nullptr;
+  size_t bytes = 0;
+};
+
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+/*
+ * Parses the device stream once and hands every sample to any number of subscribers.
+ *
+ * Each subscriber gets its own SpscRing (with its own size and overflow policy), so a slow
+ * consumer only ever affects itself -- unless it asked for backpressure (Block), in which
+ * case it holds up the reader, by design. Publishing a sample costs one copy per subscriber;
+ * the parsing is shared.
+ *
+ * Subscribe everything before starting to feed data: the subscriber list is not protected
+ * against changes while the reader is running.
+ *
+ *   sonar::Fanout fanout;
+ *   auto* logger = fanout.Subscribe("logger", 4096, sonar::OverflowPolicy::Block);
+ *   auto* monitor = fanout.Subscribe("monitor", 64, sonar::OverflowPolicy::DropOldest);
+ *   std::thread reader([&] {... fanout.Feed(buffer, n, sonar::NowNanos()); ...});
+ *   ...
+ *   sonar::Sample s;
+ *   while(logger->Wait(s)) {...}
+ */
+
+#include "sonar/sample.h"
+#include "sonar/spsc_ring.h"
+#include "sonar/stream_parser.h"
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace sonar
+{
+
+//steady-clock time in ns, for stamping received data
+uint64_t NowNanos(void);
+
+class Subscription
+{
+public:
+  Subscription(std::string name, size_t capacity, OverflowPolicy policy)
+    : name(std::move(name)), ring(capacity, policy) {}
+
+  const std::string& Name(void) const {return name;}
+
+  //returns false right away if there's nothing waiting
+  bool TryPop(Sample& sample) {return ring.Pop(sample);}
+
+  //waits (spinning briefly, then sleeping) for a sample; returns false once the stream has
+  //ended and everything has been read
+  bool Wait(Sample& sample);
+
+  //the consumer is going away; stops a Block subscription from holding up the reader
+  void Close(void) {ring.Close();}
+
+  uint64_t Dropped(void) const {return ring.Dropped();}
+  size_t Backlog(void) const {return ring.Size();}
+
+private:
+  friend class Fanout;
+
+  std::string name;
+  SpscRing<Sample> ring;
+  std::atomic<bool> ended{false};
+};
+
+class Fanout
+{
+public:
+  //metadata lines ('#...') go to onMetadata, on the reader thread
+  explicit Fanout(StreamParser::MetadataCallback onMetadata = nullptr);
+
+  Subscription* Subscribe(const std::string& name, size_t capacity, OverflowPolicy policy);
+
+  //feeds raw bytes from the device (from the reader thread)
+  void Feed(const char* data, size_t length, uint64_t hostNanos) {parser.Feed(data, length, hostNanos);}
+
+  //publishes an already-parsed sample (from the reader thread)
+  void Publish(const Sample& sample);
+
+  //tells the subscribers that no more data is coming
+  void End(void);
+
+  const StreamParser& Parser(void) const {return parser;}
+
+private:
+  StreamParser parser;
+  std::vector<std::unique_ptr<Subscription>> subscriptions;
+};
+
+}
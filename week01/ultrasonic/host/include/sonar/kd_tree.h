@@ -0,0 +1,57 @@
+#pragma once
+
+/*
+ * A static 2D k-d tree for nearest-neighbour queries on scan points.
+ *
+ * The tree is implicit: the points are reordered so that every node is a range of the array,
+ * split at its midpoint on the wider axis, and only the split axis and value are stored. That
+ * keeps the tree to a few flat arrays and makes queries cache-friendly. Given a WorkerPool,
+ * Build() partitions the top few levels itself and then builds the subtrees in parallel.
+ *
+ * Queries don't modify the tree, so any number of threads can run them at once.
+ */
+
+#include "sonar/worker_pool.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace sonar
+{
+
+class KdTree2D
+{
+public:
+  //nodes this small are searched linearly
+  static const size_t LEAF_SIZE = 8;
+
+  void Build(const float* x, const float* y, size_t n, WorkerPool* pool = nullptr);
+
+  size_t Size(void) const {return index.size();}
+
+  /*
+   * Finds up to k of the nearest points within maxDistance of (x, y), nearest first. Writes
+   * their indices (as passed to Build()) and squared distances, and returns how many it found.
+   */
+  size_t Nearest(float x, float y, size_t k, float maxDistance, uint32_t* indices, float* distance2) const;
+
+private:
+  struct Range
+  {
+    size_t lo, hi;
+  };
+
+  void Split(size_t lo, size_t hi, const float* x, const float* y);
+  void BuildRange(size_t lo, size_t hi, const float* x, const float* y);
+
+  struct Query;
+  void Search(size_t lo, size_t hi, Query& q) const;
+
+  std::vector<float> px, py;         //the points, in tree order
+  std::vector<uint32_t> index;       //tree order -> original index
+  std::vector<uint8_t> axis;         //split axis of the node whose midpoint is here
+  std::vector<float> split;          //and the value it splits at
+};
+
+}
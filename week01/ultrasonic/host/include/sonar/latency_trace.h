@@ -0,0 +1,102 @@
+#pragma once
+
+/*
+ * Where the time goes between an echo and the code that uses it, for SONAR_TRACE builds.
+ *
+ * A traced sample carries the device's micros() at three points, and the host adds two more:
+ *
+ *   capture   the echo's falling edge (caught by the timer)
+ *   ready     loop() picked up the reading
+ *   sent      the record was formatted and about to be written
+ *   received  the end of the record came out of read() on the host
+ *   consumed  a subscriber took the sample off its ring
+ *
+ * The stages between consecutive points each get a histogram, plus one for the whole trip.
+ * The first two are on the device clock and need nothing else; the rest cross from the
+ * device to the host and need a ClockSync (they're skipped until it's synced). A negative
+ * time means the clock mapping is off by more than the stage takes; those are counted apart.
+ */
+
+#include "sonar/clock_sync.h"
+#include "sonar/sample.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+
+namespace sonar
+{
+
+/*
+ * Histogram of times in ns, with buckets a quarter of an octave wide (so percentiles are
+ * good to about 10%) from 1 ns to minutes. Min, max, and mean are exact.
+ */
+class LatencyHistogram
+{
+public:
+  void Add(int64_t nanos);
+
+  uint64_t Count(void) const {return count;}
+  uint64_t Negative(void) const {return negative;}
+  int64_t Min(void) const {return count ? min : 0;}
+  int64_t Max(void) const {return count ? max : 0;}
+  double Mean(void) const {return count ? double(sum) / count : 0;}
+
+  //the q-th quantile (0 to 1), in ns
+  double Percentile(double q) const;
+
+  void Merge(const LatencyHistogram& other);
+
+private:
+  static const int SUB_BUCKETS = 4;
+  static const int BUCKETS = 40 * SUB_BUCKETS;
+
+  static int Bucket(uint64_t nanos);
+  static double BucketMiddle(int bucket);
+
+  uint64_t buckets[BUCKETS] = {};
+  uint64_t count = 0;
+  uint64_t negative = 0;
+  int64_t min = INT64_MAX;
+  int64_t max = INT64_MIN;
+  int64_t sum = 0;
+};
+
+enum class LatencyStage : uint8_t
+{
+  CaptureToReady,     //waiting for loop()
+  ReadyToSent,        //conversion and formatting
+  SentToReceived,     //the serial write, USB, and the host's driver and read()
+  ReceivedToConsumed, //parsing, the fan-out, and the subscriber's queue
+  Total,              //capture to consumed
+  Count
+};
+
+const char* LatencyStageName(LatencyStage stage);
+
+/*
+ * A histogram for each stage. Add() can be called from several consumers at once.
+ */
+class LatencyTrace
+{
+public:
+  explicit LatencyTrace(const ClockSync* sync = nullptr) : sync(sync) {}
+
+  //adds a traced sample taken off a ring at consumedNanos (NowNanos()); others are ignored
+  void Add(const Sample& sample, uint64_t consumedNanos);
+
+  //a copy of one stage's histogram
+  LatencyHistogram Stage(LatencyStage stage) const;
+
+  //prints a table of count, min, percentiles, and max (in us) per stage
+  void Print(FILE* out) const;
+
+  void Reset(void);
+
+private:
+  const ClockSync* sync;
+  mutable std::mutex mutex;
+  LatencyHistogram stages[size_t(LatencyStage::Count)];
+};
+
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+/*
+ * Largest-Triangle-Three-Buckets downsampling, for plotting long series at screen resolution.
+ *
+ * The points between the first and the last are split into buckets of equal count, and from
+ * each bucket we keep the one point that makes the largest triangle with the point kept from
+ * the bucket before and the mean of the bucket after. Unlike decimating or averaging, that
+ * keeps the shape a plot of every point would have, spikes and dropouts included, with a
+ * single pass over the data. One point per horizontal pixel is plenty.
+ *
+ * x must be non-decreasing (it's the time axis); the buckets are by count, not by x, so a
+ * gap in the data stays a gap.
+ */
+
+#include <cstddef>
+#include <cstdint>
+
+namespace sonar
+{
+
+/*
+ * Chooses up to threshold of the n points (x[i], y[i]), always including the first and the
+ * last, and writes their indices to out in order. Returns how many it wrote: all n if
+ * threshold >= n, and the first and last if threshold < 3. Allocates nothing.
+ */
+size_t LttbSelect(const double* x, const double* y, size_t n, size_t threshold, uint32_t* out);
+
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+/*
+ * Turns ranges into 3D points in the robot frame and the world frame.
+ *
+ * Each sensor's pose on the robot comes from a MountingTable (one row per trigger/echo pair),
+ * and the robot's pose at the time of each reading comes from Odometry, interpolated between
+ * the two nearest poses. Readings are collected into a batch and transformed together, 
+ * structure-of-arrays style, so the inner loops run 4 readings at a time in SIMD registers
+ * (using GCC/Clang vector extensions, so it works on x86 and ARM alike).
+ *
+ * Frames: x forward, y left, z up; distances in mm, angles in radians. A sensor looks along
+ * its own +x axis, rotated by yaw (about z) and then pitch (about the new y, positive down).
+ * For a servo-swept sensor, the sample angle (degrees) is added to the mounting yaw.
+ */
+
+#include "sonar/sample.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace sonar
+{
+
+struct SensorMount
+{
+  float x = 0, y = 0, z = 0;   //mm, in the robot frame
+  float yaw = 0, pitch = 0;    //radians
+};
+
+class MountingTable
+{
+public:
+  void Set(uint8_t sensor, const SensorMount& mount);
+  const SensorMount* Find(uint8_t sensor) const;
+
+  /*
+   * Loads whitespace-separated rows of "sensor x y z yaw pitch" (mm, degrees); blank lines 
+   * and lines starting with '#' are skipped. Returns false if the file can't be read or a
+   * row doesn't parse.
+   */
+  bool Load(const std::string& path);
+
+private:
+  std::vector<SensorMount> mounts;
+  std::vector<bool> present;
+};
+
+struct Pose2D
+{
+  double x = 0, y = 0, theta = 0;  //mm, mm, radians
+};
+
+/*
+ * Robot poses over time (in device milliseconds, the same clock as Sample::deviceMillis).
+ */
+class Odometry
+{
+public:
+  //poses must be added in time order
+  void Add(uint32_t deviceMillis, const Pose2D& pose);
+
+  //interpolated pose; holds the last pose after the end, and returns false before the first
+  //(or if there are none)
+  bool At(uint32_t deviceMillis, Pose2D& pose) const;
+
+  //forgets poses older than the given time (keeping one before it, for interpolation)
+  void Trim(uint32_t deviceMillis);
+
+  /*
+   * Loads CSV rows of "device_ms,x_mm,y_mm,theta_rad" (a header line is skipped).
+   */
+  bool Load(const std::string& path);
+
+private:
+  std::vector<uint32_t> times;
+  std::vector<Pose2D> poses;
+};
+
+struct PointBatch
+{
+  std::vector<float> x, y, z;
+  std::vector<float> range;        //mm
+  std::vector<uint8_t> sensor;
+  std::vector<uint32_t> deviceMillis;
+
+  size_t Size(void) const {return x.size();}
+  void Clear(void);
+  void Resize(size_t n);
+};
+
+class CloudBuilder
+{
+public:
+  explicit CloudBuilder(const MountingTable& mounts) : mounts(mounts) {}
+
+  //queues a reading; returns false if it has no range or its sensor isn't in the table
+  bool Add(const Sample& sample);
+
+  size_t Pending(void) const {return range.size();}
+
+  /*
+   * Transforms everything queued into the robot frame (and, if odometry is given, the world 
+   * frame), appending to the output batches, and clears the queue. Either output may be null.
+   * Readings the odometry has no pose for go in the robot frame only; see Unposed().
+   */
+  void Flush(PointBatch* robotFrame, PointBatch* worldFrame, const Odometry* odometry);
+
+  //readings left out of the world frame for want of a pose
+  uint64_t Unposed(void) const {return unposed;}
+
+  //readings beyond this are treated as no echo and skipped
+  float maxRangeMM = 4000;
+
+private:
+  const MountingTable& mounts;
+
+  //queued readings, with each one's beam direction and sensor origin already looked up
+  std::vector<float> range, dirX, dirY, dirZ, originX, originY, originZ;
+  std::vector<uint8_t> sensors;
+  std::vector<uint32_t> times;
+
+  //scratch for the robot poses, and the readings that have one
+  std::vector<float> poseX, poseY, poseCos, poseSin;
+  std::vector<uint32_t> keep;
+  std::vector<float> keptX, keptY;
+
+  uint64_t unposed = 0;
+};
+
+/*
+ * The SIMD kernels, exposed for benchmarking. out = origin + range * dir, and then
+ * (wx, wy) = pose + R(theta) (x, y).
+ */
+void BeamToPoints(size_t n, const float* range, const float* dirX, const float* dirY, const float* dirZ,
+                  const float* originX, const float* originY, const float* originZ,
+                  float* x, float* y, float* z);
+
+void RobotToWorld(size_t n, const float* x, const float* y, const float* poseX, const float* poseY,
+                  const float* cosTheta, const float* sinTheta, float* worldX, float* worldY);
+
+}
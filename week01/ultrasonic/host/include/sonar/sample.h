@@ -0,0 +1,44 @@
+#pragma once
+
+/*
+ * One reading from the device, as parsed from its serial output.
+ */
+
+#include <cstdint>
+
+namespace sonar
+{
+
+enum class SampleKind : uint8_t
+{
+  Range,      //timestamp, counts, us, mm (the default output)
+  ScanPoint,  //timestamp, angle, mm (SONAR_SWEEP)
+  Window,     //timestamp, pings, valid, min, max, mean (SONAR_DECIMATE)
+};
+
+struct Sample
+{
+  SampleKind kind = SampleKind::Range;
+  uint8_t sensor = 0;         //which sensor on the robot (0 unless the record says otherwise)
+
+  uint32_t deviceMillis = 0;  //millis() on the device when the record was sent
+  uint32_t counts = 0;        //echo width in timer counts (Range)
+  uint32_t pulseUS = 0;       //echo width in us (Range)
+  int32_t angle = 0;          //degrees (ScanPoint)
+  int32_t distanceMM10 = 0;   //distance in tenths of a mm (the mean, for a Window)
+  int32_t minMM10 = 0;        //Window only
+  int32_t maxMM10 = 0;
+  uint32_t pings = 0;
+  uint32_t valid = 0;
+
+  uint64_t hostNanos = 0;     //when the end of the record was received (steady clock)
+
+  //SONAR_TRACE builds, from the "#lat" line before the record (device micros()): the echo's
+  //falling edge, when loop() picked it up, and just before the record was written
+  bool traced = false;
+  uint32_t captureMicros = 0;
+  uint32_t readyMicros = 0;
+  uint32_t sentMicros = 0;
+};
+
+}
@@ -0,0 +1,181 @@
+#pragma once
+
+/*
+ * Aligning consecutive sonar scans to correct wheel-odometry drift.
+ *
+ * ScanMatcher does point-to-line ICP: each point of the new scan is paired with the nearest
+ * point of the reference scan (through a k-d tree), and the pose is solved to minimise the
+ * distance to the line through that point, i.e. along its surface normal. 
+ *
+ * Sonar points are not where a lidar's would be: a reading is the nearest surface anywhere 
+ * in a cone about 30 degrees wide, plotted on the cone's axis. So a point is good to a few 
+ * mm along its beam but only to range * tan(half-angle) across it. Each pair is weighted by
+ * the inverse of its variance along the normal, which takes that into account for both 
+ * points -- a far point on a wall seen side-on counts for little, a near one seen face-on 
+ * counts for a lot. Where the reference is too sparse to fit a line, the normal is taken to
+ * point back along the beam, since a sonar only hears surfaces roughly facing it. Scan::
+ * ExtractArcs() goes further and puts each wall where it really is, with its normal, and where
+ * both points of a pair know their normals the pair constrains the heading as well.
+ *
+ * Building the tree, fitting the normals, and each iteration's pairing are split across a
+ * shared WorkerPool, so one pool can serve a DriftCorrector per robot, each running in its
+ * own thread.
+ */
+
+#include "sonar/kd_tree.h"
+#include "sonar/point_cloud.h"
+#include "sonar/worker_pool.h"
+
+#include <cstddef>
+#include <vector>
+
+namespace sonar
+{
+
+//b expressed in a's frame, composed onto a
+Pose2D Compose(const Pose2D& a, const Pose2D& b);
+Pose2D Inverse(const Pose2D& a);
+
+/*
+ * One scan in the robot frame: the points and the direction and range of the beam that
+ * found each one.
+ *
+ * A point can also carry the surface normal at it, if that's known, and a tighter position
+ * than the beam width allows. ExtractArcs() produces such points.
+ */
+struct Scan
+{
+  std::vector<float> x, y;           //mm
+  std::vector<float> beamX, beamY;   //unit vector along the beam
+  std::vector<float> range;          //mm
+  std::vector<float> lateralMM;      //sigma across the beam; 0 for range * tan(half beam angle)
+  std::vector<float> normalX, normalY;
+  std::vector<float> normalSigma;    //radians; 0 if the normal isn't known
+
+  size_t Size(void) const {return x.size();}
+  void Clear(void);
+
+  void Add(float x, float y, float beamAngle, float range);
+
+  //adds robot-frame points, working out each beam from its sensor's mounting
+  void Add(const PointBatch& robotFrame, const MountingTable& mounts);
+
+  /*
+   * A wall or corner facing the sensor echoes back over the whole beam width, so a sweep 
+   * draws it as an arc of equal ranges centred on the sensor -- and the arc moves with the
+   * robot, which drags matching toward "no motion". The surface is really only at the middle
+   * of the arc, facing straight back at the sensor.
+   *
+   * This returns a copy of the scan (in the order it was swept) with each run of equal ranges
+   * spanning at least minWidth radians replaced by one point at its middle, with a known 
+   * normal. Points not in an arc are kept as they are.
+   */
+  Scan ExtractArcs(float minWidth = 0.26f, float toleranceMM = 15, float maxGap = 0.1f) const;
+};
+
+struct MatchConfig
+{
+  float beamHalfAngle = 0.26f;     //radians; about 15 degrees for an HC-SR04
+  float rangeSigmaMM = 5;          //along the beam
+  float maxPairMM = 250;           //points farther apart than this aren't the same surface
+  size_t normalNeighbours = 5;     //points used to fit the line through a reference point
+  float normalRadiusMM = 300;      //and how far away they can be
+  float lineToleranceMM = 8;       //how far they can stray from the line (sigma)
+  float guessedNormalMM = 30;      //extra uncertainty where no line fits
+  int maxIterations = 30;
+  float doneMM = 0.1f;             //stops when a step moves less than this...
+  float doneRadians = 0.0002f;     //...and turns less than this
+  size_t minPairs = 4;             //fewer than this and the match is rejected
+
+  //how far the guess is trusted; the match is pulled toward it with this uncertainty (0 to
+  //use the scans alone)
+  float priorSigmaMM = 20;
+  float priorSigmaRadians = 0.03f;
+  size_t chunk = 64;               //points per work item
+};
+
+struct MatchResult
+{
+  Pose2D pose;                     //the new scan's pose in the reference scan's frame
+  bool ok = false;
+  bool converged = false;
+  int iterations = 0;
+  size_t pairs = 0;
+  double rmsMM = 0;                //of the point-to-line distances
+
+  //the weighted normal matrix (x, y, theta) of the last step; a small eigenvalue means
+  //that direction isn't constrained (e.g., along a featureless corridor)
+  double information[3][3] = {};
+};
+
+class ScanMatcher
+{
+public:
+  explicit ScanMatcher(WorkerPool* pool = nullptr, const MatchConfig& config = MatchConfig())
+    : pool(pool), config(config) {}
+
+  void SetReference(const Scan& scan);
+  bool HasReference(void) const {return reference.Size() > 0;}
+
+  //aligns scan to the reference, starting from guess (e.g., the odometry delta)
+  MatchResult Match(const Scan& scan, const Pose2D& guess) const;
+
+  const MatchConfig& Config(void) const {return config;}
+
+private:
+  void ParallelFor(size_t n, const std::function<void(size_t)>& fn) const;
+
+  WorkerPool* pool;
+  MatchConfig config;
+
+  Scan reference;
+  std::vector<float> normalX, normalY;
+  std::vector<float> normalVariance;   //extra, for normals that are only guessed
+  KdTree2D tree;
+};
+
+/*
+ * Keeps one robot's drift-corrected pose: each scan is matched to a recent keyframe scan, 
+ * starting from the odometry's idea of the motion in between, and becomes the new keyframe
+ * once the robot has moved far enough from the old one. If the match fails, or disagrees 
+ * with the odometry by more than the limits below, the odometry is trusted for that step.
+ */
+class DriftCorrector
+{
+public:
+  explicit DriftCorrector(WorkerPool* pool = nullptr, const MatchConfig& config = MatchConfig())
+    : matcher(pool, config) {}
+
+  //a match is only used if its residual is at most maxResidualMM and it differs from odometry
+  //by at most maxCorrectionMM + maxCorrectionPerMM * the distance since the keyframe, and by
+  //at most maxCorrectionRadians; otherwise the odometry stands for that scan
+  float maxResidualMM = 150;
+  float maxCorrectionMM = 40;
+  float maxCorrectionPerMM = 0.1f;
+  float maxCorrectionRadians = 0.15f;
+
+  //the share of an accepted match's translation (relative to odometry) that's applied; its
+  //heading is always applied in full
+  float translationGain = 0.25f;
+
+  float keyframeMM = 150;
+  float keyframeRadians = 0.2f;
+
+  //takes a scan and the odometry pose it was taken at; returns the corrected pose
+  Pose2D Add(const Scan& scan, const Pose2D& odometry, MatchResult* result = nullptr);
+
+  //applies the latest correction to an odometry pose (e.g., between scans)
+  Pose2D Correct(const Pose2D& odometry) const {return Compose(correction, odometry);}
+
+  uint64_t Matched(void) const {return matched;}
+  uint64_t Rejected(void) const {return rejected;}
+
+private:
+  ScanMatcher matcher;
+
+  Pose2D keyOdometry, keyCorrected;   //where the keyframe was taken
+  Pose2D correction;               //corrected = correction * odometry
+  uint64_t matched = 0, rejected = 0;
+};
+
+}
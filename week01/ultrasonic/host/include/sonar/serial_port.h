@@ -0,0 +1,19 @@
+#pragma once
+
+/*
+ * Opening the device (or a recording of its output) for reading.
+ */
+
+#include <string>
+
+namespace sonar
+{
+
+/*
+ * Opens path for reading. If it's a terminal (e.g., /dev/ttyACM0), it's put in raw mode at
+ * the given baud rate; anything else (a file, a FIFO) is read as is, and "-" is stdin.
+ * Returns a file descriptor, or -1 with errno set.
+ */
+int OpenStream(const std::string& path, int baud = 115200);
+
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+/*
+ * Bounded lock-free ring between one producer thread and one consumer thread.
+ *
+ * What happens when the ring is full depends on the policy:
+ *   DropNewest  the new item is discarded (the consumer sees a gap at the end)
+ *   DropOldest  the oldest unread item is discarded to make room (the consumer always sees
+ *               the most recent data, which is usually what a monitor wants)
+ *   Block       the producer waits for the consumer (backpressure; a stuck consumer 
+ *               stalls the producer, so use it only for consumers that must see everything)
+ *
+ * For DropOldest, both sides advance the tail with a compare-and-swap, and the producer may
+ * overwrite the slot the consumer is copying from. So each slot also has a sequence number,
+ * seqlock style: the producer makes it odd while it writes the slot and then sets it to mark
+ * which item the slot holds. The consumer checks it before and after copying, and keeps the
+ * copy only if the slot held the item it wanted throughout and its CAS on the tail wins;
+ * otherwise it starts over from the new tail. T must be trivially copyable.
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace sonar
+{
+
+enum class OverflowPolicy
+{
+  DropNewest,
+  DropOldest,
+  Block,
+};
+
+template <typename T>
+class SpscRing
+{
+  static_assert(std::is_trivially_copyable<T>::value, "ring items are copied without locks");
+
+public:
+  //capacity is rounded up to a power of two
+  SpscRing(size_t capacity, OverflowPolicy policy) : policy(policy)
+  {
+    size_t size = 1;
+    while(size < capacity) size <<= 1;
+    items.resize(size);
+    sequence.reset(new std::atomic<uint64_t>[size]());
+    mask = size - 1;
+  }
+
+  //producer side; returns false if the item was dropped
+  bool Push(const T& item)
+  {
+    uint64_t h = head.load(std::memory_order_relaxed);
+
+    for(;;)
+    {
+      uint64_t t = tail.load(std::memory_order_acquire);
+      if(h - t <= mask) break;
+
+      if(policy == OverflowPolicy::DropNewest)
+      {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+
+      if(policy == OverflowPolicy::Block)
+      {
+        if(closed.load(std::memory_order_relaxed)) return false;
+        std::this_thread::yield();
+        continue;
+      }
+
+      //DropOldest: take the oldest item away from the consumer
+      if(tail.compare_exchange_weak(t, t + 1, std::memory_order_acq_rel))
+      {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+
+    if(policy != OverflowPolicy::DropOldest)
+    {
+      items[h & mask] = item;
+      head.store(h + 1, std::memory_order_release);
+      return true;
+    }
+
+    //odd while the slot is being written, then 2 * (h + 1) once it holds item h
+    std::atomic<uint64_t>& seq = sequence[h & mask];
+    seq.store(2 * h + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    items[h & mask] = item;
+    seq.store(2 * h + 2, std::memory_order_release);
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  //consumer side; returns false if the ring is empty
+  bool Pop(T& item)
+  {
+    uint64_t t = tail.load(std::memory_order_relaxed);
+
+    for(;;)
+    {
+      if(t == head.load(std::memory_order_acquire)) return false;
+
+      if(policy != OverflowPolicy::DropOldest)
+      {
+        item = items[t & mask];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+      }
+
+      //the slot has to hold item t from before the copy until after it
+      std::atomic<uint64_t>& seq = sequence[t & mask];
+      uint64_t before = seq.load(std::memory_order_acquire);
+      item = items[t & mask];
+      std::atomic_thread_fence(std::memory_order_acquire);
+      uint64_t after = seq.load(std::memory_order_relaxed);
+
+      //if the producer dropped this one, before or during the copy, we retry from the new tail
+      if(before == 2 * t + 2 && after == before && tail.compare_exchange_weak(t, t + 1, std::memory_order_acq_rel))
+      {
+        return true;
+      }
+      t = tail.load(std::memory_order_relaxed);
+    }
+  }
+
+  //unblocks a producer waiting on a consumer that has gone away
+  void Close(void) {closed.store(true, std::memory_order_relaxed);}
+
+  size_t Size(void) const
+  {
+    return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+  }
+
+  size_t Capacity(void) const {return mask + 1;}
+  uint64_t Dropped(void) const {return dropped.load(std::memory_order_relaxed);}
+  OverflowPolicy Policy(void) const {return policy;}
+
+private:
+  std::vector<T> items;
+  std::unique_ptr<std::atomic<uint64_t>[]> sequence;   //DropOldest only; see above
+  size_t mask;
+  OverflowPolicy policy;
+
+  //head and tail on their own cache lines, so the two threads don't fight over them
+  alignas(64) std::atomic<uint64_t> head{0};
+  alignas(64) std::atomic<uint64_t> tail{0};
+  alignas(64) std::atomic<uint64_t> dropped{0};
+  std::atomic<bool> closed{false};
+};
+
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+/*
+ * Incremental parser for the device's serial output.
+ *
+ * Bytes can be fed in whatever chunks they arrive in; each complete record is handed to the
+ * callback as a Sample. Records are lines of tab-separated integer and fixed-point fields
+ * (see RecordWriter in the firmware); the kind is inferred from the number of fields. A range
+ * record from a build with several sensors (SONAR_PAIR) has the sensor's index as a fifth
+ * field; otherwise the sensor is 0. Lines
+ * starting with '#' (metadata like "#scan") go to the metadata callback, if there is one, and
+ * anything else that doesn't parse (e.g., "setup") is counted and dropped. A "#lat" line
+ * (SONAR_TRACE) is also attached to the record that follows it.
+ *
+ * Parsing is hand-rolled (no strtod/sscanf, no allocation per line), since it runs once for
+ * every sample no matter how many consumers there are.
+ */
+
+#include "sonar/sample.h"
+
+#include <cstddef>
+#include <functional>
+#include <string>
+
+namespace sonar
+{
+
+class StreamParser
+{
+public:
+  using SampleCallback = std::function<void(const Sample&)>;
+  using MetadataCallback = std::function<void(const char* line, size_t length)>;
+
+  explicit StreamParser(SampleCallback onSample, MetadataCallback onMetadata = nullptr)
+    : onSample(std::move(onSample)), onMetadata(std::move(onMetadata)) {}
+
+  //feeds the next chunk of the stream; hostNanos is stamped on records completed in it
+  void Feed(const char* data, size_t length, uint64_t hostNanos);
+
+  uint64_t Records(void) const {return records;}
+  uint64_t Rejected(void) const {return rejected;}
+
+  //parses one line (without the newline); returns false if it isn't a record
+  static bool ParseLine(const char* line, size_t length, Sample& sample);
+
+  //parses a "#lat" line into the trace fields of sample; returns false if it isn't one
+  static bool ParseTrace(const char* line, size_t length, Sample& sample);
+
+private:
+  void Line(const char* line, size_t length, uint64_t hostNanos);
+
+  //drops a line that was too long to parse
+  void Discard(void)
+  {
+    rejected++;
+    trace.traced = false;
+  }
+
+  SampleCallback onSample;
+  MetadataCallback onMetadata;
+
+  static const size_t MAX_LINE = 256;
+  char partial[MAX_LINE];
+  size_t partialLength = 0;
+  bool overlong = false;
+
+  //the trace from a "#lat" line, for the next record
+  Sample trace;
+
+  uint64_t records = 0;
+  uint64_t rejected = 0;
+};
+
+}
@@ -0,0 +1,185 @@
+#pragma once
+
+/*
+ * Multi-target tracking: turns readings from all of a robot's sensors into persistent
+ * obstacle tracks, each with a position, a velocity, and their covariance.
+ *
+ * Each track is a constant-velocity Kalman filter in the world frame (x, y, vx, vy; mm and
+ * mm/s). A reading becomes a 2D measurement on its beam's axis whose covariance is tight
+ * along the beam and wide across it (range * tan(half-angle)), as in ScanMatcher. Readings
+ * are collected with Add() and folded in together by Step(), which:
+ *
+ *   1. predicts every track to the time of the newest reading; each reading is then compared
+ *      with where the track was when it was taken, not where it is now
+ *   2. gates: a reading can only belong to a track within the chi-square gate of it
+ *   3. splits the tracks and readings into clusters that share gates, so the association
+ *      below only ever works on a few at a time
+ *   4. associates, either
+ *        Assignment     global nearest neighbour: the Hungarian algorithm finds the pairing
+ *                       with the least total Mahalanobis distance, where a track may also be
+ *                       left out at the cost of the gate
+ *        Probabilistic  "cheap JPDA" (Fitzgerald): each track is updated with every reading
+ *                       in its gate, weighted by how likely it is to be the source given the
+ *                       other tracks competing for it, and the mixture collapsed back to one
+ *                       Gaussian
+ *   5. counts a miss for a track that a beam should have heard (inside the cone and nearer
+ *      than what the beam reported) but that got no reading, and drops tracks that miss too
+ *      often; a sonar only hears the nearest thing in its cone, so a track behind a nearer
+ *      echo isn't a miss. A confirmed track that misses is coasting until it's heard again
+ *   6. starts a tentative track at each reading that fell in no gate; it's confirmed after
+ *      enough hits. A reading at a confirmed track's range within two cone half-angles of
+ *      it starts nothing: a sonar can't place an obstacle across its beam, so that's most
+ *      likely the same obstacle heard by the next sensor along, off its own axis
+ *
+ * Everything is sized from the config up front: the track pool, the reading buffer, and all
+ * the association scratch. Add() and Step() never allocate, so one Tracker per robot can run
+ * at the full array rate, e.g. each in a WorkerPool job.
+ */
+
+#include "sonar/point_cloud.h"
+#include "sonar/sample.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace sonar
+{
+
+enum class Association : uint8_t
+{
+  Assignment,
+  Probabilistic,
+};
+
+struct TrackerConfig
+{
+  double beamHalfAngle = 0.26;        //radians; about 15 degrees for an HC-SR04
+  double rangeSigmaMM = 10;           //along the beam, plus...
+  double rangeSigmaFraction = 0.01;   //...this fraction of the range
+  double maxRangeMM = 4000;           //readings beyond this are no echo
+  double obstacleRadiusMM = 250;      //widens the cone: an obstacle is heard while any of it is in it
+
+  double accelSigma = 1500;           //mm/s^2, the process noise (people, other robots)
+  double initialSpeedSigma = 600;     //mm/s, for a new track's velocity
+  double gate = 13.8;                 //chi-square, 2 degrees of freedom (99.9%)
+
+  Association association = Association::Assignment;
+  double detectionProbability = 0.85; //Probabilistic only
+  double clutterDensity = 2e-7;       //false readings per mm^2, Probabilistic only
+
+  int confirmHits = 4;                //hits to confirm a tentative track
+  int maxMisses = 4;                  //consecutive misses to drop a confirmed (coasting) track
+  int maxTentativeMisses = 1;         //...and a tentative one
+  double missMarginMM = 150;          //a track must be this much nearer than the echo to miss
+  double maxPositionSigma = 800;      //mm; drop a track that's gone unseen this long
+
+  size_t maxTracks = 64;
+  size_t maxReadings = 64;            //per Step()
+};
+
+/*
+ * A reading in the world frame: the echo point and the beam it came from.
+ */
+struct Measurement
+{
+  double time = 0;                    //seconds
+  double x = 0, y = 0;                //mm; the echo, on the beam's axis
+  double originX = 0, originY = 0;    //the sensor
+  double heading = 0;                 //of the beam, radians
+  double range = 0;                   //mm; 0 for no echo (the cone is empty)
+  uint8_t sensor = 0;
+};
+
+/*
+ * Makes a world-frame measurement from a Range sample, given the sensor's mounting and the
+ * robot's pose at the time (see Odometry::At()). The beam's pitch is taken out of the range.
+ */
+Measurement MakeMeasurement(const Sample& sample, const SensorMount& mount, const Pose2D& robot);
+
+enum class TrackStatus : uint8_t
+{
+  Tentative,
+  Confirmed,
+  Coasting,                           //confirmed, but missed since its last hit
+};
+
+struct Track
+{
+  uint32_t id = 0;
+  TrackStatus status = TrackStatus::Tentative;
+  double x[4] = {};                   //x, y, vx, vy
+  double P[16] = {};                  //row-major covariance
+  double time = 0;                    //seconds; when the state is for
+  int hits = 0;
+  int misses = 0;                     //consecutive
+};
+
+class Tracker
+{
+public:
+  explicit Tracker(const TrackerConfig& config = TrackerConfig());
+
+  //queues a reading for the next Step(); returns false (and counts it) if the buffer is full
+  bool Add(const Measurement& m);
+
+  //folds in the queued readings and clears them
+  void Step(void);
+
+  //the live tracks, tentative and confirmed; valid until the next Step()
+  const Track* Tracks(void) const {return tracks.data();}
+  size_t TrackCount(void) const {return trackCount;}
+
+  uint64_t DroppedReadings(void) const {return droppedReadings;}
+  uint64_t DroppedTracks(void) const {return droppedTracks;}  //births with the pool full
+
+  const TrackerConfig& Config(void) const {return config;}
+
+private:
+  void Predict(Track& t, double time) const;
+  void MeasurementCovariance(const Measurement& m, double R[4]) const;
+  void Correct(const Track& t, const Measurement& m, double x[4], double P[16]) const;
+  double Distance(const Track& t, const Measurement& m, double& det) const;
+  void Gate(size_t track, size_t reading);
+  uint32_t Find(uint32_t node);
+  void Cluster(void);
+  void AssignCluster(size_t cluster);
+  void WeighCluster(size_t cluster);
+  bool ShouldHaveHeard(const Track& t) const;
+  bool Explained(const Measurement& m) const;
+  void Manage(void);
+  void Birth(const Measurement& m);
+
+  TrackerConfig config;
+  uint32_t nextId = 1;
+
+  std::vector<Track> tracks;
+  size_t trackCount = 0;
+
+  std::vector<Measurement> readings;
+  size_t readingCount = 0;
+
+  //per (track, reading) pair, row-major over maxReadings: gated, and if so the squared
+  //Mahalanobis distance and the likelihood
+  std::vector<uint8_t> gated;
+  std::vector<double> distance, likelihood;
+
+  //union-find over tracks (first) and readings, then each cluster's members
+  std::vector<uint32_t> parent;
+  std::vector<uint32_t> clusterOf, clusterTracks, clusterReadings;
+  std::vector<uint32_t> clusterTrackStart, clusterReadingStart;
+  size_t clusterCount = 0;
+
+  //per track/reading: updated this step, and in some track's gate
+  std::vector<uint8_t> updated, used;
+
+  //Hungarian scratch, for up to maxTracks rows and maxReadings + maxTracks columns
+  std::vector<double> hungarianCost, u, v, minv;
+  std::vector<int> p, way;
+  std::vector<uint8_t> seen;
+
+  uint64_t droppedReadings = 0;
+  uint64_t droppedTracks = 0;
+};
+
+}
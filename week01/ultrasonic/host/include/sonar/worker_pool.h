@@ -0,0 +1,55 @@
+#pragma once
+
+/*
+ * A fixed set of worker threads for splitting a loop across cores.
+ *
+ * Run() can be called from several threads at once (e.g., one per robot), and the calling
+ * thread works on its own loop too, so a pool with no workers just runs everything inline.
+ *
+ *   sonar::WorkerPool pool;
+ *   pool.Run(chunks, [&](size_t i) {... work on chunk i ...});
+ */
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sonar
+{
+
+class WorkerPool
+{
+public:
+  //by default, one worker per core besides the caller's
+  explicit WorkerPool(unsigned threads = DefaultThreads());
+  ~WorkerPool(void);
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  //calls fn(i) for every i in [0, n) and returns once they have all finished
+  void Run(size_t n, const std::function<void(size_t)>& fn);
+
+  unsigned Threads(void) const {return workers.size();}
+
+  static unsigned DefaultThreads(void);
+
+private:
+  struct Job;
+
+  void Worker(void);
+  static void Work(Job& job);
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::deque<std::shared_ptr<Job>> jobs;
+  bool stopping = false;
+  std::vector<std::thread> workers;
+};
+
+}
@@ -0,0 +1,114 @@
+#include "sonar/clock_sync.h"
+
+#include <algorithm>
+
+namespace sonar
+{
+
+//only fit the drift once the exchanges span this much device time (us); before that, the
+//round-trip noise swamps it
+static const int64_t MIN_DRIFT_SPAN = 5000000;
+
+//exchanges within this much (ns) of the fastest round trip count as fast ones
+static const uint64_t FAST_SLACK = 500000;
+
+void ClockSync::Request(uint64_t hostNanos)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  requestNanos = hostNanos;
+  pending = true;
+}
+
+bool ClockSync::Reply(uint32_t deviceMicros, uint64_t hostNanos)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  if(!pending || hostNanos < requestNanos) return false;
+  pending = false;
+
+  //unwrap relative to the last reply
+  int64_t device = exchanges.empty() ? deviceMicros
+                                     : lastDevice + int32_t(deviceMicros - uint32_t(lastDevice));
+  lastDevice = device;
+
+  uint64_t roundTrip = hostNanos - requestNanos;
+  exchanges.push_back({device, requestNanos + roundTrip / 2.0, roundTrip});
+  if(exchanges.size() > window) exchanges.pop_front();
+
+  Fit();
+  return true;
+}
+
+void ClockSync::Fit(void)
+{
+  uint64_t fastest = UINT64_MAX;
+  for(const Exchange& e : exchanges) fastest = std::min(fastest, e.roundTrip);
+  uint64_t limit = fastest + std::max(FAST_SLACK, fastest / 2);
+
+  //least squares of host time on device time, centered on the first fast exchange to keep
+  //the sums small
+  const Exchange* origin = nullptr;
+  double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+  int64_t minDevice = INT64_MAX, maxDevice = INT64_MIN;
+  for(const Exchange& e : exchanges)
+  {
+    if(e.roundTrip > limit) continue;
+    if(!origin) origin = &e;
+
+    double x = e.deviceMicros - origin->deviceMicros;
+    double y = e.hostNanos - origin->hostNanos;
+    n++;
+    sx += x;
+    sy += y;
+    sxx += x * x;
+    sxy += x * y;
+    minDevice = std::min(minDevice, e.deviceMicros);
+    maxDevice = std::max(maxDevice, e.deviceMicros);
+  }
+
+  double slope = 1000;
+  double denominator = n * sxx - sx * sx;
+  if(maxDevice - minDevice >= MIN_DRIFT_SPAN && denominator > 0)
+  {
+    slope = (n * sxy - sx * sy) / denominator;
+  }
+
+  //the line goes through the mean of the fast exchanges
+  deviceAt = origin->deviceMicros;
+  hostAt = origin->hostNanos + (sy - slope * sx) / n;
+  nanosPerMicro = slope;
+  bestRoundTrip = fastest;
+  synced = true;
+}
+
+bool ClockSync::Pending(void) const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return pending;
+}
+
+bool ClockSync::Synced(void) const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return synced;
+}
+
+int64_t ClockSync::ToHostNanos(uint32_t deviceMicros) const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  int64_t device = lastDevice + int32_t(deviceMicros - uint32_t(lastDevice));
+  return int64_t(hostAt + nanosPerMicro * (device - deviceAt));
+}
+
+uint64_t ClockSync::BestRoundTripNanos(void) const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return bestRoundTrip;
+}
+
+double ClockSync::DriftPPM(void) const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return (1000 / nanosPerMicro - 1) * 1e6;
+}
+
+}
@@ -0,0 +1,207 @@
+#include "sonar/cloud_output.h"
+
+#include <cstring>
+#include <new>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace sonar
+{
+
+//the header is padded to the same size whatever the counts are, so Close() can rewrite it in
+//place; the padding goes in a comment, since not every reader copes with zero-padded numbers
+static const int COUNT_WIDTH = 12;
+
+CloudFile::Format CloudFile::FormatFor(const std::string& path)
+{
+  size_t dot = path.rfind('.');
+  return dot != std::string::npos && path.compare(dot, std::string::npos, ".pcd") == 0 
+         ? Format::Pcd : Format::Ply;
+}
+
+bool CloudFile::Open(const std::string& path, Format format)
+{
+  Close();
+  file = fopen(path.c_str(), "wb");
+  if(!file) return false;
+
+  this->format = format;
+  points = 0;
+  WriteHeader();
+  return true;
+}
+
+void CloudFile::WriteHeader(void)
+{
+  char count[24];
+  int digits = snprintf(count, sizeof(count), "%llu", (unsigned long long)points);
+
+  if(format == Format::Ply)
+  {
+    fprintf(file, "ply\nformat binary_little_endian 1.0\ncomment sonar ranges, mm\n"
+                  "element vertex %s\n"
+                  "property float x\nproperty float y\nproperty float z\n"
+                  "property float range\nproperty uchar sensor\n"
+                  "comment%*s\nend_header\n", count, COUNT_WIDTH - digits, "");
+  }
+  else
+  {
+    fprintf(file, "# .PCD v0.7 - sonar ranges, mm\nVERSION 0.7\nFIELDS x y z range sensor\n"
+                  "SIZE 4 4 4 4 1\nTYPE F F F F U\nCOUNT 1 1 1 1 1\n"
+                  "WIDTH %s\nHEIGHT 1\nVIEWPOINT 0 0 0 1 0 0 0\nPOINTS %s\n"
+                  "#%*s\nDATA binary\n", count, count, 2 * (COUNT_WIDTH - digits), "");
+  }
+}
+
+void CloudFile::Write(const PointBatch& batch)
+{
+  if(!file) return;
+
+  //both formats want the fields interleaved per point (x86 and ARM are both little-endian)
+  unsigned char record[17];
+  for(size_t i = 0; i < batch.Size(); i++)
+  {
+    memcpy(record, &batch.x[i], 4);
+    memcpy(record + 4, &batch.y[i], 4);
+    memcpy(record + 8, &batch.z[i], 4);
+    memcpy(record + 12, &batch.range[i], 4);
+    record[16] = batch.sensor[i];
+    fwrite(record, sizeof(record), 1, file);
+  }
+
+  points += batch.Size();
+}
+
+void CloudFile::Close(void)
+{
+  if(!file) return;
+
+  rewind(file);
+  WriteHeader();
+  fclose(file);
+  file = nullptr;
+}
+
+SharedCloud::~SharedCloud(void)
+{
+  if(header) munmap(header, bytes);
+}
+
+bool SharedCloud::Create(const std::string& name, uint32_t capacity)
+{
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) return false;
+
+  bytes = sizeof(SharedCloudHeader) + capacity * sizeof(SharedCloudPoint);
+  void* p = MAP_FAILED;
+  if(ftruncate(fd, bytes) == 0) p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(p == MAP_FAILED) return false;
+
+  this->name = name;
+  header = new(p) SharedCloudHeader;
+  header->capacity = capacity;
+  header->sequence.store(0);
+  header->head.store(0);
+
+  //readers check this last
+  std::atomic_thread_fence(std::memory_order_release);
+  header->magic = SharedCloudHeader::MAGIC;
+  return true;
+}
+
+bool SharedCloud::Attach(const std::string& name)
+{
+  int fd = shm_open(name.c_str(), O_RDWR, 0);
+  if(fd < 0) return false;
+
+  struct stat st;
+  void* p = MAP_FAILED;
+  if(fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(SharedCloudHeader))
+  {
+    p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if(p == MAP_FAILED) return false;
+
+  header = static_cast<SharedCloudHeader*>(p);
+  bytes = st.st_size;
+  if(header->magic != SharedCloudHeader::MAGIC ||
+     bytes < sizeof(SharedCloudHeader) + header->capacity * sizeof(SharedCloudPoint))
+  {
+    munmap(header, bytes);
+    header = nullptr;
+    return false;
+  }
+
+  this->name = name;
+  return true;
+}
+
+void SharedCloud::Write(const PointBatch& batch)
+{
+  if(!header || !header->capacity) return;
+
+  uint64_t seq = header->sequence.load(std::memory_order_relaxed);
+  header->sequence.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  uint64_t head = header->head.load(std::memory_order_relaxed);
+  SharedCloudPoint* ring = header->Points();
+  for(size_t i = 0; i < batch.Size(); i++)
+  {
+    SharedCloudPoint& p = ring[(head + i) % header->capacity];
+    p.x = batch.x[i];
+    p.y = batch.y[i];
+    p.z = batch.z[i];
+    p.range = batch.range[i];
+    p.deviceMillis = batch.deviceMillis[i];
+    p.sensor = batch.sensor[i];
+  }
+
+  header->head.store(head + batch.Size(), std::memory_order_relaxed);
+  header->sequence.store(seq + 2, std::memory_order_release);
+}
+
+size_t SharedCloud::Read(uint64_t& since, SharedCloudPoint* out, size_t max)
+{
+  if(!header) return 0;
+
+  for(;;)
+  {
+    uint64_t seq = header->sequence.load(std::memory_order_acquire);
+    if(seq & 1)
+    {
+      std::this_thread::yield();
+      continue;
+    }
+
+    uint64_t head = header->head.load(std::memory_order_relaxed);
+    uint64_t first = since;
+    uint64_t oldest = head > header->capacity ? head - header->capacity : 0;
+    if(first < oldest) first = oldest;
+    if(head - first > max) first = head - max;
+
+    size_t n = head - first;
+    SharedCloudPoint* ring = header->Points();
+    for(size_t i = 0; i < n; i++) out[i] = ring[(first + i) % header->capacity];
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if(header->sequence.load(std::memory_order_relaxed) == seq)
+    {
+      since = head;
+      return n;
+    }
+  }
+}
+
+void SharedCloud::Unlink(void)
+{
+  if(!name.empty()) shm_unlink(name.c_str());
+}
+
+}
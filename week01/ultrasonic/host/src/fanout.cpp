@@ -0,0 +1,54 @@
+#include "sonar/fanout.h"
+
+#include <chrono>
+#include <thread>
+
+namespace sonar
+{
+
+uint64_t NowNanos(void)
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool Subscription::Wait(Sample& sample)
+{
+  for(unsigned spins = 0;; spins++)
+  {
+    if(ring.Pop(sample)) return true;
+
+    //check for the end after the ring, so that we don't miss the last few samples
+    if(ended.load(std::memory_order_acquire)) return ring.Pop(sample);
+
+    if(spins < 64) std::this_thread::yield();
+    else std::this_thread::sleep_for(std::chrono::microseconds(200));
+  }
+}
+
+Fanout::Fanout(StreamParser::MetadataCallback onMetadata)
+  : parser([this](const Sample& sample) {Publish(sample);}, std::move(onMetadata))
+{
+}
+
+Subscription* Fanout::Subscribe(const std::string& name, size_t capacity, OverflowPolicy policy)
+{
+  subscriptions.emplace_back(new Subscription(name, capacity, policy));
+  return subscriptions.back().get();
+}
+
+void Fanout::Publish(const Sample& sample)
+{
+  for(auto& subscription : subscriptions) subscription->ring.Push(sample);
+}
+
+void Fanout::End(void)
+{
+  for(auto& subscription : subscriptions)
+  {
+    subscription->ended.store(true, std::memory_order_release);
+    subscription->ring.Close();
+  }
+}
+
+}
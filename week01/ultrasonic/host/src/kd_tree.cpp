@@ -0,0 +1,153 @@
+#include "sonar/kd_tree.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace sonar
+{
+
+struct KdTree2D::Query
+{
+  float x, y;
+  size_t k;
+  size_t found;
+  float worst;              //squared distance a point has to beat to get in
+  uint32_t* indices;
+  float* distance2;
+
+  void Offer(uint32_t i, float d2)
+  {
+    if(d2 >= worst) return;
+
+    //insertion into the short sorted list
+    size_t j = found < k ? found++ : k - 1;
+    while(j > 0 && distance2[j - 1] > d2)
+    {
+      distance2[j] = distance2[j - 1];
+      indices[j] = indices[j - 1];
+      j--;
+    }
+    distance2[j] = d2;
+    indices[j] = i;
+
+    if(found == k) worst = distance2[k - 1];
+  }
+};
+
+//partitions [lo, hi) about its midpoint on the wider axis
+void KdTree2D::Split(size_t lo, size_t hi, const float* x, const float* y)
+{
+  float minX = INFINITY, maxX = -INFINITY, minY = INFINITY, maxY = -INFINITY;
+  for(size_t i = lo; i < hi; i++)
+  {
+    minX = std::min(minX, x[index[i]]);
+    maxX = std::max(maxX, x[index[i]]);
+    minY = std::min(minY, y[index[i]]);
+    maxY = std::max(maxY, y[index[i]]);
+  }
+
+  size_t mid = (lo + hi) / 2;
+  uint8_t a = (maxX - minX) >= (maxY - minY) ? 0 : 1;
+  const float* v = a == 0 ? x : y;
+  axis[mid] = a;
+
+  std::nth_element(index.begin() + lo, index.begin() + mid, index.begin() + hi,
+                   [v](uint32_t i, uint32_t j) {return v[i] < v[j];});
+
+  //building the right half reorders it, so the value at mid has to be kept separately
+  split[mid] = v[index[mid]];
+}
+
+void KdTree2D::BuildRange(size_t lo, size_t hi, const float* x, const float* y)
+{
+  if(hi - lo <= LEAF_SIZE) return;
+
+  Split(lo, hi, x, y);
+  size_t mid = (lo + hi) / 2;
+  BuildRange(lo, mid, x, y);
+  BuildRange(mid, hi, x, y);
+}
+
+void KdTree2D::Build(const float* x, const float* y, size_t n, WorkerPool* pool)
+{
+  index.resize(n);
+  axis.assign(n, 0);
+  split.assign(n, 0);
+  for(size_t i = 0; i < n; i++) index[i] = i;
+
+  //split the top levels here until there's a subtree for every thread, then build those
+  //in parallel; small trees aren't worth handing out
+  std::vector<Range> ranges{{0, n}};
+  size_t wanted = pool && n > 4096 ? 2 * (pool->Threads() + 1) : 1;
+  while(ranges.size() < wanted)
+  {
+    std::vector<Range> next;
+    for(const Range& r : ranges)
+    {
+      if(r.hi - r.lo <= LEAF_SIZE)
+      {
+        next.push_back(r);
+        continue;
+      }
+
+      Split(r.lo, r.hi, x, y);
+      size_t mid = (r.lo + r.hi) / 2;
+      next.push_back({r.lo, mid});
+      next.push_back({mid, r.hi});
+    }
+    ranges.swap(next);
+  }
+
+  if(ranges.size() > 1)
+  {
+    pool->Run(ranges.size(), [&](size_t i) {BuildRange(ranges[i].lo, ranges[i].hi, x, y);});
+  }
+  else BuildRange(0, n, x, y);
+
+  px.resize(n);
+  py.resize(n);
+  for(size_t i = 0; i < n; i++)
+  {
+    px[i] = x[index[i]];
+    py[i] = y[index[i]];
+  }
+}
+
+void KdTree2D::Search(size_t lo, size_t hi, Query& q) const
+{
+  if(hi - lo <= LEAF_SIZE)
+  {
+    for(size_t i = lo; i < hi; i++)
+    {
+      float dx = px[i] - q.x, dy = py[i] - q.y;
+      q.Offer(index[i], dx * dx + dy * dy);
+    }
+    return;
+  }
+
+  //everything left of mid is <= the split value, everything from mid on is >=
+  size_t mid = (lo + hi) / 2;
+  float diff = (axis[mid] == 0 ? q.x : q.y) - split[mid];
+
+  if(diff < 0)
+  {
+    Search(lo, mid, q);
+    if(diff * diff < q.worst) Search(mid, hi, q);
+  }
+  else
+  {
+    Search(mid, hi, q);
+    if(diff * diff < q.worst) Search(lo, mid, q);
+  }
+}
+
+size_t KdTree2D::Nearest(float x, float y, size_t k, float maxDistance, uint32_t* indices, float* distance2) const
+{
+  if(!k || index.empty()) return 0;
+
+  Query q{x, y, k, 0, maxDistance * maxDistance, indices, distance2};
+  Search(0, index.size(), q);
+  return q.found;
+}
+
+}
@@ -0,0 +1,129 @@
+#include "sonar/latency_trace.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace sonar
+{
+
+int LatencyHistogram::Bucket(uint64_t nanos)
+{
+  if(nanos < SUB_BUCKETS) return nanos;
+
+  //the octave, and the next two bits below the top one
+  int octave = 63 - __builtin_clzll(nanos);
+  int sub = (nanos >> (octave - 2)) & (SUB_BUCKETS - 1);
+  return std::min((octave - 1) * SUB_BUCKETS + sub, BUCKETS - 1);
+}
+
+double LatencyHistogram::BucketMiddle(int bucket)
+{
+  if(bucket < SUB_BUCKETS) return bucket;
+
+  int octave = bucket / SUB_BUCKETS + 1;
+  int sub = bucket % SUB_BUCKETS;
+  double low = std::ldexp(SUB_BUCKETS + sub, octave - 2);
+  return low + std::ldexp(0.5, octave - 2);
+}
+
+void LatencyHistogram::Add(int64_t nanos)
+{
+  if(nanos < 0) negative++;
+
+  buckets[Bucket(nanos < 0 ? 0 : nanos)]++;
+  count++;
+  min = std::min(min, nanos);
+  max = std::max(max, nanos);
+  sum += nanos;
+}
+
+double LatencyHistogram::Percentile(double q) const
+{
+  if(!count) return 0;
+
+  //the rank'th smallest time, clamped to what was actually seen
+  uint64_t rank = std::min<uint64_t>(count - 1, uint64_t(q * count));
+  uint64_t seen = 0;
+  for(int i = 0; i < BUCKETS; i++)
+  {
+    seen += buckets[i];
+    if(seen > rank) return std::max<double>(min, std::min<double>(max, BucketMiddle(i)));
+  }
+  return max;
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram& other)
+{
+  for(int i = 0; i < BUCKETS; i++) buckets[i] += other.buckets[i];
+  count += other.count;
+  negative += other.negative;
+  min = std::min(min, other.min);
+  max = std::max(max, other.max);
+  sum += other.sum;
+}
+
+const char* LatencyStageName(LatencyStage stage)
+{
+  switch(stage)
+  {
+    case LatencyStage::CaptureToReady: return "capture->ready";
+    case LatencyStage::ReadyToSent: return "ready->sent";
+    case LatencyStage::SentToReceived: return "sent->received";
+    case LatencyStage::ReceivedToConsumed: return "received->consumed";
+    case LatencyStage::Total: return "total";
+    default: return "?";
+  }
+}
+
+void LatencyTrace::Add(const Sample& sample, uint64_t consumedNanos)
+{
+  if(!sample.traced) return;
+
+  //device micros() wrap, so take the differences in 32 bits
+  int64_t capture = int64_t(uint32_t(sample.readyMicros - sample.captureMicros)) * 1000;
+  int64_t ready = int64_t(uint32_t(sample.sentMicros - sample.readyMicros)) * 1000;
+  int64_t consumed = int64_t(consumedNanos - sample.hostNanos);
+
+  bool synced = sync && sync->Synced();
+  int64_t sentHost = synced ? sync->ToHostNanos(sample.sentMicros) : 0;
+  int64_t captureHost = synced ? sync->ToHostNanos(sample.captureMicros) : 0;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  stages[size_t(LatencyStage::CaptureToReady)].Add(capture);
+  stages[size_t(LatencyStage::ReadyToSent)].Add(ready);
+  stages[size_t(LatencyStage::ReceivedToConsumed)].Add(consumed);
+  if(synced)
+  {
+    stages[size_t(LatencyStage::SentToReceived)].Add(int64_t(sample.hostNanos) - sentHost);
+    stages[size_t(LatencyStage::Total)].Add(int64_t(consumedNanos) - captureHost);
+  }
+}
+
+LatencyHistogram LatencyTrace::Stage(LatencyStage stage) const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return stages[size_t(stage)];
+}
+
+void LatencyTrace::Print(FILE* out) const
+{
+  fprintf(out, "%-20s %8s %9s %9s %9s %9s %9s %9s %6s\n", "stage (us)", "count", "min", "mean",
+          "p50", "p90", "p99", "max", "neg");
+
+  for(size_t i = 0; i < size_t(LatencyStage::Count); i++)
+  {
+    LatencyHistogram h = Stage(LatencyStage(i));
+    fprintf(out, "%-20s %8llu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %6llu\n",
+            LatencyStageName(LatencyStage(i)), (unsigned long long)h.Count(), h.Min() / 1e3,
+            h.Mean() / 1e3, h.Percentile(0.5) / 1e3, h.Percentile(0.9) / 1e3,
+            h.Percentile(0.99) / 1e3, h.Max() / 1e3, (unsigned long long)h.Negative());
+  }
+}
+
+void LatencyTrace::Reset(void)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  for(LatencyHistogram& h : stages) h = LatencyHistogram();
+}
+
+}
@@ -0,0 +1,72 @@
+#include "sonar/lttb.h"
+
+namespace sonar
+{
+
+size_t LttbSelect(const double* x, const double* y, size_t n, size_t threshold, uint32_t* out)
+{
+  if(threshold >= n)
+  {
+    for(size_t i = 0; i < n; i++) out[i] = i;
+    return n;
+  }
+
+  if(n == 0) return 0;
+  if(threshold < 3)
+  {
+    out[0] = 0;
+    if(n == 1) return 1;
+    out[1] = n - 1;
+    return 2;
+  }
+
+  //the first and last points are kept as they are; the rest go into threshold - 2 buckets
+  double every = (double)(n - 2) / (threshold - 2);
+  size_t kept = 0;
+  size_t a = 0;
+  out[kept++] = 0;
+
+  for(size_t bucket = 0; bucket < threshold - 2; bucket++)
+  {
+    size_t start = (size_t)(bucket * every) + 1;
+    size_t end = (size_t)((bucket + 1) * every) + 1;
+
+    //the mean of the next bucket (the last point, for the last bucket)
+    size_t nextStart = end;
+    size_t nextEnd = (size_t)((bucket + 2) * every) + 1;
+    if(nextEnd > n) nextEnd = n;
+    if(nextStart >= nextEnd) nextStart = nextEnd - 1;
+
+    double meanX = 0, meanY = 0;
+    for(size_t i = nextStart; i < nextEnd; i++)
+    {
+      meanX += x[i];
+      meanY += y[i];
+    }
+    meanX /= nextEnd - nextStart;
+    meanY /= nextEnd - nextStart;
+
+    //twice the triangle's area; the factor doesn't change which is largest
+    double ax = x[a], ay = y[a];
+    double best = -1;
+    size_t chosen = start;
+    for(size_t i = start; i < end; i++)
+    {
+      double area = (ax - meanX) * (y[i] - ay) - (ax - x[i]) * (meanY - ay);
+      if(area < 0) area = -area;
+      if(area > best)
+      {
+        best = area;
+        chosen = i;
+      }
+    }
+
+    out[kept++] = chosen;
+    a = chosen;
+  }
+
+  out[kept++] = n - 1;
+  return kept;
+}
+
+}
@@ -0,0 +1,297 @@
+#include "sonar/point_cloud.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+namespace sonar
+{
+
+namespace
+{
+
+const double DEGREES = M_PI / 180.0;
+
+//four floats: one SSE register on x86-64, one NEON register on ARM
+typedef float Float4 __attribute__((vector_size(16)));
+
+inline Float4 Load4(const float* p)
+{
+  Float4 v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline void Store4(float* p, Float4 v)
+{
+  memcpy(p, &v, sizeof(v));
+}
+
+}
+
+void MountingTable::Set(uint8_t sensor, const SensorMount& mount)
+{
+  if(sensor >= mounts.size())
+  {
+    mounts.resize(sensor + 1);
+    present.resize(sensor + 1, false);
+  }
+
+  mounts[sensor] = mount;
+  present[sensor] = true;
+}
+
+const SensorMount* MountingTable::Find(uint8_t sensor) const
+{
+  return sensor < mounts.size() && present[sensor] ? &mounts[sensor] : nullptr;
+}
+
+bool MountingTable::Load(const std::string& path)
+{
+  std::ifstream in(path);
+  if(!in) return false;
+
+  std::string line;
+  while(std::getline(in, line))
+  {
+    size_t start = line.find_first_not_of(" \t\r");
+    if(start == std::string::npos || line[start] == '#') continue;
+
+    std::istringstream row(line);
+    int sensor;
+    SensorMount mount;
+    if(!(row >> sensor >> mount.x >> mount.y >> mount.z >> mount.yaw >> mount.pitch)) return false;
+    if(sensor < 0 || sensor > 255) return false;
+
+    mount.yaw *= DEGREES;
+    mount.pitch *= DEGREES;
+    Set(sensor, mount);
+  }
+
+  return true;
+}
+
+void Odometry::Add(uint32_t deviceMillis, const Pose2D& pose)
+{
+  times.push_back(deviceMillis);
+  poses.push_back(pose);
+}
+
+bool Odometry::At(uint32_t deviceMillis, Pose2D& pose) const
+{
+  if(poses.empty()) return false;
+
+  //before the first pose we don't know where the robot was
+  auto it = std::upper_bound(times.begin(), times.end(), deviceMillis);
+  if(it == times.begin()) return false;
+  if(it == times.end())
+  {
+    pose = poses.back();
+    return true;
+  }
+
+  size_t i = it - times.begin();
+  const Pose2D& a = poses[i - 1];
+  const Pose2D& b = poses[i];
+  double f = double(deviceMillis - times[i - 1]) / double(times[i] - times[i - 1]);
+
+  //interpolate the heading the short way around
+  double dTheta = std::remainder(b.theta - a.theta, 2 * M_PI);
+  pose.x = a.x + f * (b.x - a.x);
+  pose.y = a.y + f * (b.y - a.y);
+  pose.theta = a.theta + f * dTheta;
+  return true;
+}
+
+void Odometry::Trim(uint32_t deviceMillis)
+{
+  auto it = std::upper_bound(times.begin(), times.end(), deviceMillis);
+  if(it == times.begin()) return;
+
+  size_t keepFrom = (it - times.begin()) - 1;
+  times.erase(times.begin(), times.begin() + keepFrom);
+  poses.erase(poses.begin(), poses.begin() + keepFrom);
+}
+
+bool Odometry::Load(const std::string& path)
+{
+  FILE* f = fopen(path.c_str(), "r");
+  if(!f) return false;
+
+  char line[256];
+  while(fgets(line, sizeof(line), f))
+  {
+    unsigned long t;
+    Pose2D pose;
+    if(sscanf(line, "%lu,%lf,%lf,%lf", &t, &pose.x, &pose.y, &pose.theta) == 4) Add(t, pose);
+  }
+
+  fclose(f);
+  return true;
+}
+
+void PointBatch::Clear(void)
+{
+  Resize(0);
+}
+
+void PointBatch::Resize(size_t n)
+{
+  x.resize(n);
+  y.resize(n);
+  z.resize(n);
+  range.resize(n);
+  sensor.resize(n);
+  deviceMillis.resize(n);
+}
+
+bool CloudBuilder::Add(const Sample& sample)
+{
+  if(sample.kind == SampleKind::Window) return false;
+
+  float r = sample.distanceMM10 / 10.0f;
+  if(r <= 0 || r > maxRangeMM) return false;
+
+  const SensorMount* mount = mounts.Find(sample.sensor);
+  if(!mount) return false;
+
+  float yaw = mount->yaw;
+  if(sample.kind == SampleKind::ScanPoint) yaw += sample.angle * DEGREES;
+
+  //pitch is positive down, so it points the beam toward -z
+  float cosPitch = std::cos(mount->pitch);
+  range.push_back(r);
+  dirX.push_back(std::cos(yaw) * cosPitch);
+  dirY.push_back(std::sin(yaw) * cosPitch);
+  dirZ.push_back(-std::sin(mount->pitch));
+  originX.push_back(mount->x);
+  originY.push_back(mount->y);
+  originZ.push_back(mount->z);
+  sensors.push_back(sample.sensor);
+  times.push_back(sample.deviceMillis);
+  return true;
+}
+
+void BeamToPoints(size_t n, const float* range, const float* dirX, const float* dirY, const float* dirZ,
+                  const float* originX, const float* originY, const float* originZ,
+                  float* x, float* y, float* z)
+{
+  size_t i = 0;
+  for(; i + 4 <= n; i += 4)
+  {
+    Float4 r = Load4(range + i);
+    Store4(x + i, Load4(originX + i) + r * Load4(dirX + i));
+    Store4(y + i, Load4(originY + i) + r * Load4(dirY + i));
+    Store4(z + i, Load4(originZ + i) + r * Load4(dirZ + i));
+  }
+
+  for(; i < n; i++)
+  {
+    x[i] = originX[i] + range[i] * dirX[i];
+    y[i] = originY[i] + range[i] * dirY[i];
+    z[i] = originZ[i] + range[i] * dirZ[i];
+  }
+}
+
+void RobotToWorld(size_t n, const float* x, const float* y, const float* poseX, const float* poseY,
+                  const float* cosTheta, const float* sinTheta, float* worldX, float* worldY)
+{
+  size_t i = 0;
+  for(; i + 4 <= n; i += 4)
+  {
+    Float4 px = Load4(x + i), py = Load4(y + i);
+    Float4 c = Load4(cosTheta + i), s = Load4(sinTheta + i);
+    Store4(worldX + i, Load4(poseX + i) + c * px - s * py);
+    Store4(worldY + i, Load4(poseY + i) + s * px + c * py);
+  }
+
+  for(; i < n; i++)
+  {
+    worldX[i] = poseX[i] + cosTheta[i] * x[i] - sinTheta[i] * y[i];
+    worldY[i] = poseY[i] + sinTheta[i] * x[i] + cosTheta[i] * y[i];
+  }
+}
+
+void CloudBuilder::Flush(PointBatch* robotFrame, PointBatch* worldFrame, const Odometry* odometry)
+{
+  size_t n = range.size();
+  if(!n) return;
+
+  //the robot-frame points go straight into the output if we have one, otherwise into scratch
+  PointBatch scratch;
+  PointBatch* robot = robotFrame ? robotFrame : &scratch;
+  size_t base = robot->Size();
+  robot->Resize(base + n);
+
+  BeamToPoints(n, range.data(), dirX.data(), dirY.data(), dirZ.data(), originX.data(), originY.data(), 
+               originZ.data(), robot->x.data() + base, robot->y.data() + base, robot->z.data() + base);
+  std::copy(range.begin(), range.end(), robot->range.begin() + base);
+  std::copy(sensors.begin(), sensors.end(), robot->sensor.begin() + base);
+  std::copy(times.begin(), times.end(), robot->deviceMillis.begin() + base);
+
+  if(worldFrame && odometry)
+  {
+    poseX.resize(n);
+    poseY.resize(n);
+    poseCos.resize(n);
+    poseSin.resize(n);
+    keep.resize(n);
+
+    /*
+     * Readings without a pose (no odometry yet, or from before the first pose) are left out
+     * of the world frame and counted, rather than placed as if the robot were at the origin.
+     * The rest are packed to the front of the robot-frame scratch, in order.
+     */
+    size_t posed = 0;
+    Pose2D pose;
+    uint32_t lastTime = 0;
+    bool looked = false, havePose = false;
+    for(size_t i = 0; i < n; i++)
+    {
+      //readings usually arrive in bursts at the same time, so only look up new times
+      if(!looked || times[i] != lastTime)
+      {
+        havePose = odometry->At(times[i], pose);
+        lastTime = times[i];
+        looked = true;
+      }
+      if(!havePose)
+      {
+        unposed++;
+        continue;
+      }
+
+      poseX[posed] = pose.x;
+      poseY[posed] = pose.y;
+      poseCos[posed] = std::cos(pose.theta);
+      poseSin[posed] = std::sin(pose.theta);
+      keep[posed++] = i;
+    }
+
+    size_t worldBase = worldFrame->Size();
+    worldFrame->Resize(worldBase + posed);
+    keptX.resize(posed);
+    keptY.resize(posed);
+    for(size_t j = 0; j < posed; j++)
+    {
+      size_t i = keep[j];
+      keptX[j] = robot->x[base + i];
+      keptY[j] = robot->y[base + i];
+      worldFrame->z[worldBase + j] = robot->z[base + i];
+      worldFrame->range[worldBase + j] = range[i];
+      worldFrame->sensor[worldBase + j] = sensors[i];
+      worldFrame->deviceMillis[worldBase + j] = times[i];
+    }
+    RobotToWorld(posed, keptX.data(), keptY.data(), poseX.data(), poseY.data(), poseCos.data(),
+                 poseSin.data(), worldFrame->x.data() + worldBase, worldFrame->y.data() + worldBase);
+  }
+
+  for(auto* v : {&range, &dirX, &dirY, &dirZ, &originX, &originY, &originZ}) v->clear();
+  sensors.clear();
+  times.clear();
+}
+
+}
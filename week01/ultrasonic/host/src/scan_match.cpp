@@ -0,0 +1,437 @@
+#include "sonar/scan_match.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace sonar
+{
+
+Pose2D Compose(const Pose2D& a, const Pose2D& b)
+{
+  double c = std::cos(a.theta), s = std::sin(a.theta);
+  Pose2D p;
+  p.x = a.x + c * b.x - s * b.y;
+  p.y = a.y + s * b.x + c * b.y;
+  p.theta = std::remainder(a.theta + b.theta, 2 * M_PI);
+  return p;
+}
+
+Pose2D Inverse(const Pose2D& a)
+{
+  double c = std::cos(a.theta), s = std::sin(a.theta);
+  Pose2D p;
+  p.x = -c * a.x - s * a.y;
+  p.y = s * a.x - c * a.y;
+  p.theta = -a.theta;
+  return p;
+}
+
+void Scan::Clear(void)
+{
+  for(auto* v : {&x, &y, &beamX, &beamY, &range, &lateralMM, &normalX, &normalY, &normalSigma}) v->clear();
+}
+
+void Scan::Add(float px, float py, float beamAngle, float r)
+{
+  x.push_back(px);
+  y.push_back(py);
+  beamX.push_back(std::cos(beamAngle));
+  beamY.push_back(std::sin(beamAngle));
+  range.push_back(r);
+  lateralMM.push_back(0);
+  normalX.push_back(0);
+  normalY.push_back(0);
+  normalSigma.push_back(0);
+}
+
+void Scan::Add(const PointBatch& robotFrame, const MountingTable& mounts)
+{
+  for(size_t i = 0; i < robotFrame.Size(); i++)
+  {
+    const SensorMount* mount = mounts.Find(robotFrame.sensor[i]);
+    if(!mount) continue;
+
+    float beam = std::atan2(robotFrame.y[i] - mount->y, robotFrame.x[i] - mount->x);
+    Add(robotFrame.x[i], robotFrame.y[i], beam, robotFrame.range[i]);
+  }
+}
+
+Scan Scan::ExtractArcs(float minWidth, float toleranceMM, float maxGap) const
+{
+  Scan out;
+  size_t n = Size();
+  size_t start = 0;
+
+  auto angleBetween = [this](size_t i, size_t j)
+  {
+    return std::atan2(beamX[i] * beamY[j] - beamY[i] * beamX[j], beamX[i] * beamX[j] + beamY[i] * beamY[j]);
+  };
+
+  auto copyPoint = [&](size_t i)
+  {
+    out.x.push_back(x[i]);
+    out.y.push_back(y[i]);
+    out.beamX.push_back(beamX[i]);
+    out.beamY.push_back(beamY[i]);
+    out.range.push_back(range[i]);
+    out.lateralMM.push_back(lateralMM[i]);
+    out.normalX.push_back(normalX[i]);
+    out.normalY.push_back(normalY[i]);
+    out.normalSigma.push_back(normalSigma[i]);
+  };
+
+  //[start, end) is a run of points with about the same range and no big gaps
+  for(size_t end = 1; end <= n; end++)
+  {
+    if(end < n && std::fabs(range[end] - range[end - 1]) <= toleranceMM && 
+       std::fabs(angleBetween(end - 1, end)) <= maxGap) continue;
+
+    float width = std::fabs(angleBetween(start, end - 1));
+    if(end - start >= 3 && width >= minWidth)
+    {
+      double sum = 0;
+      for(size_t i = start; i < end; i++) sum += range[i];
+      float r = sum / (end - start);
+
+      //the sensor is where the beams come from; the surface is at the arc's middle
+      float originX = x[start] - range[start] * beamX[start];
+      float originY = y[start] - range[start] * beamY[start];
+      float mid = std::atan2(beamY[start], beamX[start]) + angleBetween(start, end - 1) / 2;
+      float step = width / (end - start - 1);
+
+      out.Add(originX + r * std::cos(mid), originY + r * std::sin(mid), mid, r);
+      out.lateralMM.back() = r * step / 2;
+      out.normalX.back() = -std::cos(mid);
+      out.normalY.back() = -std::sin(mid);
+      out.normalSigma.back() = step / 2 + 0.02f;
+    }
+    else
+    {
+      for(size_t i = start; i < end; i++) copyPoint(i);
+    }
+
+    start = end;
+  }
+
+  return out;
+}
+
+void ScanMatcher::ParallelFor(size_t n, const std::function<void(size_t)>& fn) const
+{
+  size_t chunks = (n + config.chunk - 1) / config.chunk;
+  auto chunk = [&](size_t c)
+  {
+    size_t end = std::min(n, (c + 1) * config.chunk);
+    for(size_t i = c * config.chunk; i < end; i++) fn(i);
+  };
+
+  if(pool) pool->Run(chunks, chunk);
+  else for(size_t c = 0; c < chunks; c++) chunk(c);
+}
+
+void ScanMatcher::SetReference(const Scan& scan)
+{
+  reference = scan;
+  size_t n = scan.Size();
+  tree.Build(reference.x.data(), reference.y.data(), n, pool);
+  normalX.resize(n);
+  normalY.resize(n);
+  normalVariance.resize(n);
+
+  ParallelFor(n, [&](size_t i)
+  {
+    if(reference.normalSigma[i] > 0)
+    {
+      normalX[i] = reference.normalX[i];
+      normalY[i] = reference.normalY[i];
+      normalVariance[i] = 0;
+      return;
+    }
+
+    //at most 16 neighbours are used, whatever the config says
+    uint32_t near[16];
+    float d2[16];
+    size_t k = std::min<size_t>(config.normalNeighbours + 1, 16);
+    size_t found = tree.Nearest(reference.x[i], reference.y[i], k, config.normalRadiusMM, near, d2);
+
+    double sx = 0, sy = 0, sxx = 0, sxy = 0, syy = 0;
+    for(size_t j = 0; j < found; j++)
+    {
+      double px = reference.x[near[j]], py = reference.y[near[j]];
+      sx += px;
+      sy += py;
+      sxx += px * px;
+      sxy += px * py;
+      syy += py * py;
+    }
+
+    //the line is the covariance's major axis; the normal is the minor one
+    if(found >= 3)
+    {
+      double cxx = sxx / found - (sx / found) * (sx / found);
+      double cxy = sxy / found - (sx / found) * (sy / found);
+      double cyy = syy / found - (sy / found) * (sy / found);
+      double spread = std::sqrt((cxx - cyy) * (cxx - cyy) + 4 * cxy * cxy);
+      double major = (cxx + cyy + spread) / 2, minor = (cxx + cyy - spread) / 2;
+
+      //only if the neighbours really do lie on a line (which rules out corners)
+      if(major > 0 && minor <= config.lineToleranceMM * config.lineToleranceMM)
+      {
+        double angle = 0.5 * std::atan2(2 * cxy, cxx - cyy) + M_PI / 2;
+        normalX[i] = std::cos(angle);
+        normalY[i] = std::sin(angle);
+        normalVariance[i] = 0;
+        return;
+      }
+    }
+
+    //a guess, so it counts for less
+    normalX[i] = -reference.beamX[i];
+    normalY[i] = -reference.beamY[i];
+    normalVariance[i] = config.guessedNormalMM * config.guessedNormalMM;
+  });
+}
+
+namespace
+{
+
+struct Accumulator
+{
+  double h[3][3] = {};
+  double g[3] = {};
+  double squares = 0;
+  size_t pairs = 0;
+};
+
+//variance of a point's position along the normal, given its beam
+inline double NormalVariance(double nx, double ny, double bx, double by, double range, double lateral,
+                             double rangeSigma2, double tanHalfAngle)
+{
+  double along = nx * bx + ny * by;
+  double across = -nx * by + ny * bx;
+  double width = lateral > 0 ? lateral : range * tanHalfAngle;
+  return rangeSigma2 * along * along + width * width * across * across;
+}
+
+//solves the symmetric 3x3 system h x = b by Gaussian elimination; false if it's singular
+bool Solve3(double h[3][3], double b[3], double x[3])
+{
+  double a[3][4];
+  for(int r = 0; r < 3; r++)
+  {
+    for(int c = 0; c < 3; c++) a[r][c] = h[r][c];
+    a[r][3] = b[r];
+  }
+
+  for(int c = 0; c < 3; c++)
+  {
+    int pivot = c;
+    for(int r = c + 1; r < 3; r++) if(std::fabs(a[r][c]) > std::fabs(a[pivot][c])) pivot = r;
+    if(std::fabs(a[pivot][c]) < 1e-12) return false;
+    if(pivot != c) for(int k = 0; k < 4; k++) std::swap(a[c][k], a[pivot][k]);
+
+    for(int r = c + 1; r < 3; r++)
+    {
+      double f = a[r][c] / a[c][c];
+      for(int k = c; k < 4; k++) a[r][k] -= f * a[c][k];
+    }
+  }
+
+  for(int r = 2; r >= 0; r--)
+  {
+    double sum = a[r][3];
+    for(int c = r + 1; c < 3; c++) sum -= a[r][c] * x[c];
+    x[r] = sum / a[r][r];
+  }
+
+  return true;
+}
+
+}
+
+MatchResult ScanMatcher::Match(const Scan& scan, const Pose2D& guess) const
+{
+  MatchResult result;
+  result.pose = guess;
+  if(!HasReference() || !scan.Size()) return result;
+
+  size_t n = scan.Size();
+  size_t chunks = (n + config.chunk - 1) / config.chunk;
+  std::vector<Accumulator> partial(chunks);
+
+  double rangeSigma2 = config.rangeSigmaMM * config.rangeSigmaMM;
+  double tanHalfAngle = std::tan(config.beamHalfAngle);
+
+  Pose2D& pose = result.pose;
+  for(result.iterations = 1; result.iterations <= config.maxIterations; result.iterations++)
+  {
+    double c = std::cos(pose.theta), s = std::sin(pose.theta);
+
+    auto work = [&](size_t chunk)
+    {
+      Accumulator& acc = partial[chunk];
+      acc = Accumulator();
+      size_t end = std::min(n, (chunk + 1) * config.chunk);
+
+      for(size_t i = chunk * config.chunk; i < end; i++)
+      {
+        //the point and its beam, in the reference frame
+        double px = pose.x + c * scan.x[i] - s * scan.y[i];
+        double py = pose.y + s * scan.x[i] + c * scan.y[i];
+        double bx = c * scan.beamX[i] - s * scan.beamY[i];
+        double by = s * scan.beamX[i] + c * scan.beamY[i];
+
+        uint32_t j;
+        float d2;
+        if(!tree.Nearest(px, py, 1, config.maxPairMM, &j, &d2)) continue;
+
+        double nx = normalX[j], ny = normalY[j];
+        double e = nx * (px - reference.x[j]) + ny * (py - reference.y[j]);
+        double variance = 1.0 + normalVariance[j]
+          + NormalVariance(nx, ny, bx, by, scan.range[i], scan.lateralMM[i], rangeSigma2, tanHalfAngle)
+          + NormalVariance(nx, ny, reference.beamX[j], reference.beamY[j], reference.range[j], 
+                           reference.lateralMM[j], rangeSigma2, tanHalfAngle);
+        double w = 1 / variance;
+
+        //Tukey-style: beyond 3 sigma, a pair counts less and less, and not at all past 6
+        double sigmas = std::fabs(e) * std::sqrt(w);
+        if(sigmas > 6) continue;
+        if(sigmas > 3) w *= (6 - sigmas) / 3;
+
+        double jac[3] = {nx, ny, nx * -(py - pose.y) + ny * (px - pose.x)};
+        for(int r = 0; r < 3; r++)
+        {
+          for(int k = r; k < 3; k++) acc.h[r][k] += w * jac[r] * jac[k];
+          acc.g[r] += w * jac[r] * e;
+        }
+        acc.squares += e * e;
+        acc.pairs++;
+
+        //two surfaces with known normals: they should face the same way
+        if(scan.normalSigma[i] > 0 && reference.normalSigma[j] > 0)
+        {
+          double sx = c * scan.normalX[i] - s * scan.normalY[i];
+          double sy = s * scan.normalX[i] + c * scan.normalY[i];
+          double turn = std::atan2(nx * sy - ny * sx, nx * sx + ny * sy);
+          double sigma2 = scan.normalSigma[i] * scan.normalSigma[i] + 
+                          reference.normalSigma[j] * reference.normalSigma[j];
+
+          //much more than that and they're not the same surface
+          if(turn * turn < 9 * sigma2)
+          {
+            acc.h[2][2] += 1 / sigma2;
+            acc.g[2] += turn / sigma2;
+          }
+        }
+      }
+    };
+
+    if(pool) pool->Run(chunks, work);
+    else for(size_t i = 0; i < chunks; i++) work(i);
+
+    Accumulator total;
+    for(const Accumulator& acc : partial)
+    {
+      for(int r = 0; r < 3; r++)
+      {
+        for(int k = r; k < 3; k++) total.h[r][k] += acc.h[r][k];
+        total.g[r] += acc.g[r];
+      }
+      total.squares += acc.squares;
+      total.pairs += acc.pairs;
+    }
+
+    for(int r = 0; r < 3; r++) for(int k = 0; k < r; k++) total.h[r][k] = total.h[k][r];
+    std::copy(&total.h[0][0], &total.h[0][0] + 9, &result.information[0][0]);
+    result.pairs = total.pairs;
+    result.rmsMM = total.pairs ? std::sqrt(total.squares / total.pairs) : 0;
+    if(total.pairs < config.minPairs) return result;
+
+    //the guess as a prior, so directions the scans don't pin down stay where it put them
+    double prior[3] = {0, 0, 0};
+    if(config.priorSigmaMM > 0 && config.priorSigmaRadians > 0)
+    {
+      prior[0] = prior[1] = 1 / (config.priorSigmaMM * config.priorSigmaMM);
+      prior[2] = 1 / (config.priorSigmaRadians * config.priorSigmaRadians);
+    }
+
+    //plus a touch of damping, in case there's no prior
+    double damping = 1e-6 * (total.h[0][0] + total.h[1][1] + total.h[2][2]);
+    double offset[3] = {pose.x - guess.x, pose.y - guess.y, std::remainder(pose.theta - guess.theta, 2 * M_PI)};
+    for(int r = 0; r < 3; r++)
+    {
+      total.h[r][r] += prior[r] + damping;
+      total.g[r] += prior[r] * offset[r];
+    }
+
+    double step[3], rhs[3] = {-total.g[0], -total.g[1], -total.g[2]};
+    if(!Solve3(total.h, rhs, step)) return result;
+
+    pose.x += step[0];
+    pose.y += step[1];
+    pose.theta += step[2];
+
+    if(std::hypot(step[0], step[1]) < config.doneMM && std::fabs(step[2]) < config.doneRadians)
+    {
+      result.converged = true;
+      break;
+    }
+  }
+
+  result.iterations = std::min(result.iterations, config.maxIterations);
+  result.ok = true;
+  return result;
+}
+
+Pose2D DriftCorrector::Add(const Scan& scan, const Pose2D& odometry, MatchResult* result)
+{
+  Pose2D corrected = Correct(odometry);
+
+  if(matcher.HasReference())
+  {
+    Pose2D guess = Compose(Inverse(keyOdometry), odometry);
+    MatchResult match = matcher.Match(scan, guess);
+
+    //odometry is only a few percent out over the distance from the keyframe, so a match that
+    //disagrees with it by more than that has most likely locked onto the wrong surfaces
+    float allowedMM = maxCorrectionMM + maxCorrectionPerMM * std::hypot(guess.x, guess.y);
+    Pose2D disagreement = Compose(Inverse(guess), match.pose);
+    bool plausible = match.rmsMM <= maxResidualMM &&
+                     std::hypot(disagreement.x, disagreement.y) <= allowedMM &&
+                     std::fabs(disagreement.theta) <= maxCorrectionRadians;
+
+    if(match.ok && plausible)
+    {
+      //over one keyframe's distance the sonar pins down heading far better than the wheels
+      //do, but not position, so only part of the match's translation is taken
+      Pose2D blended{guess.x + translationGain * (match.pose.x - guess.x),
+                     guess.y + translationGain * (match.pose.y - guess.y), match.pose.theta};
+      corrected = Compose(keyCorrected, blended);
+      matched++;
+    }
+    else
+    {
+      corrected = Compose(keyCorrected, guess);
+      rejected++;
+    }
+
+    if(result) *result = match;
+  }
+
+  correction = Compose(corrected, Inverse(odometry));
+
+  //keep matching against the same scan until we've moved far enough from it, so small
+  //errors in each match don't pile up
+  Pose2D moved = Compose(Inverse(keyCorrected), corrected);
+  if(!matcher.HasReference() || std::hypot(moved.x, moved.y) >= keyframeMM || 
+     std::fabs(moved.theta) >= keyframeRadians)
+  {
+    matcher.SetReference(scan);
+    keyOdometry = odometry;
+    keyCorrected = corrected;
+  }
+
+  return corrected;
+}
+
+}
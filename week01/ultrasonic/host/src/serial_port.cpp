@@ -0,0 +1,51 @@
+#include "sonar/serial_port.h"
+
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+namespace sonar
+{
+
+namespace
+{
+
+speed_t BaudConstant(int baud)
+{
+  switch(baud)
+  {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 230400: return B230400;
+    default: return B115200;
+  }
+}
+
+}
+
+int OpenStream(const std::string& path, int baud)
+{
+  if(path == "-") return STDIN_FILENO;
+
+  int fd = open(path.c_str(), O_RDWR | O_NOCTTY);
+  if(fd < 0) fd = open(path.c_str(), O_RDONLY);
+  if(fd < 0 || !isatty(fd)) return fd;
+
+  termios tty;
+  if(tcgetattr(fd, &tty) == 0)
+  {
+    cfmakeraw(&tty);
+    cfsetispeed(&tty, BaudConstant(baud));
+    cfsetospeed(&tty, BaudConstant(baud));
+    tty.c_cflag |= CLOCAL | CREAD;
+    tty.c_cc[VMIN] = 1;
+    tty.c_cc[VTIME] = 0;
+    tcsetattr(fd, TCSANOW, &tty);
+  }
+
+  return fd;
+}
+
+}
@@ -0,0 +1,195 @@
+#include "sonar/stream_parser.h"
+
+#include <cstring>
+
+namespace sonar
+{
+
+namespace
+{
+
+/*
+ * Parses a field like "-123" or "4567.8" into tenths, so that "4567.8" -> 45678 and
+ * "12" -> 120. Returns false if the field is empty or has anything else in it.
+ */
+bool ParseTenths(const char*& p, const char* end, int64_t& tenths)
+{
+  bool negative = false;
+  if(p < end && *p == '-')
+  {
+    negative = true;
+    p++;
+  }
+
+  const char* start = p;
+  int64_t value = 0;
+  while(p < end && *p >= '0' && *p <= '9') value = value * 10 + (*p++ - '0');
+  if(p == start) return false;
+
+  value *= 10;
+  if(p < end && *p == '.')
+  {
+    p++;
+    if(p < end && *p >= '0' && *p <= '9') value += *p++ - '0';
+    while(p < end && *p >= '0' && *p <= '9') p++; //ignore any further digits
+  }
+
+  tenths = negative ? -value : value;
+  return true;
+}
+
+}
+
+bool StreamParser::ParseLine(const char* line, size_t length, Sample& sample)
+{
+  if(length && line[length - 1] == '\r') length--;
+
+  const size_t MAX_FIELDS = 8;
+  int64_t fields[MAX_FIELDS];
+  size_t count = 0;
+
+  const char* p = line;
+  const char* end = line + length;
+  while(p < end)
+  {
+    if(count == MAX_FIELDS) return false;
+    if(!ParseTenths(p, end, fields[count++])) return false;
+    if(p < end && *p++ != '\t') return false;
+  }
+
+  //fields are in tenths; most are integers, so scale them back
+  switch(count)
+  {
+    case 3:
+      sample.kind = SampleKind::ScanPoint;
+      sample.angle = fields[1] / 10;
+      sample.distanceMM10 = fields[2];
+      break;
+
+    case 4:
+    case 5:
+      sample.kind = SampleKind::Range;
+      sample.counts = fields[1] / 10;
+      sample.pulseUS = fields[2] / 10;
+      sample.distanceMM10 = fields[3];
+      if(count == 5)
+      {
+        if(fields[4] < 0 || fields[4] > 2550) return false;
+        sample.sensor = fields[4] / 10;
+      }
+      break;
+
+    case 6:
+      sample.kind = SampleKind::Window;
+      sample.pings = fields[1] / 10;
+      sample.valid = fields[2] / 10;
+      sample.minMM10 = fields[3];
+      sample.maxMM10 = fields[4];
+      sample.distanceMM10 = fields[5];
+      break;
+
+    default:
+      return false;
+  }
+
+  sample.deviceMillis = fields[0] / 10;
+  return true;
+}
+
+bool StreamParser::ParseTrace(const char* line, size_t length, Sample& sample)
+{
+  if(length && line[length - 1] == '\r') length--;
+  if(length < 5 || memcmp(line, "#lat\t", 5)) return false;
+
+  int64_t fields[3];
+  const char* p = line + 5;
+  const char* end = line + length;
+  for(int i = 0; i < 3; i++)
+  {
+    if(!ParseTenths(p, end, fields[i])) return false;
+    if(p < end && *p++ != '\t') return false;
+  }
+  if(p != end) return false;
+
+  sample.traced = true;
+  sample.captureMicros = fields[0] / 10;
+  sample.readyMicros = fields[1] / 10;
+  sample.sentMicros = fields[2] / 10;
+  return true;
+}
+
+void StreamParser::Line(const char* line, size_t length, uint64_t hostNanos)
+{
+  //a trace only belongs to the line right after it
+  bool traced = trace.traced;
+  trace.traced = false;
+
+  if(length && line[0] == '#')
+  {
+    ParseTrace(line, length, trace);
+    if(onMetadata) onMetadata(line, length);
+    return;
+  }
+
+  Sample sample;
+  if(!ParseLine(line, length, sample))
+  {
+    if(length) rejected++;
+    return;
+  }
+
+  if(traced)
+  {
+    sample.traced = true;
+    sample.captureMicros = trace.captureMicros;
+    sample.readyMicros = trace.readyMicros;
+    sample.sentMicros = trace.sentMicros;
+  }
+
+  sample.hostNanos = hostNanos;
+  records++;
+  onSample(sample);
+}
+
+void StreamParser::Feed(const char* data, size_t length, uint64_t hostNanos)
+{
+  const char* end = data + length;
+
+  while(data < end)
+  {
+    const char* newline = static_cast<const char*>(memchr(data, '\n', end - data));
+    if(!newline)
+    {
+      //keep the start of the line for next time
+      size_t n = end - data;
+      if(partialLength + n > MAX_LINE) overlong = true;
+      else
+      {
+        memcpy(partial + partialLength, data, n);
+        partialLength += n;
+      }
+      return;
+    }
+
+    if(overlong) Discard();
+
+    //parse in place if we can, and only copy when a line was split across chunks
+    else if(partialLength == 0) Line(data, newline - data, hostNanos);
+    else
+    {
+      size_t n = newline - data;
+      if(partialLength + n > MAX_LINE) Discard();
+      else
+      {
+        memcpy(partial + partialLength, data, n);
+        Line(partial, partialLength + n, hostNanos);
+      }
+    }
+
+    partialLength = 0;
+    overlong = false;
+    data = newline + 1;
+  }
+}
+
+}
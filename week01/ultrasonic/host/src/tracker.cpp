@@ -0,0 +1,615 @@
+#include "sonar/tracker.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace sonar
+{
+
+//the cost of an impossible pairing in the assignment; big, but finite so the sums work
+static const double FORBIDDEN = 1e9;
+
+static double WrapAngle(double a)
+{
+  while(a > M_PI) a -= 2 * M_PI;
+  while(a < -M_PI) a += 2 * M_PI;
+  return a;
+}
+
+//an obstacle is heard while any of it is in the cone, so its echo can come from a little
+//outside it: this is the cone's half-angle widened by that much at the given range
+static double HeardHalfAngle(const TrackerConfig& config, double range)
+{
+  double r = config.obstacleRadiusMM;
+  return std::min(config.beamHalfAngle + std::asin(r / (range + r)), M_PI / 3);
+}
+
+Measurement MakeMeasurement(const Sample& sample, const SensorMount& mount, const Pose2D& robot)
+{
+  double c = std::cos(robot.theta), s = std::sin(robot.theta);
+  double heading = robot.theta + mount.yaw;
+  if(sample.kind == SampleKind::ScanPoint) heading += sample.angle * M_PI / 180;
+
+  Measurement m;
+  m.time = sample.deviceMillis / 1000.0;
+  m.sensor = sample.sensor;
+  m.originX = robot.x + c * mount.x - s * mount.y;
+  m.originY = robot.y + s * mount.x + c * mount.y;
+  m.heading = WrapAngle(heading);
+  m.range = sample.distanceMM10 > 0 ? sample.distanceMM10 / 10.0 * std::cos(mount.pitch) : 0;
+  m.x = m.originX + m.range * std::cos(m.heading);
+  m.y = m.originY + m.range * std::sin(m.heading);
+  return m;
+}
+
+Tracker::Tracker(const TrackerConfig& config) : config(config)
+{
+  size_t T = config.maxTracks, M = config.maxReadings;
+
+  tracks.resize(T);
+  readings.resize(M);
+  gated.resize(T * M);
+  distance.resize(T * M);
+  likelihood.resize(T * M);
+
+  parent.resize(T + M);
+  clusterOf.resize(T + M);
+  clusterTracks.resize(T);
+  clusterReadings.resize(M);
+  clusterTrackStart.resize(T + M + 1);
+  clusterReadingStart.resize(T + M + 1);
+
+  updated.resize(T);
+  used.resize(M);
+
+  hungarianCost.resize(T * (M + T));
+  u.resize(T + 1);
+  v.resize(M + T + 1);
+  minv.resize(M + T + 1);
+  p.resize(M + T + 1);
+  way.resize(M + T + 1);
+  seen.resize(M + T + 1);
+}
+
+bool Tracker::Add(const Measurement& m)
+{
+  if(readingCount == config.maxReadings)
+  {
+    droppedReadings++;
+    return false;
+  }
+
+  Measurement& r = readings[readingCount++];
+  r = m;
+  if(r.range <= 0 || r.range > config.maxRangeMM) r.range = 0;
+  return true;
+}
+
+void Tracker::Predict(Track& t, double time) const
+{
+  double dt = time - t.time;
+  if(dt <= 0) return;
+
+  double* x = t.x;
+  double* P = t.P;
+  x[0] += dt * x[2];
+  x[1] += dt * x[3];
+
+  //P = F P F' for F = [I dt*I; 0 I], done in place: rows, then columns
+  for(int c = 0; c < 4; c++)
+  {
+    P[0 * 4 + c] += dt * P[2 * 4 + c];
+    P[1 * 4 + c] += dt * P[3 * 4 + c];
+  }
+  for(int r = 0; r < 4; r++)
+  {
+    P[r * 4 + 0] += dt * P[r * 4 + 2];
+    P[r * 4 + 1] += dt * P[r * 4 + 3];
+  }
+
+  //white-noise acceleration, the same on each axis
+  double q = config.accelSigma * config.accelSigma;
+  double dt2 = dt * dt;
+  for(int a = 0; a < 2; a++)
+  {
+    P[a * 4 + a] += q * dt2 * dt2 / 4;
+    P[a * 4 + a + 2] += q * dt2 * dt / 2;
+    P[(a + 2) * 4 + a] += q * dt2 * dt / 2;
+    P[(a + 2) * 4 + a + 2] += q * dt2;
+  }
+
+  t.time = time;
+}
+
+void Tracker::MeasurementCovariance(const Measurement& m, double R[4]) const
+{
+  //tight along the beam; across it, the spread of a uniform over the cone's width
+  double along = config.rangeSigmaMM + config.rangeSigmaFraction * m.range;
+  double across = std::max(along, m.range * std::tan(HeardHalfAngle(config, m.range)) / std::sqrt(3.0));
+
+  double c = std::cos(m.heading), s = std::sin(m.heading);
+  double a2 = along * along, x2 = across * across;
+  R[0] = c * c * a2 + s * s * x2;
+  R[1] = R[2] = c * s * (a2 - x2);
+  R[3] = s * s * a2 + c * c * x2;
+}
+
+/*
+ * The readings folded in by one Step() span a round of the ring, but every track has been
+ * predicted to the newest of them. A reading taken dt earlier saw the track where it was
+ * then, x - dt * v, so it measures H x with H = [I -dt*I] rather than just the position.
+ * This gives that predicted position, P H' (4 x 2, row-major), and S = H P H' + R.
+ */
+static void Project(const Track& t, const Measurement& m, const double R[4], double h[2], double PH[8],
+                    double S[4])
+{
+  double dt = t.time - m.time;
+  const double* P = t.P;
+
+  h[0] = t.x[0] - dt * t.x[2];
+  h[1] = t.x[1] - dt * t.x[3];
+  for(int r = 0; r < 4; r++)
+  {
+    PH[r * 2 + 0] = P[r * 4 + 0] - dt * P[r * 4 + 2];
+    PH[r * 2 + 1] = P[r * 4 + 1] - dt * P[r * 4 + 3];
+  }
+  for(int k = 0; k < 2; k++)
+  {
+    for(int l = 0; l < 2; l++) S[k * 2 + l] = PH[k * 2 + l] - dt * PH[(k + 2) * 2 + l] + R[k * 2 + l];
+  }
+}
+
+void Tracker::Correct(const Track& t, const Measurement& m, double x[4], double P[16]) const
+{
+  double R[4], h[2], PH[8], S[4];
+  MeasurementCovariance(m, R);
+  Project(t, m, R, h, PH, S);
+
+  double det = S[0] * S[3] - S[1] * S[1];
+  double i00 = S[3] / det, i01 = -S[1] / det, i11 = S[0] / det;
+
+  //K = P H' S^-1
+  double K[8];
+  for(int r = 0; r < 4; r++)
+  {
+    double p0 = PH[r * 2 + 0], p1 = PH[r * 2 + 1];
+    K[r * 2 + 0] = p0 * i00 + p1 * i01;
+    K[r * 2 + 1] = p0 * i01 + p1 * i11;
+  }
+
+  //x and P may be t's own, so work from copies
+  double x0[4];
+  std::copy(t.x, t.x + 4, x0);
+  double n0 = m.x - h[0], n1 = m.y - h[1];
+  for(int r = 0; r < 4; r++) x[r] = x0[r] + K[r * 2] * n0 + K[r * 2 + 1] * n1;
+
+  //P - K H P, where H P is the transpose of P H'; then make sure it stays symmetric
+  double Pt[16];
+  std::copy(t.P, t.P + 16, Pt);
+  for(int r = 0; r < 4; r++)
+  {
+    for(int c = 0; c < 4; c++) P[r * 4 + c] = Pt[r * 4 + c] - K[r * 2] * PH[c * 2] - K[r * 2 + 1] * PH[c * 2 + 1];
+  }
+  for(int r = 0; r < 4; r++)
+  {
+    for(int c = r + 1; c < 4; c++) P[r * 4 + c] = P[c * 4 + r] = (P[r * 4 + c] + P[c * 4 + r]) / 2;
+  }
+}
+
+double Tracker::Distance(const Track& t, const Measurement& m, double& det) const
+{
+  double R[4], h[2], PH[8], S[4];
+  MeasurementCovariance(m, R);
+  Project(t, m, R, h, PH, S);
+
+  det = S[0] * S[3] - S[1] * S[1];
+  double n0 = m.x - h[0], n1 = m.y - h[1];
+  return (n0 * n0 * S[3] - 2 * n0 * n1 * S[1] + n1 * n1 * S[0]) / det;
+}
+
+void Tracker::Gate(size_t track, size_t reading)
+{
+  size_t k = track * config.maxReadings + reading;
+  gated[k] = 0;
+
+  const Measurement& m = readings[reading];
+  if(!m.range) return;
+
+  double det;
+  double d2 = Distance(tracks[track], m, det);
+  if(!(d2 < config.gate)) return;
+
+  gated[k] = 1;
+  distance[k] = d2;
+  likelihood[k] = std::exp(-d2 / 2) / (2 * M_PI * std::sqrt(det));
+}
+
+uint32_t Tracker::Find(uint32_t node)
+{
+  while(parent[node] != node)
+  {
+    parent[node] = parent[parent[node]];
+    node = parent[node];
+  }
+  return node;
+}
+
+void Tracker::Cluster(void)
+{
+  size_t T = trackCount, M = readingCount;
+  for(size_t i = 0; i < T + M; i++) parent[i] = i;
+
+  for(size_t i = 0; i < T; i++)
+  {
+    for(size_t j = 0; j < M; j++)
+    {
+      if(!gated[i * config.maxReadings + j]) continue;
+      uint32_t a = Find(i), b = Find(T + j);
+      if(a != b) parent[a] = b;
+    }
+  }
+
+  //number the clusters, then bucket the tracks and readings by cluster (a counting sort)
+  clusterCount = 0;
+  for(size_t i = 0; i < T + M; i++) clusterOf[i] = UINT32_MAX;
+  for(size_t i = 0; i < T + M; i++)
+  {
+    uint32_t root = Find(i);
+    if(clusterOf[root] == UINT32_MAX) clusterOf[root] = clusterCount++;
+    clusterOf[i] = clusterOf[root];
+  }
+
+  std::fill(clusterTrackStart.begin(), clusterTrackStart.begin() + clusterCount + 1, 0);
+  std::fill(clusterReadingStart.begin(), clusterReadingStart.begin() + clusterCount + 1, 0);
+  for(size_t i = 0; i < T; i++) clusterTrackStart[clusterOf[i] + 1]++;
+  for(size_t j = 0; j < M; j++) clusterReadingStart[clusterOf[T + j] + 1]++;
+  for(size_t c = 0; c < clusterCount; c++)
+  {
+    clusterTrackStart[c + 1] += clusterTrackStart[c];
+    clusterReadingStart[c + 1] += clusterReadingStart[c];
+  }
+
+  //fill using each start as a cursor, which leaves it at the next cluster's start...
+  for(size_t i = 0; i < T; i++) clusterTracks[clusterTrackStart[clusterOf[i]]++] = i;
+  for(size_t j = 0; j < M; j++) clusterReadings[clusterReadingStart[clusterOf[T + j]]++] = j;
+
+  //...so shift them back
+  for(size_t c = clusterCount; c > 0; c--)
+  {
+    clusterTrackStart[c] = clusterTrackStart[c - 1];
+    clusterReadingStart[c] = clusterReadingStart[c - 1];
+  }
+  clusterTrackStart[0] = clusterReadingStart[0] = 0;
+}
+
+/*
+ * Global nearest neighbour for one cluster. The rows are its tracks, and the columns its
+ * readings plus one "missed" column per track, which only that track can take (at the cost
+ * of the gate). This is the O(n^2 m) Hungarian algorithm with potentials, 1-based.
+ */
+void Tracker::AssignCluster(size_t cluster)
+{
+  const uint32_t* rows = &clusterTracks[clusterTrackStart[cluster]];
+  const uint32_t* cols = &clusterReadings[clusterReadingStart[cluster]];
+  int n = clusterTrackStart[cluster + 1] - clusterTrackStart[cluster];
+  int readingCols = clusterReadingStart[cluster + 1] - clusterReadingStart[cluster];
+  int m = readingCols + n;
+
+  for(int i = 0; i < n; i++)
+  {
+    double* row = &hungarianCost[i * m];
+    for(int j = 0; j < readingCols; j++)
+    {
+      size_t k = rows[i] * config.maxReadings + cols[j];
+      row[j] = gated[k] ? distance[k] : FORBIDDEN;
+    }
+    for(int j = 0; j < n; j++) row[readingCols + j] = i == j ? config.gate : FORBIDDEN;
+  }
+
+  std::fill(u.begin(), u.begin() + n + 1, 0.0);
+  std::fill(v.begin(), v.begin() + m + 1, 0.0);
+  std::fill(p.begin(), p.begin() + m + 1, 0);
+
+  for(int i = 1; i <= n; i++)
+  {
+    p[0] = i;
+    int j0 = 0;
+    std::fill(minv.begin(), minv.begin() + m + 1, HUGE_VAL);
+    std::fill(seen.begin(), seen.begin() + m + 1, 0);
+
+    do
+    {
+      seen[j0] = 1;
+      int i0 = p[j0], j1 = 0;
+      double delta = HUGE_VAL;
+      for(int j = 1; j <= m; j++)
+      {
+        if(seen[j]) continue;
+        double cur = hungarianCost[(i0 - 1) * m + j - 1] - u[i0] - v[j];
+        if(cur < minv[j])
+        {
+          minv[j] = cur;
+          way[j] = j0;
+        }
+        if(minv[j] < delta)
+        {
+          delta = minv[j];
+          j1 = j;
+        }
+      }
+
+      for(int j = 0; j <= m; j++)
+      {
+        if(seen[j])
+        {
+          u[p[j]] += delta;
+          v[j] -= delta;
+        }
+        else minv[j] -= delta;
+      }
+      j0 = j1;
+    } while(p[j0] != 0);
+
+    do
+    {
+      int j1 = way[j0];
+      p[j0] = p[j1];
+      j0 = j1;
+    } while(j0);
+  }
+
+  for(int j = 1; j <= readingCols; j++)
+  {
+    if(!p[j]) continue;
+
+    uint32_t track = rows[p[j] - 1], reading = cols[j - 1];
+    if(!gated[track * config.maxReadings + reading]) continue;
+
+    Track& t = tracks[track];
+    Correct(t, readings[reading], t.x, t.P);
+    updated[track] = 1;
+  }
+}
+
+/*
+ * Cheap JPDA for one cluster. With G[i][j] the (detection-weighted) likelihood of reading j
+ * coming from track i, Fitzgerald's approximation of the association probability is
+ *
+ *   beta[i][j] = G[i][j] / (sum over j' of G[i][j'] + sum over i' of G[i'][j] - G[i][j] + B)
+ *
+ * which shrinks a reading's weight for a track both when the track has other candidates
+ * and when the reading does. B stands in for clutter and missed detections.
+ */
+void Tracker::WeighCluster(size_t cluster)
+{
+  const uint32_t* rows = &clusterTracks[clusterTrackStart[cluster]];
+  const uint32_t* cols = &clusterReadings[clusterReadingStart[cluster]];
+  int n = clusterTrackStart[cluster + 1] - clusterTrackStart[cluster];
+  int readingCols = clusterReadingStart[cluster + 1] - clusterReadingStart[cluster];
+
+  double pd = config.detectionProbability;
+  double B = config.clutterDensity * (1 - pd);
+
+  //reading (column) sums, kept in the Hungarian scratch
+  double* columnSum = &minv[0];
+  for(int j = 0; j < readingCols; j++)
+  {
+    columnSum[j] = 0;
+    for(int i = 0; i < n; i++)
+    {
+      size_t k = rows[i] * config.maxReadings + cols[j];
+      if(gated[k]) columnSum[j] += pd * likelihood[k];
+    }
+  }
+
+  for(int i = 0; i < n; i++)
+  {
+    Track& t = tracks[rows[i]];
+    size_t base = rows[i] * config.maxReadings;
+
+    double rowSum = 0;
+    for(int j = 0; j < readingCols; j++)
+    {
+      if(gated[base + cols[j]]) rowSum += pd * likelihood[base + cols[j]];
+    }
+
+    //collapse the mixture: the prediction (weight beta0) and each reading's update
+    double weight[64];
+    double total = 0;
+    int candidates = 0;
+    for(int j = 0; j < readingCols && candidates < 64; j++)
+    {
+      size_t k = base + cols[j];
+      if(!gated[k]) continue;
+      double g = pd * likelihood[k];
+      weight[candidates] = g / (rowSum + columnSum[j] - g + B);
+      total += weight[candidates++];
+    }
+    if(!candidates) continue;
+
+    double scale = total > 1 ? 1 / total : 1;
+    double beta0 = std::max(0.0, 1 - total * scale);
+
+    double x[4], P[16];
+    double xs[64][4];
+    for(int r = 0; r < 4; r++) x[r] = beta0 * t.x[r];
+    for(int e = 0; e < 16; e++) P[e] = beta0 * t.P[e];
+
+    int c = 0;
+    for(int j = 0; j < readingCols && c < candidates; j++)
+    {
+      if(!gated[base + cols[j]]) continue;
+
+      double Pj[16];
+      double b = weight[c] * scale;
+      Correct(t, readings[cols[j]], xs[c], Pj);
+      for(int r = 0; r < 4; r++) x[r] += b * xs[c][r];
+      for(int e = 0; e < 16; e++) P[e] += b * Pj[e];
+      c++;
+    }
+
+    //the spread of the means
+    for(int k = 0; k <= candidates; k++)
+    {
+      const double* xk = k < candidates ? xs[k] : t.x;
+      double b = k < candidates ? weight[k] * scale : beta0;
+      double d[4];
+      for(int r = 0; r < 4; r++) d[r] = xk[r] - x[r];
+      for(int r = 0; r < 4; r++)
+      {
+        for(int cc = 0; cc < 4; cc++) P[r * 4 + cc] += b * d[r] * d[cc];
+      }
+    }
+
+    std::copy(x, x + 4, t.x);
+    std::copy(P, P + 16, t.P);
+
+    //it counts as a hit if it's more likely than not that the track was seen
+    if(beta0 < 0.5) updated[rows[i]] = 1;
+  }
+}
+
+bool Tracker::ShouldHaveHeard(const Track& t) const
+{
+  for(size_t j = 0; j < readingCount; j++)
+  {
+    const Measurement& m = readings[j];
+    double dx = t.x[0] - m.originX, dy = t.x[1] - m.originY;
+    double reach = (m.range ? m.range : config.maxRangeMM) - config.missMarginMM;
+    if(dx * dx + dy * dy > reach * reach) continue;
+    if(std::fabs(WrapAngle(std::atan2(dy, dx) - m.heading)) <= config.beamHalfAngle) return true;
+  }
+  return false;
+}
+
+/*
+ * Whether a reading that fell in no gate is still most likely an obstacle already tracked:
+ * at the range of a confirmed track (within its gate along the line of sight) and no more
+ * than two cone half-angles from it. Neighbouring sensors hear the same obstacle at the
+ * edges of their wide cones, and each puts it on its own axis, which can be further across
+ * than any gate reaches; a new track there would confirm on its own and share the obstacle.
+ */
+bool Tracker::Explained(const Measurement& m) const
+{
+  double along = config.rangeSigmaMM + config.rangeSigmaFraction * m.range;
+  double half = HeardHalfAngle(config, m.range);
+
+  for(size_t i = 0; i < trackCount; i++)
+  {
+    const Track& t = tracks[i];
+    if(t.status == TrackStatus::Tentative) continue;
+
+    double dx = t.x[0] - m.originX, dy = t.x[1] - m.originY;
+    double spread = along * along + (t.P[0] + t.P[5]) / 2;
+    if(std::fabs(std::sqrt(dx * dx + dy * dy) - m.range) > std::sqrt(config.gate * spread)) continue;
+    if(std::fabs(WrapAngle(std::atan2(dy, dx) - m.heading)) <= 2 * half) return true;
+  }
+  return false;
+}
+
+void Tracker::Birth(const Measurement& m)
+{
+  if(trackCount == config.maxTracks)
+  {
+    droppedTracks++;
+    return;
+  }
+
+  Track& t = tracks[trackCount++];
+  double R[4];
+  MeasurementCovariance(m, R);
+  double v = config.initialSpeedSigma * config.initialSpeedSigma;
+
+  t = Track();
+  t.id = nextId++;
+  t.time = m.time;
+  t.x[0] = m.x;
+  t.x[1] = m.y;
+  t.P[0] = R[0];
+  t.P[1] = R[1];
+  t.P[4] = R[2];
+  t.P[5] = R[3];
+  t.P[10] = t.P[15] = v;
+  t.hits = 1;
+}
+
+void Tracker::Manage(void)
+{
+  double maxVariance = config.maxPositionSigma * config.maxPositionSigma;
+
+  //backwards, so that a track swapped into a hole has already been looked at
+  for(size_t i = trackCount; i-- > 0;)
+  {
+    Track& t = tracks[i];
+    if(updated[i])
+    {
+      t.hits++;
+      t.misses = 0;
+      if(t.status == TrackStatus::Coasting || t.hits >= config.confirmHits) t.status = TrackStatus::Confirmed;
+    }
+    else if(ShouldHaveHeard(t))
+    {
+      t.misses++;
+      if(t.status == TrackStatus::Confirmed) t.status = TrackStatus::Coasting;
+    }
+
+    int limit = t.status == TrackStatus::Tentative ? config.maxTentativeMisses : config.maxMisses;
+    if(t.misses > limit || t.P[0] + t.P[5] > maxVariance) tracks[i] = tracks[--trackCount];
+  }
+}
+
+void Tracker::Step(void)
+{
+  if(!readingCount) return;
+
+  double now = readings[0].time;
+  for(size_t j = 1; j < readingCount; j++) now = std::max(now, readings[j].time);
+
+  for(size_t i = 0; i < trackCount; i++)
+  {
+    Predict(tracks[i], now);
+    updated[i] = 0;
+    for(size_t j = 0; j < readingCount; j++) Gate(i, j);
+  }
+  for(size_t j = 0; j < readingCount; j++) used[j] = 0;
+
+  Cluster();
+  for(size_t c = 0; c < clusterCount; c++)
+  {
+    bool hasTracks = clusterTrackStart[c + 1] > clusterTrackStart[c];
+    bool hasReadings = clusterReadingStart[c + 1] > clusterReadingStart[c];
+    if(!hasTracks || !hasReadings) continue;
+
+    if(config.association == Association::Assignment) AssignCluster(c);
+    else WeighCluster(c);
+
+    //a reading in some track's gate is that track's (or a duplicate of it), even if the
+    //assignment gave the track another one
+    for(uint32_t k = clusterReadingStart[c]; k < clusterReadingStart[c + 1]; k++) used[clusterReadings[k]] = 1;
+  }
+
+  Manage();
+
+  //whatever fell in no gate starts a new track, unless it's the same thing as a confirmed
+  //track or one just started (e.g., seen by two neighbouring sensors)
+  size_t firstBorn = trackCount;
+  for(size_t j = 0; j < readingCount; j++)
+  {
+    const Measurement& m = readings[j];
+    if(!m.range || used[j] || Explained(m)) continue;
+
+    size_t same = trackCount;
+    for(size_t i = firstBorn; i < trackCount && same == trackCount; i++)
+    {
+      double det;
+      if(Distance(tracks[i], m, det) < config.gate) same = i;
+    }
+
+    if(same < trackCount) Correct(tracks[same], m, tracks[same].x, tracks[same].P);
+    else Birth(m);
+  }
+
+  readingCount = 0;
+}
+
+}
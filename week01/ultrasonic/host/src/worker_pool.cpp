@@ -0,0 +1,100 @@
+#include "sonar/worker_pool.h"
+
+#include <atomic>
+
+namespace sonar
+{
+
+struct WorkerPool::Job
+{
+  const std::function<void(size_t)>* fn;
+  size_t n;
+  std::atomic<size_t> next{0};
+  std::atomic<size_t> done{0};
+
+  std::mutex mutex;
+  std::condition_variable finished;
+};
+
+unsigned WorkerPool::DefaultThreads(void)
+{
+  unsigned cores = std::thread::hardware_concurrency();
+  return cores > 1 ? cores - 1 : 0;
+}
+
+WorkerPool::WorkerPool(unsigned threads)
+{
+  for(unsigned i = 0; i < threads; i++) workers.emplace_back(&WorkerPool::Worker, this);
+}
+
+WorkerPool::~WorkerPool(void)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+
+  wake.notify_all();
+  for(auto& t : workers) t.join();
+}
+
+//claims and runs items until there are none left to claim
+void WorkerPool::Work(Job& job)
+{
+  size_t i;
+  while((i = job.next.fetch_add(1)) < job.n)
+  {
+    (*job.fn)(i);
+
+    if(job.done.fetch_add(1) + 1 == job.n)
+    {
+      std::lock_guard<std::mutex> lock(job.mutex);
+      job.finished.notify_all();
+    }
+  }
+}
+
+void WorkerPool::Worker(void)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  for(;;)
+  {
+    wake.wait(lock, [this] {return stopping || !jobs.empty();});
+    if(stopping) return;
+
+    std::shared_ptr<Job> job = jobs.front();
+    lock.unlock();
+    Work(*job);
+    lock.lock();
+
+    //everything in it has been claimed, so nobody else needs to find it
+    if(!jobs.empty() && jobs.front() == job) jobs.pop_front();
+  }
+}
+
+void WorkerPool::Run(size_t n, const std::function<void(size_t)>& fn)
+{
+  if(!n) return;
+
+  auto job = std::make_shared<Job>();
+  job->fn = &fn;
+  job->n = n;
+
+  //not worth waking anyone for a single item
+  if(n > 1 && !workers.empty())
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      jobs.push_back(job);
+    }
+    wake.notify_all();
+  }
+
+  Work(*job);
+
+  std::unique_lock<std::mutex> lock(job->mutex);
+  job->finished.wait(lock, [&] {return job->done.load() == n;});
+}
+
+}
@@ -0,0 +1,241 @@
+/*
+ * Checks ClockSync and LatencyTrace against a simulated device, so the clock fit and the
+ * histograms can be trusted without hardware.
+ *
+ *   latency_check [--seconds S] [--drift PPM] [--seed N]
+ *
+ * The device's micros() runs at its own rate (drift, default 40 ppm fast), from an offset
+ * that makes it wrap 20 s in. The host asks for it twice a second over a link that takes
+ * 150 us or so each way and now and then holds a message up for a few ms (a USB frame, the
+ * scheduler). Every 25 ms an echo goes through the pipeline with known stage times, and its
+ * "#lat" line and record go through a StreamParser, in pieces, into a LatencyTrace.
+ *
+ * It passes, and exits 0, if:
+ *   - the clock mapping is within CLOCK_TOLERANCE of the truth after the first 10 s, and the
+ *     drift within DRIFT_TOLERANCE of the simulated one
+ *   - every sample is traced into every stage, none of them negative
+ *   - each stage's min, p50, p90, p99, and max are within a bucket's half-width (1/8) of the
+ *     exact ones, give or take the device's 1 us resolution and the clock mapping's error
+ *   - a histogram puts a time in a bucket whose middle is within 1/8 of it, from 1 ns to
+ *     minutes, and counts negative times and merges as it should
+ */
+
+#include "sonar/clock_sync.h"
+#include "sonar/latency_trace.h"
+#include "sonar/stream_parser.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+namespace
+{
+
+const uint64_t HOST_START = 5000000000000ull;   //ns; any steady clock reading
+const uint32_t DEVICE_START = 0xFFFFFFFFu - 20000000u;  //us, so micros() wraps 20 s in
+const double SYNC_INTERVAL = 0.5;               //s
+const double SAMPLE_INTERVAL = 0.025;           //s
+const double WARMUP = 10;                       //s, before the clock is checked and samples count
+
+//the pass marks
+const double CLOCK_TOLERANCE = 100000;          //ns
+const double DRIFT_TOLERANCE = 5;               //ppm
+const double BUCKET_ERROR = 0.125;              //of the time
+
+struct Device
+{
+  double drift;   //ppm
+
+  //micros() on the device at host time hostNanos
+  uint32_t Micros(uint64_t hostNanos) const
+  {
+    double us = (hostNanos - HOST_START) / 1e3 * (1 + drift * 1e-6);
+    return DEVICE_START + uint32_t(uint64_t(us));
+  }
+};
+
+//one way over the link, in ns: usually about 150 us, held up for a few ms one time in ten
+uint64_t LinkDelay(std::mt19937& rng)
+{
+  std::exponential_distribution<double> jitter(1 / 50e3);
+  std::uniform_real_distribution<double> unit(0, 1);
+  double delay = 120e3 + jitter(rng);
+  if(unit(rng) < 0.1) delay += 1e6 + unit(rng) * 7e6;
+  return uint64_t(delay);
+}
+
+//the q-th quantile of sorted, at the same rank LatencyHistogram::Percentile() uses
+double Exact(const std::vector<int64_t>& sorted, double q)
+{
+  size_t rank = std::min(sorted.size() - 1, size_t(q * sorted.size()));
+  return sorted[rank];
+}
+
+bool CheckStage(const sonar::LatencyTrace& trace, sonar::LatencyStage stage, std::vector<int64_t> truth,
+                double slack)
+{
+  std::sort(truth.begin(), truth.end());
+  sonar::LatencyHistogram h = trace.Stage(stage);
+
+  bool ok = h.Count() == truth.size() && h.Negative() == 0;
+  printf("%-20s %8llu samples, %llu negative", sonar::LatencyStageName(stage), (unsigned long long)h.Count(),
+         (unsigned long long)h.Negative());
+
+  //min and max are exact but for the slack; the percentiles are also off by up to a bucket
+  const double qs[] = {0, 0.5, 0.9, 0.99, 1};
+  const char* names[] = {"min", "p50", "p90", "p99", "max"};
+  for(size_t i = 0; i < 5; i++)
+  {
+    double q = qs[i];
+    double got = q == 0 ? h.Min() : q == 1 ? h.Max() : h.Percentile(q);
+    double want = Exact(truth, q);
+    double allowed = (q == 0 || q == 1 ? 0 : BUCKET_ERROR * want) + slack;
+    if(std::fabs(got - want) > allowed) ok = false;
+    printf(", %s %.1f/%.1f us", names[i], got / 1e3, want / 1e3);
+  }
+  printf(" (%s)\n", ok ? "ok" : "off");
+  return ok;
+}
+
+bool CheckBuckets(void)
+{
+  bool ok = true;
+
+  //a time between two far-off ones is the median, so the bucket's middle isn't clamped
+  double worst = 0;
+  for(double t = 1; t < 1e11; t = t * 1.07 + 1)
+  {
+    sonar::LatencyHistogram h;
+    h.Add(0);
+    h.Add(int64_t(t));
+    h.Add(INT64_MAX / 2);
+    double error = std::fabs(h.Percentile(0.5) - int64_t(t)) / int64_t(t);
+    worst = std::max(worst, error);
+  }
+  //the middle of a bucket is exactly an eighth above its bottom, so allow for rounding
+  if(worst > BUCKET_ERROR + 1e-9) ok = false;
+
+  sonar::LatencyHistogram a, b;
+  a.Add(-5);
+  a.Add(100);
+  b.Add(300);
+  a.Merge(b);
+  bool merged = a.Count() == 3 && a.Negative() == 1 && a.Min() == -5 && a.Max() == 300 &&
+                std::fabs(a.Mean() - 395 / 3.0) < 1e-9;
+  if(!merged) ok = false;
+
+  printf("histogram: worst bucket error %.1f%% (want at most %.1f%%), negative and merge %s\n", 100 * worst,
+         100 * BUCKET_ERROR, merged ? "ok" : "off");
+  return ok;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+  double seconds = 120;
+  Device device = {40};
+  unsigned seed = 1;
+  for(int i = 1; i < argc; i++)
+  {
+    if(!strcmp(argv[i], "--seconds") && i + 1 < argc) seconds = atof(argv[++i]);
+    else if(!strcmp(argv[i], "--drift") && i + 1 < argc) device.drift = atof(argv[++i]);
+    else if(!strcmp(argv[i], "--seed") && i + 1 < argc) seed = atoi(argv[++i]);
+    else
+    {
+      fprintf(stderr, "usage: %s [--seconds S] [--drift PPM] [--seed N]\n", argv[0]);
+      return 1;
+    }
+  }
+  if(seconds <= WARMUP)
+  {
+    fprintf(stderr, "--seconds must be more than the %.0f s warm-up\n", WARMUP);
+    return 1;
+  }
+
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<double> unit(0, 1);
+
+  sonar::ClockSync sync;
+  sonar::LatencyTrace trace(&sync);
+
+  //what the trace should find; consumedAt is where the parser's callback takes the sample off
+  std::vector<int64_t> truth[size_t(sonar::LatencyStage::Count)];
+  uint64_t consumedAt = 0;
+  bool counting = false;
+  sonar::StreamParser parser([&](const sonar::Sample& sample) {trace.Add(sample, consumedAt);});
+
+  double worstClock = 0;
+  uint64_t nextSync = HOST_START;
+  uint64_t end = HOST_START + uint64_t(seconds * 1e9);
+  for(uint64_t capture = HOST_START; capture < end; capture += uint64_t(SAMPLE_INTERVAL * 1e9))
+  {
+    if(capture >= nextSync)
+    {
+      uint64_t request = capture;
+      uint64_t read = request + LinkDelay(rng);
+      sync.Request(request);
+      sync.Reply(device.Micros(read), read + LinkDelay(rng));
+      nextSync += uint64_t(SYNC_INTERVAL * 1e9);
+    }
+
+    if(!counting && capture >= HOST_START + uint64_t(WARMUP * 1e9))
+    {
+      counting = true;
+      trace.Reset();
+    }
+
+    //the pipeline, with a loop() that's sometimes busy and a USB frame or two to cross
+    uint64_t ready = capture + uint64_t(20e3 + unit(rng) * 580e3);
+    uint64_t sent = ready + uint64_t(150e3 + unit(rng) * 100e3);
+    uint64_t received = sent + uint64_t(1e6 + unit(rng) * 3e6);
+    consumedAt = received + uint64_t(5e3 + unit(rng) * 195e3);
+
+    if(counting)
+    {
+      //the device stages are only known to the us, as the device sees them
+      uint32_t c = device.Micros(capture), r = device.Micros(ready), s = device.Micros(sent);
+      truth[size_t(sonar::LatencyStage::CaptureToReady)].push_back(int64_t(uint32_t(r - c)) * 1000);
+      truth[size_t(sonar::LatencyStage::ReadyToSent)].push_back(int64_t(uint32_t(s - r)) * 1000);
+      truth[size_t(sonar::LatencyStage::SentToReceived)].push_back(received - sent);
+      truth[size_t(sonar::LatencyStage::ReceivedToConsumed)].push_back(consumedAt - received);
+      truth[size_t(sonar::LatencyStage::Total)].push_back(consumedAt - capture);
+
+      worstClock = std::max(worstClock, std::fabs(double(sync.ToHostNanos(c) - int64_t(capture))));
+    }
+
+    //the "#lat" line and its record, fed in a couple of arbitrary pieces
+    char text[128];
+    int length = snprintf(text, sizeof(text), "#lat\t%u\t%u\t%u\n%u\t%u\t%u\t%u.%u\n",
+                          device.Micros(capture), device.Micros(ready), device.Micros(sent),
+                          device.Micros(sent) / 1000, 1000, 2000, 3430, 0);
+    size_t split = size_t(unit(rng) * length);
+    parser.Feed(text, split, sent);
+    parser.Feed(text + split, length - split, received);
+  }
+
+  bool clockOk = worstClock <= CLOCK_TOLERANCE && std::fabs(sync.DriftPPM() - device.drift) <= DRIFT_TOLERANCE;
+  printf("clock: worst error %.1f us (want at most %.0f), drift %.2f ppm (simulated %.2f), best round trip "
+         "%.1f us\n", worstClock / 1e3, CLOCK_TOLERANCE / 1e3, sync.DriftPPM(), device.drift,
+         sync.BestRoundTripNanos() / 1e3);
+
+  //the device's stages are exact to the us; the ones crossing to the host add the clock's error
+  bool traceOk = parser.Rejected() == 0;
+  for(size_t i = 0; i < size_t(sonar::LatencyStage::Count); i++)
+  {
+    sonar::LatencyStage stage = sonar::LatencyStage(i);
+    bool onDevice = stage == sonar::LatencyStage::CaptureToReady || stage == sonar::LatencyStage::ReadyToSent;
+    if(!CheckStage(trace, stage, truth[i], onDevice ? 0 : worstClock + 1000)) traceOk = false;
+  }
+
+  bool bucketsOk = CheckBuckets();
+
+  bool pass = clockOk && traceOk && bucketsOk;
+  printf("%s: clock %s, trace %s, histogram %s\n", pass ? "PASS" : "FAIL", clockOk ? "ok" : "off",
+         traceOk ? "ok" : "off", bucketsOk ? "ok" : "off");
+  return pass ? 0 : 1;
+}
@@ -0,0 +1,218 @@
+/*
+ * Runs the scan matcher against simulated robots driving around a room, to check that it 
+ * corrects odometry drift and to time it with several robots sharing one worker pool.
+ *
+ *   scan_match_bench [--robots N] [--scans N] [--step DEGREES] [--threads N]
+ *
+ * Each robot drives a loop with odometry that overestimates distance by 3% and drifts in
+ * heading, and sweeps a sonar across 180 degrees in front of it after every move. The 
+ * simulated sonar returns the nearest wall anywhere in its beam that faces it within 40
+ * degrees (walls at a glancing angle reflect the ping away), plus a little noise.
+ *
+ * For each robot it prints the position and heading error at the end of the run, and the
+ * position error averaged over the run, for odometry alone and corrected, and flags any
+ * robot the correction left worse off.
+ */
+
+#include "sonar/scan_match.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+struct Wall
+{
+  double x0, y0, x1, y1;
+};
+
+//a 4 x 3 m room with a cupboard and a box in it, in mm
+const Wall ROOM[] =
+{
+  {0, 0, 4000, 0}, {4000, 0, 4000, 3000}, {4000, 3000, 0, 3000}, {0, 3000, 0, 0},
+  {0, 2400, 800, 2400}, {800, 2400, 800, 3000},
+  {2600, 1000, 3000, 1000}, {3000, 1000, 3000, 1300}, {3000, 1300, 2600, 1300}, {2600, 1300, 2600, 1000},
+};
+
+const double HALF_BEAM = 15 * M_PI / 180;
+const double MAX_INCIDENCE = 40 * M_PI / 180;
+const double MAX_RANGE = 4000;
+
+//distance along the ray to the nearest wall that would echo it back, or 0
+double Raycast(double x, double y, double angle)
+{
+  double dx = std::cos(angle), dy = std::sin(angle);
+  double best = 0;
+
+  for(const Wall& w : ROOM)
+  {
+    double ex = w.x1 - w.x0, ey = w.y1 - w.y0;
+    double denom = dx * ey - dy * ex;
+    if(std::fabs(denom) < 1e-9) continue;
+
+    double t = ((w.x0 - x) * ey - (w.y0 - y) * ex) / denom;
+    double u = ((w.x0 - x) * dy - (w.y0 - y) * dx) / denom;
+    if(t <= 0 || u < 0 || u > 1) continue;
+
+    double incidence = std::acos(std::fabs(dx * ey - dy * ex) / std::hypot(ex, ey));
+    if(incidence > MAX_INCIDENCE) continue;
+
+    if(!best || t < best) best = t;
+  }
+
+  return best;
+}
+
+//the nearest echo anywhere in the cone
+double Sonar(double x, double y, double angle)
+{
+  double nearest = 0;
+  for(int i = -6; i <= 6; i++)
+  {
+    double r = Raycast(x, y, angle + HALF_BEAM * i / 6);
+    if(r && (!nearest || r < nearest)) nearest = r;
+  }
+  return nearest <= MAX_RANGE ? nearest : 0;
+}
+
+struct RobotStats
+{
+  double odometryError = 0, correctedError = 0;
+  double odometryHeading = 0, correctedHeading = 0;
+  double odometryMean = 0, correctedMean = 0;      //position error averaged over every scan
+  std::vector<double> matchMS;
+  uint64_t matched = 0, rejected = 0;
+};
+
+void Robot(int id, int scans, double stepDegrees, sonar::WorkerPool* pool, RobotStats& stats)
+{
+  std::mt19937 rng(id);
+  std::normal_distribution<double> noise(0, 3);
+  std::uniform_real_distribution<double> uniform(0, 1);
+
+  //each robot loops around the box, starting in a different place
+  sonar::Pose2D truth{1400.0 + 150 * id, 600, 0}, odometry = truth;
+  sonar::DriftCorrector corrector(pool);
+  const double mountX = 80;
+
+  for(int k = 0; k < scans; k++)
+  {
+    //drive 100 mm and turn a little; the odometry gets it slightly wrong
+    double turn = 0.1;
+    sonar::Pose2D move{100, 0, turn};
+    sonar::Pose2D measured{103, 0, turn * 1.02 + 0.003};
+    truth = sonar::Compose(truth, move);
+    odometry = sonar::Compose(odometry, measured);
+
+    //keep away from the walls: turn round when getting close
+    if(Raycast(truth.x, truth.y, truth.theta) < 500) truth.theta += 1.2, odometry.theta += 1.2;
+
+    sonar::Scan scan;
+    for(double a = -90; a <= 90; a += stepDegrees)
+    {
+      double beam = a * M_PI / 180;
+      double sx = truth.x + mountX * std::cos(truth.theta);
+      double sy = truth.y + mountX * std::sin(truth.theta);
+      double r = Sonar(sx, sy, truth.theta + beam);
+      if(!r || uniform(rng) < 0.03) continue;
+
+      r += noise(rng);
+      scan.Add(mountX + r * std::cos(beam), r * std::sin(beam), beam, r);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    scan = scan.ExtractArcs();
+    sonar::Pose2D corrected = corrector.Add(scan, odometry);
+    auto end = std::chrono::steady_clock::now();
+    stats.matchMS.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+
+    stats.odometryMean += std::hypot(odometry.x - truth.x, odometry.y - truth.y) / scans;
+    stats.correctedMean += std::hypot(corrected.x - truth.x, corrected.y - truth.y) / scans;
+
+    if(k == scans - 1)
+    {
+      stats.odometryError = std::hypot(odometry.x - truth.x, odometry.y - truth.y);
+      stats.correctedError = std::hypot(corrected.x - truth.x, corrected.y - truth.y);
+      stats.odometryHeading = std::fabs(std::remainder(odometry.theta - truth.theta, 2 * M_PI));
+      stats.correctedHeading = std::fabs(std::remainder(corrected.theta - truth.theta, 2 * M_PI));
+    }
+  }
+
+  stats.matched = corrector.Matched();
+  stats.rejected = corrector.Rejected();
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+  int robots = 4, scans = 200;
+  double step = 2;
+  unsigned threads = sonar::WorkerPool::DefaultThreads();
+
+  for(int i = 1; i < argc; i++)
+  {
+    if(!strcmp(argv[i], "--robots") && i + 1 < argc) robots = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--scans") && i + 1 < argc) scans = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--step") && i + 1 < argc) step = atof(argv[++i]);
+    else if(!strcmp(argv[i], "--threads") && i + 1 < argc) threads = atoi(argv[++i]);
+    else
+    {
+      fprintf(stderr, "usage: %s [--robots N] [--scans N] [--step DEGREES] [--threads N]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  sonar::WorkerPool pool(threads);
+  std::vector<RobotStats> stats(robots);
+  std::vector<std::thread> running;
+
+  auto start = std::chrono::steady_clock::now();
+  for(int i = 0; i < robots; i++) running.emplace_back(Robot, i, scans, step, &pool, std::ref(stats[i]));
+  for(auto& t : running) t.join();
+  double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  //a robot whose corrected pose ends up, or spends the run, farther off than its odometry
+  //alone has been made worse by the matcher, whatever the average says
+  printf("robot  odom_err_mm  odom_err_deg  odom_mean_mm  fixed_err_mm  fixed_err_deg  fixed_mean_mm  "
+         "matched  rejected  match_ms_p50  match_ms_p99\n");
+  RobotStats total;
+  int worse = 0;
+  for(int i = 0; i < robots; i++)
+  {
+    RobotStats& s = stats[i];
+    std::sort(s.matchMS.begin(), s.matchMS.end());
+    bool regressed = s.correctedError > s.odometryError || s.correctedMean > s.odometryMean;
+    printf("%5d  %11.0f  %12.1f  %12.0f  %12.0f  %13.1f  %13.0f  %7llu  %8llu  %12.3f  %12.3f%s\n", i,
+           s.odometryError, s.odometryHeading * 180 / M_PI, s.odometryMean, s.correctedError,
+           s.correctedHeading * 180 / M_PI, s.correctedMean, (unsigned long long)s.matched,
+           (unsigned long long)s.rejected, s.matchMS[s.matchMS.size() / 2],
+           s.matchMS[s.matchMS.size() * 99 / 100], regressed ? "  WORSE" : "");
+
+    worse += regressed;
+    total.odometryError += s.odometryError / robots;
+    total.odometryHeading += s.odometryHeading / robots;
+    total.odometryMean += s.odometryMean / robots;
+    total.correctedError += s.correctedError / robots;
+    total.correctedHeading += s.correctedHeading / robots;
+    total.correctedMean += s.correctedMean / robots;
+  }
+
+  printf(" mean  %11.0f  %12.1f  %12.0f  %12.0f  %13.1f  %13.0f\n", total.odometryError,
+         total.odometryHeading * 180 / M_PI, total.odometryMean, total.correctedError,
+         total.correctedHeading * 180 / M_PI, total.correctedMean);
+  printf("%d of %d robots worse than odometry alone\n", worse, robots);
+
+  printf("%d robots x %d scans in %.2f s (%.0f scans/s) with %u pool threads\n", robots, scans, wall,
+         robots * scans / wall, pool.Threads());
+  return 0;
+}
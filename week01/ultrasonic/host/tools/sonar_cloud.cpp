@@ -0,0 +1,143 @@
+/*
+ * Turns the sonar stream into a point cloud, for the navigation stack or for looking at in
+ * a point-cloud viewer.
+ *
+ *   sonar_cloud --mounts FILE [--odometry FILE] [--out FILE] [--shm NAME] [--batch N] [SOURCE]
+ *
+ * SOURCE is the serial device (default /dev/ttyACM0), a recording, or - for stdin.
+ *   --mounts FILE    the mounting table: rows of "sensor x y z yaw pitch" (mm, degrees)
+ *   --odometry FILE  robot poses as CSV "device_ms,x_mm,y_mm,theta_rad"; without it, points
+ *                    are left in the robot frame. Readings from before the first pose are
+ *                    left out (and counted)
+ *   --out FILE       writes the points to a .ply or .pcd file
+ *   --shm NAME       publishes the points to a shared-memory ring (see cloud_output.h)
+ *   --batch N        transforms this many readings at a time (default 64); a batch is also
+ *                    flushed when the input goes quiet
+ */
+
+#include "sonar/cloud_output.h"
+#include "sonar/point_cloud.h"
+#include "sonar/serial_port.h"
+#include "sonar/stream_parser.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <poll.h>
+#include <unistd.h>
+
+int main(int argc, char* argv[])
+{
+  std::string source = "/dev/ttyACM0";
+  const char* mountsPath = nullptr;
+  const char* odometryPath = nullptr;
+  const char* outPath = nullptr;
+  const char* shmName = nullptr;
+  size_t batchSize = 64;
+
+  for(int i = 1; i < argc; i++)
+  {
+    if(!strcmp(argv[i], "--mounts") && i + 1 < argc) mountsPath = argv[++i];
+    else if(!strcmp(argv[i], "--odometry") && i + 1 < argc) odometryPath = argv[++i];
+    else if(!strcmp(argv[i], "--out") && i + 1 < argc) outPath = argv[++i];
+    else if(!strcmp(argv[i], "--shm") && i + 1 < argc) shmName = argv[++i];
+    else if(!strcmp(argv[i], "--batch") && i + 1 < argc) batchSize = strtoul(argv[++i], nullptr, 0);
+    else source = argv[i];
+  }
+
+  if(!mountsPath || (!outPath && !shmName))
+  {
+    fprintf(stderr, "usage: %s --mounts FILE [--odometry FILE] [--out FILE] [--shm NAME] "
+                    "[--batch N] [SOURCE]\n", argv[0]);
+    return 2;
+  }
+
+  sonar::MountingTable mounts;
+  if(!mounts.Load(mountsPath))
+  {
+    fprintf(stderr, "can't read the mounting table %s\n", mountsPath);
+    return 1;
+  }
+
+  sonar::Odometry odometry;
+  if(odometryPath && !odometry.Load(odometryPath))
+  {
+    fprintf(stderr, "can't read %s: %s\n", odometryPath, strerror(errno));
+    return 1;
+  }
+
+  sonar::CloudFile file;
+  if(outPath && !file.Open(outPath, sonar::CloudFile::FormatFor(outPath)))
+  {
+    fprintf(stderr, "can't open %s: %s\n", outPath, strerror(errno));
+    return 1;
+  }
+
+  sonar::SharedCloud shared;
+  if(shmName && !shared.Create(shmName, 65536))
+  {
+    fprintf(stderr, "can't create %s: %s\n", shmName, strerror(errno));
+    return 1;
+  }
+
+  int fd = sonar::OpenStream(source);
+  if(fd < 0)
+  {
+    fprintf(stderr, "can't open %s: %s\n", source.c_str(), strerror(errno));
+    return 1;
+  }
+
+  sonar::CloudBuilder builder(mounts);
+  sonar::PointBatch robot, world;
+  uint64_t points = 0, skipped = 0;
+
+  auto flush = [&]
+  {
+    robot.Clear();
+    world.Clear();
+    builder.Flush(&robot, odometryPath ? &world : nullptr, &odometry);
+
+    const sonar::PointBatch& out = odometryPath ? world : robot;
+    points += out.Size();
+    if(outPath) file.Write(out);
+    if(shmName) shared.Write(out);
+  };
+
+  sonar::StreamParser parser([&](const sonar::Sample& s)
+  {
+    if(!builder.Add(s)) skipped++;
+    else if(builder.Pending() >= batchSize) flush();
+  });
+
+  char buffer[4096];
+  for(;;)
+  {
+    //don't sit on a part-filled batch while the sensor is quiet
+    struct pollfd p = {fd, POLLIN, 0};
+    if(builder.Pending() && poll(&p, 1, 100) == 0)
+    {
+      flush();
+      continue;
+    }
+
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+    if(n <= 0) break;
+    parser.Feed(buffer, n, 0);
+  }
+
+  flush();
+  file.Close();
+  if(shmName) shared.Unlink();
+
+  fprintf(stderr, "%llu points, %llu readings skipped (no echo, or no mounting for the sensor)\n",
+          (unsigned long long)points, (unsigned long long)skipped);
+  if(builder.Unposed())
+  {
+    fprintf(stderr, "%llu readings left out: no pose for them (before the first odometry)\n",
+            (unsigned long long)builder.Unposed());
+  }
+  return 0;
+}
@@ -0,0 +1,580 @@
+/*
+ * A live plot of the ranges in a browser, for more sensors and faster pings than a serial
+ * monitor can keep up with.
+ *
+ *   sonar_dashboard [--port N] [--history S] [--demo N] [--rate HZ] [SOURCE...]
+ *
+ * Each SOURCE is a serial device, a recording, or - for stdin. Sources are numbered 0, 1, ...
+ * in the order given, and each sensor heard on a source (a record's sensor field, 0 if it
+ * has none) gets its own lane, labelled with both. Open http://127.0.0.1:8080/ to watch.
+ *   --port N     port to serve on, on the loopback interface only (default 8080)
+ *   --history S  seconds of readings to keep for each sensor (default 600)
+ *   --demo N     no sources: makes up one with N sensors pinging at --rate, to try it out
+ *   --rate HZ    the demo's ping rate (default 40)
+ *
+ * Each source is read through its own Fanout, and its consumer sorts the samples into a
+ * history per sensor, made when the sensor is first heard. The page asks for
+ * the last so many seconds a few times a second, and each sensor's readings in that window
+ * are cut down to about one point per pixel with LTTB (see sonar/lttb.h) before they're
+ * sent, so the browser draws the same few thousand points whether the window holds ten
+ * seconds or ten minutes. Readings without an echo aren't plotted; they leave a gap.
+ *
+ * Live sources are plotted against the host's clock. A recording is read as fast as the disk
+ * goes, so it's plotted against the device's millis() instead, and stays up after it ends.
+ */
+
+#include "sonar/fanout.h"
+#include "sonar/lttb.h"
+#include "sonar/serial_port.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+//the most readings per second we make room for, per sensor
+static const double MAX_RATE = 100;
+
+//the most points per sensor the page can ask for
+static const size_t MAX_POINTS = 4096;
+
+/*
+ * The readings from one sensor: a ring of (seconds, mm), oldest first, appended to by its
+ * consumer and copied out by the server.
+ */
+class RangeHistory
+{
+public:
+  explicit RangeHistory(size_t capacity) : t(capacity), mm(capacity) {}
+
+  void Add(double seconds, double distanceMM)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t slot = (head + count) % t.size();
+    if(count < t.size()) count++;
+    else head = (head + 1) % t.size();
+    t[slot] = seconds;
+    mm[slot] = distanceMM;
+  }
+
+  double Latest(void)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return count ? t[(head + count - 1) % t.size()] : -INFINITY;
+  }
+
+  //copies out the readings since the given time
+  void CopySince(double since, std::vector<double>& outT, std::vector<double>& outMM)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    //the times only go up, so the window starts at a binary search
+    size_t lo = 0, hi = count;
+    while(lo < hi)
+    {
+      size_t mid = (lo + hi) / 2;
+      if(t[(head + mid) % t.size()] < since) lo = mid + 1;
+      else hi = mid;
+    }
+
+    outT.clear();
+    outMM.clear();
+    for(size_t i = lo; i < count; i++)
+    {
+      size_t slot = (head + i) % t.size();
+      outT.push_back(t[slot]);
+      outMM.push_back(mm[slot]);
+    }
+  }
+
+private:
+  std::mutex mutex;
+  std::vector<double> t, mm;
+  size_t head = 0, count = 0;
+};
+
+//one sensor on one source
+struct Lane
+{
+  uint8_t sensor;
+  std::unique_ptr<RangeHistory> history;
+};
+
+struct Source
+{
+  std::string path;
+  int fd = -1;
+  bool live = false;
+  sonar::Fanout fanout;
+  sonar::Subscription* sub = nullptr;
+
+  //by sensor; the consumer adds to them and the server reads them, under the mutex
+  std::mutex mutex;
+  std::vector<Lane> lanes;
+};
+
+static uint64_t startNanos;
+static size_t historyCapacity;
+
+//moves one source's samples from its subscription into its sensors' histories
+static void Consumer(Source* source)
+{
+  sonar::Sample s;
+  bool first = true;
+  uint32_t firstMillis = 0;
+  RangeHistory* histories[256] = {};
+
+  while(source->sub->Wait(s))
+  {
+    if(s.kind != sonar::SampleKind::Range || s.distanceMM10 <= 0) continue;
+
+    RangeHistory*& history = histories[s.sensor];
+    if(!history)
+    {
+      Lane lane = {s.sensor, std::unique_ptr<RangeHistory>(new RangeHistory(historyCapacity))};
+      history = lane.history.get();
+
+      std::lock_guard<std::mutex> lock(source->mutex);
+      auto at = std::find_if(source->lanes.begin(), source->lanes.end(),
+                             [&](const Lane& l) {return l.sensor > s.sensor;});
+      source->lanes.insert(at, std::move(lane));
+    }
+
+    double seconds;
+    if(source->live) seconds = (s.hostNanos - startNanos) / 1e9;
+    else
+    {
+      if(first) firstMillis = s.deviceMillis;
+      seconds = (uint32_t)(s.deviceMillis - firstMillis) / 1e3;
+    }
+    first = false;
+
+    history->Add(seconds, s.distanceMM10 / 10.0);
+  }
+}
+
+/*
+ * Makes up readings for the demo, as firmware with several sensors would print them, and
+ * feeds them in through the source's fanout: a slow swing, some noise, the odd spike, and
+ * dropouts.
+ */
+static void Demo(Source* source, int sensors, double rate)
+{
+  std::mt19937 random(1);
+  std::normal_distribution<double> noise(0, 8);
+  std::uniform_real_distribution<double> uniform(0, 1);
+
+  uint64_t period = 1e9 / rate;
+  uint64_t next = sonar::NowNanos();
+  char line[64];
+
+  for(;;)
+  {
+    uint64_t now = sonar::NowNanos();
+    if(now < next)
+    {
+      std::this_thread::sleep_for(std::chrono::nanoseconds(next - now));
+      continue;
+    }
+    next += period;
+
+    double seconds = (now - startNanos) / 1e9;
+    for(int i = 0; i < sensors; i++)
+    {
+      double mm = 1200 + 700 * sin(seconds * (0.3 + 0.11 * i) + i) + noise(random);
+      double p = uniform(random);
+      if(p < 0.03) continue;
+      if(p > 0.995) mm = 300 + 3000 * uniform(random);
+
+      uint32_t us = mm * 2 / 0.343;
+      int n = snprintf(line, sizeof(line), "%u\t%u\t%u\t%.1f\t%d\n", (uint32_t)(seconds * 1000), us * 2, us,
+                       mm, i);
+      source->fanout.Feed(line, n, sonar::NowNanos());
+    }
+  }
+}
+
+static std::string Query(const std::string& target, const char* name)
+{
+  size_t q = target.find('?');
+  if(q == std::string::npos) return "";
+
+  std::string key = std::string(name) + "=";
+  for(size_t p = q + 1; p < target.size();)
+  {
+    size_t end = target.find('&', p);
+    if(end == std::string::npos) end = target.size();
+    if(!target.compare(p, key.size(), key)) return target.substr(p + key.size(), end - p - key.size());
+    p = end + 1;
+  }
+  return "";
+}
+
+//appends value as "%.*f" would, but several times faster: there can be tens of thousands
+static void AppendFixed(std::string& out, double value, int decimals)
+{
+  static const double SCALE[] = {1, 10, 100, 1000};
+  int64_t scaled = llround(value * SCALE[decimals]);
+  if(scaled < 0)
+  {
+    out += '-';
+    scaled = -scaled;
+  }
+
+  char digits[24];
+  int n = 0;
+  do
+  {
+    digits[n++] = '0' + scaled % 10;
+    scaled /= 10;
+  }
+  while(scaled || n <= decimals);
+
+  while(n > decimals) out += digits[--n];
+  if(decimals) out += '.';
+  while(n) out += digits[--n];
+}
+
+/*
+ * The readings of every sensor for the last window seconds, each cut down to at most
+ * points, as JSON: times are seconds before now.
+ */
+static std::string Data(std::vector<std::unique_ptr<Source>>& sources, double window, size_t points)
+{
+  uint64_t begin = sonar::NowNanos();
+
+  //the lanes so far; a history stays put once made, so it can be read without the lock
+  struct Shown
+  {
+    size_t source;
+    uint8_t sensor;
+    RangeHistory* history;
+  };
+  std::vector<Shown> shown;
+  for(size_t i = 0; i < sources.size(); i++)
+  {
+    std::lock_guard<std::mutex> lock(sources[i]->mutex);
+    for(auto& lane : sources[i]->lanes) shown.push_back({i, lane.sensor, lane.history.get()});
+  }
+
+  //a live source keeps the plot moving even when nothing's coming in
+  double now = -INFINITY;
+  for(auto& lane : shown) now = std::max(now, lane.history->Latest());
+  for(auto& source : sources)
+  {
+    if(source->live) now = std::max(now, (begin - startNanos) / 1e9);
+  }
+  if(now == -INFINITY) now = 0;
+
+  std::vector<double> t, mm;
+  std::vector<uint32_t> kept(points);
+  std::string json;
+  char field[64];
+
+  snprintf(field, sizeof(field), "{\"window\":%g,\"sensors\":[", window);
+  json += field;
+
+  for(size_t s = 0; s < shown.size(); s++)
+  {
+    shown[s].history->CopySince(now - window, t, mm);
+    size_t n = sonar::LttbSelect(t.data(), mm.data(), t.size(), points, kept.data());
+
+    double span = t.empty() ? 0 : std::min(window, now - t.front());
+    snprintf(field, sizeof(field), "%s{\"source\":%zu,\"sensor\":%u,\"raw\":%zu,\"rate\":%.1f,\"t\":[",
+             s ? "," : "", shown[s].source, shown[s].sensor, t.size(), span > 0 ? t.size() / span : 0.0);
+    json += field;
+    for(size_t i = 0; i < n; i++)
+    {
+      if(i) json += ',';
+      AppendFixed(json, t[kept[i]] - now, 3);
+    }
+    json += "],\"mm\":[";
+    for(size_t i = 0; i < n; i++)
+    {
+      if(i) json += ',';
+      AppendFixed(json, mm[kept[i]], 1);
+    }
+    json += "]}";
+  }
+
+  snprintf(field, sizeof(field), "],\"us\":%.0f}", (sonar::NowNanos() - begin) / 1e3);
+  json += field;
+  return json;
+}
+
+static const char PAGE[] = R"html(<!DOCTYPE html>
+<html><head><meta charset="utf-8"><title>sonar</title>
+<style>
+body {margin: 0; font: 12px monospace; background: #111; color: #ccc}
+#bar {padding: 4px 8px}
+canvas {display: block; width: 100vw; height: calc(100vh - 28px)}
+</style></head>
+<body>
+<div id="bar">window <select id="window">
+<option>10</option><option selected>60</option><option>300</option><option>600</option>
+</select> s <span id="status"></span></div>
+<canvas id="plot"></canvas>
+<script>
+const canvas = document.getElementById('plot');
+const ctx = canvas.getContext('2d');
+const status = document.getElementById('status');
+const colours = ['#4e9', '#49e', '#e94', '#e49', '#9e4', '#94e', '#ee4', '#4ee'];
+
+function draw(data) {
+  const dpr = window.devicePixelRatio || 1;
+  const w = canvas.clientWidth, h = canvas.clientHeight;
+  canvas.width = w * dpr;
+  canvas.height = h * dpr;
+  ctx.setTransform(dpr, 0, 0, dpr, 0, 0);
+  ctx.clearRect(0, 0, w, h);
+
+  // one lane per sensor of each source, each scaled to its own readings
+  const lanes = Math.max(data.sensors.length, 1), laneH = h / lanes;
+  const x = t => w + t / data.window * w;
+  const gap = Math.max(0.5, 3 * data.window / w);
+  let raw = 0, drawn = 0;
+
+  data.sensors.forEach((s, lane) => {
+    const top = lane * laneH;
+    raw += s.raw;
+    drawn += s.t.length;
+    let lo = Math.min(...s.mm), hi = Math.max(...s.mm);
+    if (!(hi > lo)) { lo = 0; hi = 4000; }
+    const pad = (hi - lo) * 0.05;
+    lo -= pad;
+    hi += pad;
+    const y = mm => top + laneH - (mm - lo) / (hi - lo) * laneH;
+
+    ctx.strokeStyle = '#333';
+    ctx.beginPath();
+    ctx.moveTo(0, top + laneH - 0.5);
+    ctx.lineTo(w, top + laneH - 0.5);
+    ctx.stroke();
+
+    ctx.strokeStyle = colours[lane % colours.length];
+    ctx.beginPath();
+    for (let i = 0; i < s.t.length; i++) {
+      if (i && s.t[i] - s.t[i - 1] <= gap) ctx.lineTo(x(s.t[i]), y(s.mm[i]));
+      else ctx.moveTo(x(s.t[i]), y(s.mm[i]));
+    }
+    ctx.stroke();
+
+    ctx.fillStyle = '#ccc';
+    const last = s.mm.length ? s.mm[s.mm.length - 1].toFixed(1) + ' mm' : '-';
+    ctx.fillText('source ' + s.source + ' sensor ' + s.sensor + '  ' + last + '  ' + s.rate.toFixed(1) + ' Hz  ' +
+                 lo.toFixed(0) + '..' + hi.toFixed(0) + ' mm', 6, top + 12);
+  });
+
+  status.textContent = raw + ' readings, ' + drawn + ' drawn, ' + data.us + ' us on the server';
+}
+
+async function update() {
+  try {
+    const points = Math.min(Math.max(canvas.clientWidth, 16), 4096);
+    const response = await fetch('/data?window=' + document.getElementById('window').value +
+                                 '&points=' + points, {cache: 'no-store'});
+    draw(await response.json());
+  } catch (e) {
+    status.textContent = 'no connection';
+  }
+  setTimeout(update, 250);
+}
+update();
+</script>
+</body></html>
+)html";
+
+static void Respond(int client, const char* status, const char* type, const std::string& body)
+{
+  char header[256];
+  int n = snprintf(header, sizeof(header), "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+                   "Cache-Control: no-store\r\nConnection: close\r\n\r\n", status, type, body.size());
+  std::string response(header, n);
+  response += body;
+
+  for(size_t sent = 0; sent < response.size();)
+  {
+    ssize_t k = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+    if(k <= 0) break;
+    sent += k;
+  }
+}
+
+//one request per connection, one connection at a time: it's one page on the same machine
+static void Serve(int listener, std::vector<std::unique_ptr<Source>>* sources)
+{
+  for(;;)
+  {
+    int client = accept(listener, nullptr, nullptr);
+    if(client < 0)
+    {
+      if(errno == EINTR) continue;
+      break;
+    }
+
+    //don't let a stuck client hold up the rest
+    timeval timeout = {2, 0};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    std::string request;
+    char buffer[1024];
+    while(request.find("\r\n\r\n") == std::string::npos && request.size() < 8192)
+    {
+      ssize_t n = recv(client, buffer, sizeof(buffer), 0);
+      if(n <= 0) break;
+      request.append(buffer, n);
+    }
+
+    //"GET /target HTTP/1.1"
+    size_t space = request.find(' ');
+    size_t end = space == std::string::npos ? space : request.find(' ', space + 1);
+    std::string method = request.substr(0, space);
+    std::string target = end == std::string::npos ? "" : request.substr(space + 1, end - space - 1);
+    std::string path = target.substr(0, target.find('?'));
+
+    if(method != "GET") Respond(client, "405 Method Not Allowed", "text/plain", "GET only\n");
+    else if(path == "/") Respond(client, "200 OK", "text/html; charset=utf-8", PAGE);
+    else if(path == "/data")
+    {
+      double window = atof(Query(target, "window").c_str());
+      long points = atol(Query(target, "points").c_str());
+      if(!(window > 0)) window = 60;
+      if(points < 3) points = 1000;
+      if(points > (long)MAX_POINTS) points = MAX_POINTS;
+      Respond(client, "200 OK", "application/json", Data(*sources, window, points));
+    }
+    else Respond(client, "404 Not Found", "text/plain", "not found\n");
+
+    close(client);
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  std::vector<std::string> paths;
+  int port = 8080;
+  double history = 600;
+  int demo = 0;
+  double rate = 40;
+
+  for(int i = 1; i < argc; i++)
+  {
+    if(!strcmp(argv[i], "--port") && i + 1 < argc) port = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--history") && i + 1 < argc) history = atof(argv[++i]);
+    else if(!strcmp(argv[i], "--demo") && i + 1 < argc) demo = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--rate") && i + 1 < argc) rate = atof(argv[++i]);
+    else paths.push_back(argv[i]);
+  }
+  if(paths.empty() && !demo) paths.push_back("/dev/ttyACM0");
+  if(demo) paths.assign(1, "demo");
+
+  startNanos = sonar::NowNanos();
+  historyCapacity = std::max(history, 1.0) * std::max(MAX_RATE, rate);
+
+  std::vector<std::unique_ptr<Source>> sources;
+  for(auto& path : paths)
+  {
+    std::unique_ptr<Source> source(new Source);
+    source->path = path;
+    source->live = true;
+    if(!demo)
+    {
+      source->fd = sonar::OpenStream(path);
+      if(source->fd < 0)
+      {
+        fprintf(stderr, "can't open %s: %s\n", path.c_str(), strerror(errno));
+        return 1;
+      }
+      source->live = isatty(source->fd);
+    }
+
+    //a recording is read as fast as the disk goes, so don't let it overrun the consumer
+    source->sub = source->fanout.Subscribe("dashboard", 1024, source->live ? sonar::OverflowPolicy::DropOldest
+                                                                             : sonar::OverflowPolicy::Block);
+    sources.push_back(std::move(source));
+  }
+
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  int yes = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if(bind(listener, (sockaddr*)&address, sizeof(address)) < 0 || listen(listener, 8) < 0)
+  {
+    fprintf(stderr, "can't listen on port %d: %s\n", port, strerror(errno));
+    return 1;
+  }
+  fprintf(stderr, "serving on http://127.0.0.1:%d/\n", port);
+
+  std::vector<std::thread> consumers;
+  for(auto& source : sources) consumers.emplace_back(Consumer, source.get());
+  std::thread server(Serve, listener, &sources);
+
+  if(demo) Demo(sources[0].get(), demo, rate);
+
+  //one reader for all the sources
+  std::vector<pollfd> pfds;
+  for(auto& source : sources) pfds.push_back({source->fd, POLLIN, 0});
+
+  char buffer[4096];
+  size_t open = sources.size();
+  while(open)
+  {
+    if(poll(pfds.data(), pfds.size(), -1) < 0)
+    {
+      if(errno == EINTR) continue;
+      break;
+    }
+
+    for(size_t i = 0; i < pfds.size(); i++)
+    {
+      if(!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+      ssize_t n = read(pfds[i].fd, buffer, sizeof(buffer));
+      if(n > 0)
+      {
+        sources[i]->fanout.Feed(buffer, n, sonar::NowNanos());
+        continue;
+      }
+
+      fprintf(stderr, "%s: end of stream, %llu records\n", sources[i]->path.c_str(),
+              (unsigned long long)sources[i]->fanout.Parser().Records());
+      sources[i]->fanout.End();
+      close(pfds[i].fd);
+      pfds[i].fd = -1;
+      open--;
+    }
+  }
+
+  for(auto& t : consumers) t.join();
+  for(auto& source : sources)
+  {
+    if(source->sub->Dropped())
+    {
+      fprintf(stderr, "%s: %llu samples dropped\n", source->path.c_str(), (unsigned long long)source->sub->Dropped());
+    }
+  }
+
+  //keep showing what was read
+  fprintf(stderr, "all sources ended; still serving\n");
+  server.join();
+  return 0;
+}
@@ -0,0 +1,142 @@
+/*
+ * Measures how stale the ranges are by the time a consumer sees them, stage by stage, from
+ * a SONAR_TRACE build of the firmware.
+ *
+ *   sonar_latency [--every S] [--sync-ms MS] [--queue N] [SOURCE]
+ *
+ * SOURCE is the serial device (default /dev/ttyACM0), a recording, or - for stdin.
+ *   --every S    prints the histograms every S seconds (default 5), as well as at the end
+ *   --sync-ms MS asks the device for its clock every MS ms (default 1000)
+ *   --queue N    size of the consumer's ring (default 256; drops the oldest from a device)
+ *
+ * The stages on the device (capture->ready->sent) come from the trace alone. Those that
+ * cross to the host need the device's clock, which is only available from a live device:
+ * with a recording they're left out.
+ */
+
+#include "sonar/clock_sync.h"
+#include "sonar/fanout.h"
+#include "sonar/latency_trace.h"
+#include "sonar/serial_port.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include <poll.h>
+#include <unistd.h>
+
+//the first few clock requests go out quickly, so the host stages show up soon
+static const int QUICK_SYNCS = 8;
+static const uint64_t QUICK_SYNC_NS = 100000000ull;
+
+//give up on an answer after this long and ask again
+static const uint64_t SYNC_TIMEOUT_NS = 500000000ull;
+
+static void Consumer(sonar::Subscription* sub, sonar::LatencyTrace* trace, const sonar::ClockSync* sync,
+                     double every)
+{
+  sonar::Sample s;
+  uint64_t lastPrint = sonar::NowNanos();
+  while(sub->Wait(s))
+  {
+    uint64_t now = sonar::NowNanos();
+    trace->Add(s, now);
+
+    if(every > 0 && now - lastPrint >= every * 1e9)
+    {
+      lastPrint = now;
+      trace->Print(stdout);
+      if(sync->Synced())
+      {
+        printf("clock: best round trip %.0f us, drift %.1f ppm\n\n", sync->BestRoundTripNanos() / 1e3,
+               sync->DriftPPM());
+      }
+      else printf("clock: not synced\n\n");
+      fflush(stdout);
+    }
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  std::string source = "/dev/ttyACM0";
+  double every = 5;
+  uint64_t syncPeriod = 1000000000ull;
+  size_t queue = 256;
+
+  for(int i = 1; i < argc; i++)
+  {
+    if(!strcmp(argv[i], "--every") && i + 1 < argc) every = atof(argv[++i]);
+    else if(!strcmp(argv[i], "--sync-ms") && i + 1 < argc) syncPeriod = atof(argv[++i]) * 1e6;
+    else if(!strcmp(argv[i], "--queue") && i + 1 < argc) queue = atoi(argv[++i]);
+    else source = argv[i];
+  }
+
+  int fd = sonar::OpenStream(source);
+  if(fd < 0)
+  {
+    fprintf(stderr, "can't open %s: %s\n", source.c_str(), strerror(errno));
+    return 1;
+  }
+
+  //only a terminal we could open for writing can answer clock requests
+  bool canSync = isatty(fd) && write(fd, "", 0) == 0;
+
+  sonar::ClockSync sync;
+  sonar::LatencyTrace trace(&sync);
+  uint64_t chunkNanos = 0;
+
+  sonar::Fanout fanout([&](const char* line, size_t length)
+  {
+    if(length > 5 && !strncmp(line, "#clk\t", 5))
+    {
+      sync.Reply(strtoul(std::string(line + 5, length - 5).c_str(), nullptr, 10), chunkNanos);
+    }
+  });
+
+  //a recording is read as fast as the disk goes, so don't let it overrun the consumer
+  auto* sub = fanout.Subscribe("latency", queue, isatty(fd) ? sonar::OverflowPolicy::DropOldest 
+                                                            : sonar::OverflowPolicy::Block);
+  std::thread consumer(Consumer, sub, &trace, &sync, every);
+
+  int syncs = 0;
+  uint64_t lastRequest = 0;
+  char buffer[4096];
+  pollfd pfd = {fd, POLLIN, 0};
+
+  for(;;)
+  {
+    uint64_t now = sonar::NowNanos();
+    uint64_t period = syncs < QUICK_SYNCS ? QUICK_SYNC_NS : syncPeriod;
+    bool due = now - lastRequest >= (sync.Pending() ? SYNC_TIMEOUT_NS : period);
+    if(canSync && due)
+    {
+      //stamp before writing, so the write's own time is inside the round trip
+      sync.Request(sonar::NowNanos());
+      if(write(fd, "T", 1) != 1) canSync = false;
+      lastRequest = now;
+      syncs++;
+    }
+
+    if(poll(&pfd, 1, 50) < 0 && errno != EINTR) break;
+    if(!(pfd.revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+    if(n <= 0) break;
+
+    chunkNanos = sonar::NowNanos();
+    fanout.Feed(buffer, n, chunkNanos);
+  }
+
+  fanout.End();
+  consumer.join();
+
+  trace.Print(stdout);
+  if(sub->Dropped()) printf("%llu samples dropped by the consumer\n", (unsigned long long)sub->Dropped());
+  if(!sync.Synced()) printf("no clock sync, so no host stages (is this a SONAR_TRACE build on a live port?)\n");
+  return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * Reads the sonar stream once and feeds several consumers from it, as an example of 
+ * (and a test bed for) the fan-out library.
+ *
+ *   sonar_tap [--log FILE] [--stats] [--print] [SOURCE]
+ *
+ * SOURCE is the serial device (default /dev/ttyACM0), a recording, or - for stdin.
+ *   --log FILE  writes every sample to FILE as CSV (backpressure: never drops)
+ *   --stats     prints the sample rate and closest range once a second (keeps the latest)
+ *   --print     echoes samples to stdout (drops new samples if it falls behind)
+ */
+
+#include "sonar/fanout.h"
+#include "sonar/serial_port.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+static void Logger(sonar::Subscription* sub, FILE* out)
+{
+  fprintf(out, "host_ns,device_ms,kind,counts,us,angle,mm\n");
+
+  sonar::Sample s;
+  while(sub->Wait(s))
+  {
+    fprintf(out, "%llu,%u,%d,%u,%u,%d,%.1f\n", (unsigned long long)s.hostNanos, s.deviceMillis, 
+            (int)s.kind, s.counts, s.pulseUS, s.angle, s.distanceMM10 / 10.0);
+  }
+
+  fclose(out);
+}
+
+static void Stats(sonar::Subscription* sub)
+{
+  sonar::Sample s;
+  uint64_t windowStart = sonar::NowNanos();
+  unsigned count = 0;
+  int32_t closest = INT32_MAX;
+
+  while(sub->Wait(s))
+  {
+    count++;
+    if(s.distanceMM10 < closest) closest = s.distanceMM10;
+
+    if(s.hostNanos - windowStart >= 1000000000ull)
+    {
+      fprintf(stderr, "%u samples/s, closest %.1f mm, dropped %llu\n", count, closest / 10.0, 
+              (unsigned long long)sub->Dropped());
+      windowStart = s.hostNanos;
+      count = 0;
+      closest = INT32_MAX;
+    }
+  }
+}
+
+static void Printer(sonar::Subscription* sub)
+{
+  sonar::Sample s;
+  while(sub->Wait(s)) printf("%u\t%.1f\n", s.deviceMillis, s.distanceMM10 / 10.0);
+}
+
+int main(int argc, char* argv[])
+{
+  std::string source = "/dev/ttyACM0";
+  const char* logPath = nullptr;
+  bool stats = false, print = false;
+
+  for(int i = 1; i < argc; i++)
+  {
+    if(!strcmp(argv[i], "--log") && i + 1 < argc) logPath = argv[++i];
+    else if(!strcmp(argv[i], "--stats")) stats = true;
+    else if(!strcmp(argv[i], "--print")) print = true;
+    else source = argv[i];
+  }
+
+  int fd = sonar::OpenStream(source);
+  if(fd < 0)
+  {
+    fprintf(stderr, "can't open %s: %s\n", source.c_str(), strerror(errno));
+    return 1;
+  }
+
+  sonar::Fanout fanout;
+  std::vector<std::thread> consumers;
+
+  if(logPath)
+  {
+    FILE* out = fopen(logPath, "w");
+    if(!out)
+    {
+      fprintf(stderr, "can't open %s: %s\n", logPath, strerror(errno));
+      return 1;
+    }
+    auto* sub = fanout.Subscribe("logger", 4096, sonar::OverflowPolicy::Block);
+    consumers.emplace_back(Logger, sub, out);
+  }
+
+  if(stats)
+  {
+    auto* sub = fanout.Subscribe("stats", 64, sonar::OverflowPolicy::DropOldest);
+    consumers.emplace_back(Stats, sub);
+  }
+
+  if(print)
+  {
+    auto* sub = fanout.Subscribe("print", 256, sonar::OverflowPolicy::DropNewest);
+    consumers.emplace_back(Printer, sub);
+  }
+
+  char buffer[4096];
+  ssize_t n;
+  while((n = read(fd, buffer, sizeof(buffer))) > 0) fanout.Feed(buffer, n, sonar::NowNanos());
+
+  fanout.End();
+  for(auto& t : consumers) t.join();
+
+  fprintf(stderr, "%llu records, %llu other lines\n", (unsigned long long)fanout.Parser().Records(),
+          (unsigned long long)fanout.Parser().Rejected());
+  return 0;
+}
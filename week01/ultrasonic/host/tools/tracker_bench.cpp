@@ -0,0 +1,411 @@
+/*
+ * Runs the tracker against simulated robots with a ring of sonars among moving obstacles, to
+ * check that it holds on to them and to time it with many robots sharing a worker pool.
+ *
+ *   tracker_bench [--robots N] [--seconds S] [--sensors N] [--targets N] [--jpda] [--threads N]
+ *
+ * Each robot sits in the middle of a 6 m square with N sensors evenly spaced around it, fired
+ * one after another, 20 ms apart; the tracker steps once per round of the ring. The targets
+ * (150 mm radius, like a leg or a small robot) wander at walking speed and bounce off the
+ * edges. The simulated sonar hears the nearest target anywhere in its cone, misses 5% of the
+ * time, and 2% of the time hears something that isn't there.
+ *
+ * A single sonar can't place a target across its beam better than the beam's width, which
+ * is over 300 mm beyond about 1.2 m, so a track is on a target if it's within 300 mm of it
+ * along the line of sight and within the beam's half-width (widened by the target's radius)
+ * across it. Reported: how often each target had a confirmed track on it, the position
+ * error of those tracks, how many times a target's track changed identity (in all, and
+ * while the target was held from one step to the next), confirmed tracks on nothing (and of
+ * those, how many are over a metre from any target), and the time per step. For scale, it
+ * also reports how often a target was heard by some sensor in the round, and how often
+ * tracks were within 300 mm of targets against how often the reading that heard a target
+ * was (the most a tracker can do on a beam's axis). The first robot is also run on its own
+ * first, counting heap allocations in Add() and Step() (there should be none).
+ *
+ * It passes, and exits 0, if targets are tracked at least 90% as often as they're heard, a
+ * held target changes identity at most twice a minute, and there's at most one false track
+ * per 20 target-steps.
+ */
+
+#include "sonar/tracker.h"
+#include "sonar/worker_pool.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <random>
+#include <vector>
+
+//counts every allocation, so we can check the tracker doesn't make any
+static std::atomic<uint64_t> allocations{0};
+
+void* operator new(size_t size)
+{
+  allocations++;
+  if(void* p = malloc(size)) return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {free(p);}
+void operator delete(void* p, size_t) noexcept {free(p);}
+
+namespace
+{
+
+const double ARENA = 6000;            //mm, square, centred on the robot
+const double TARGET_RADIUS = 150;
+const double SPEED = 800;             //mm/s
+const double HALF_BEAM = 0.26;
+const double MAX_RANGE = 4000;
+const double PING_INTERVAL = 0.02;    //s
+const double TRACKED_WITHIN = 300;    //mm
+const double PHANTOM_BEYOND = 1000;   //mm
+
+//the pass marks
+const double TRACKED_OF_HEARD = 0.9;
+const double HELD_SWITCHES_PER_MINUTE = 2;
+const double FALSE_PER_TARGET_STEP = 0.05;
+
+struct Target
+{
+  double x, y, vx, vy;
+};
+
+struct Robot
+{
+  std::mt19937 rng;
+  std::vector<Target> targets;
+  sonar::Tracker tracker;
+  double time = 0;
+
+  //per target: the track last on it (0 for none) and the step it was, whether a sensor heard
+  //it this round and if so where (on the beam's axis), and the stats
+  std::vector<uint32_t> lastTrack;
+  std::vector<uint64_t> lastTracked;
+  std::vector<uint8_t> heard;
+  std::vector<double> heardX, heardY;
+  uint64_t targetSteps = 0, trackedSteps = 0, heardSteps = 0, switches = 0, heldSwitches = 0;
+  uint64_t nearSteps = 0, heardNearSteps = 0, falseTracks = 0, phantoms = 0;
+  uint64_t steps = 0;
+  double squaredError = 0;
+
+  Robot(unsigned seed, int targetCount, const sonar::TrackerConfig& config)
+    : rng(seed), tracker(config), lastTrack(targetCount, 0), lastTracked(targetCount, 0),
+      heard(targetCount, 0), heardX(targetCount), heardY(targetCount)
+  {
+    std::uniform_real_distribution<double> position(-ARENA / 2 + 500, ARENA / 2 - 500);
+    std::uniform_real_distribution<double> heading(-M_PI, M_PI);
+    for(int i = 0; i < targetCount; i++)
+    {
+      //not right on top of the robot
+      Target t;
+      do
+      {
+        t.x = position(rng);
+        t.y = position(rng);
+      } while(std::hypot(t.x, t.y) < 600);
+
+      double h = heading(rng);
+      t.vx = SPEED * std::cos(h);
+      t.vy = SPEED * std::sin(h);
+      targets.push_back(t);
+    }
+  }
+
+  void Move(double dt)
+  {
+    std::normal_distribution<double> turn(0, 0.5 * std::sqrt(dt));
+    for(Target& t : targets)
+    {
+      double h = std::atan2(t.vy, t.vx) + turn(rng);
+      t.vx = SPEED * std::cos(h);
+      t.vy = SPEED * std::sin(h);
+      t.x += t.vx * dt;
+      t.y += t.vy * dt;
+      if(std::fabs(t.x) > ARENA / 2) t.vx = -t.vx;
+      if(std::fabs(t.y) > ARENA / 2) t.vy = -t.vy;
+
+      //don't drive through the robot
+      if(std::hypot(t.x, t.y) < 400)
+      {
+        t.vx = t.x * SPEED / std::hypot(t.x, t.y);
+        t.vy = t.y * SPEED / std::hypot(t.x, t.y);
+      }
+    }
+  }
+
+  double Ping(double heading)
+  {
+    std::uniform_real_distribution<double> uniform(0, 1);
+    std::normal_distribution<double> noise(0, 8);
+
+    if(uniform(rng) < 0.02) return 200 + uniform(rng) * (MAX_RANGE - 200);
+    if(uniform(rng) < 0.05) return 0;
+
+    double nearest = 0;
+    size_t source = 0;
+    for(size_t k = 0; k < targets.size(); k++)
+    {
+      const Target& t = targets[k];
+      double d = std::hypot(t.x, t.y);
+      double off = std::remainder(std::atan2(t.y, t.x) - heading, 2 * M_PI);
+      if(std::fabs(off) > HALF_BEAM + std::asin(std::min(1.0, TARGET_RADIUS / d))) continue;
+      double r = d - TARGET_RADIUS;
+      if(r < MAX_RANGE && (!nearest || r < nearest))
+      {
+        nearest = r;
+        source = k;
+      }
+    }
+    if(!nearest) return 0;
+
+    double range = nearest + noise(rng);
+    heard[source] = 1;
+    heardX[source] = range * std::cos(heading);
+    heardY[source] = range * std::sin(heading);
+    return range;
+  }
+
+  //one round of the ring and a tracker step
+  void Round(int sensors)
+  {
+    for(int s = 0; s < sensors; s++)
+    {
+      Move(PING_INTERVAL);
+      time += PING_INTERVAL;
+
+      sonar::Sample sample;
+      sample.sensor = s;
+      sample.deviceMillis = uint32_t(time * 1000 + 0.5);
+      sample.distanceMM10 = int32_t(Ping(2 * M_PI * s / sensors) * 10);
+
+      sonar::SensorMount mount;
+      mount.x = 80 * std::cos(2 * M_PI * s / sensors);
+      mount.y = 80 * std::sin(2 * M_PI * s / sensors);
+      mount.yaw = 2 * M_PI * s / sensors;
+      tracker.Add(sonar::MakeMeasurement(sample, mount, sonar::Pose2D()));
+    }
+
+    tracker.Step();
+    Score();
+  }
+
+  //echoes come from the side facing the robot, so that's where a track should be
+  static void NearSide(const Target& t, double& x, double& y)
+  {
+    double scale = 1 - TARGET_RADIUS / std::hypot(t.x, t.y);
+    x = t.x * scale;
+    y = t.y * scale;
+  }
+
+  //whether a track is on a target, to the resolution of a sonar; if so, how far off it is
+  static bool On(const sonar::Track& track, const Target& t, double& distance)
+  {
+    double x, y;
+    NearSide(t, x, y);
+    double range = std::hypot(x, y);
+    double ex = track.x[0] - x, ey = track.x[1] - y;
+    double along = std::fabs(ex * x + ey * y) / range, across = std::fabs(ey * x - ex * y) / range;
+
+    double half = HALF_BEAM + std::asin(std::min(1.0, TARGET_RADIUS / (range + TARGET_RADIUS)));
+    if(along > TRACKED_WITHIN || across > std::max(TRACKED_WITHIN, range * std::tan(half))) return false;
+    distance = std::hypot(ex, ey);
+    return true;
+  }
+
+  void Score(void)
+  {
+    steps++;
+    const sonar::Track* tracks = tracker.Tracks();
+    size_t n = tracker.TrackCount();
+
+    for(size_t k = 0; k < targets.size(); k++)
+    {
+      //only count targets a sonar could see
+      const Target& t = targets[k];
+      double range = std::hypot(t.x, t.y);
+      bool wasHeard = heard[k];
+      heard[k] = 0;
+      if(range > MAX_RANGE - 200) continue;
+      targetSteps++;
+      heardSteps += wasHeard;
+
+      double x, y;
+      NearSide(t, x, y);
+      if(wasHeard && std::hypot(heardX[k] - x, heardY[k] - y) < TRACKED_WITHIN) heardNearSteps++;
+
+      //the nearest track on it; but as in CLEAR MOT, it keeps the one it had while that's on it
+      bool held = lastTracked[k] == steps - 1;
+      const sonar::Track* best = nullptr;
+      double bestDistance = INFINITY;
+      for(size_t i = 0; i < n; i++)
+      {
+        double d;
+        if(tracks[i].status != sonar::TrackStatus::Confirmed || !On(tracks[i], t, d)) continue;
+        if(d < bestDistance || (held && tracks[i].id == lastTrack[k]))
+        {
+          bestDistance = d;
+          best = &tracks[i];
+        }
+        if(held && tracks[i].id == lastTrack[k]) break;
+      }
+      if(!best) continue;
+
+      trackedSteps++;
+      nearSteps += bestDistance < TRACKED_WITHIN;
+      squaredError += bestDistance * bestDistance;
+      if(lastTrack[k] && lastTrack[k] != best->id)
+      {
+        switches++;
+        heldSwitches += held;
+      }
+      lastTrack[k] = best->id;
+      lastTracked[k] = steps;
+    }
+
+    for(size_t i = 0; i < n; i++)
+    {
+      if(tracks[i].status != sonar::TrackStatus::Confirmed) continue;
+      //by the same test as above
+      bool on = false;
+      double nearestTarget = INFINITY;
+      for(const Target& t : targets)
+      {
+        double d, x, y;
+        on = on || On(tracks[i], t, d);
+        NearSide(t, x, y);
+        nearestTarget = std::min(nearestTarget, std::hypot(tracks[i].x[0] - x, tracks[i].x[1] - y));
+      }
+      if(!on) falseTracks++;
+      if(nearestTarget >= PHANTOM_BEYOND) phantoms++;
+    }
+  }
+};
+
+}
+
+int main(int argc, char* argv[])
+{
+  int robots = 16, sensors = 8, targets = 4;
+  double seconds = 120;
+  int threads = -1;
+  sonar::TrackerConfig config;
+
+  for(int i = 1; i < argc; i++)
+  {
+    if(!strcmp(argv[i], "--robots") && i + 1 < argc) robots = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--seconds") && i + 1 < argc) seconds = atof(argv[++i]);
+    else if(!strcmp(argv[i], "--sensors") && i + 1 < argc) sensors = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--targets") && i + 1 < argc) targets = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--threads") && i + 1 < argc) threads = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--jpda")) config.association = sonar::Association::Probabilistic;
+    else
+    {
+      fprintf(stderr, "usage: %s [--robots N] [--seconds S] [--sensors N] [--targets N] [--jpda] "
+                      "[--threads N]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  config.beamHalfAngle = HALF_BEAM;
+  config.maxRangeMM = MAX_RANGE;
+  config.maxReadings = sensors;
+
+  std::vector<std::unique_ptr<Robot>> fleet;
+  for(int r = 0; r < robots; r++) fleet.emplace_back(new Robot(1000 + r, targets, config));
+
+  int rounds = int(seconds / (PING_INTERVAL * sensors));
+
+  //the first robot's first few seconds on its own, counting allocations in the tracker
+  Robot& first = *fleet[0];
+  uint64_t trackerAllocations = 0;
+  int warmup = std::min(rounds, 50);
+  for(int k = 0; k < warmup; k++)
+  {
+    for(int s = 0; s < sensors; s++)
+    {
+      first.Move(PING_INTERVAL);
+      first.time += PING_INTERVAL;
+
+      sonar::Sample sample;
+      sample.sensor = s;
+      sample.deviceMillis = uint32_t(first.time * 1000 + 0.5);
+      sample.distanceMM10 = int32_t(first.Ping(2 * M_PI * s / sensors) * 10);
+
+      sonar::SensorMount mount;
+      mount.yaw = 2 * M_PI * s / sensors;
+      sonar::Measurement m = sonar::MakeMeasurement(sample, mount, sonar::Pose2D());
+
+      uint64_t before = allocations;
+      first.tracker.Add(m);
+      trackerAllocations += allocations - before;
+    }
+
+    uint64_t before = allocations;
+    first.tracker.Step();
+    trackerAllocations += allocations - before;
+    first.Score();
+  }
+
+  sonar::WorkerPool pool(threads < 0 ? sonar::WorkerPool::DefaultThreads() : threads);
+  auto start = std::chrono::steady_clock::now();
+  pool.Run(fleet.size(), [&](size_t r)
+  {
+    for(int k = r ? 0 : warmup; k < rounds; k++) fleet[r]->Round(sensors);
+  });
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  uint64_t targetSteps = 0, trackedSteps = 0, heardSteps = 0, switches = 0, heldSwitches = 0;
+  uint64_t nearSteps = 0, heardNearSteps = 0, falseTracks = 0, phantoms = 0;
+  uint64_t steps = 0;
+  double squaredError = 0;
+  for(auto& r : fleet)
+  {
+    targetSteps += r->targetSteps;
+    trackedSteps += r->trackedSteps;
+    heardSteps += r->heardSteps;
+    switches += r->switches;
+    heldSwitches += r->heldSwitches;
+    nearSteps += r->nearSteps;
+    heardNearSteps += r->heardNearSteps;
+    falseTracks += r->falseTracks;
+    phantoms += r->phantoms;
+    steps += r->steps;
+    squaredError += r->squaredError;
+  }
+
+  double tracked = double(trackedSteps) / std::max<uint64_t>(targetSteps, 1);
+  double heard = double(heardSteps) / std::max<uint64_t>(targetSteps, 1);
+  double targetMinutes = targetSteps * PING_INTERVAL * sensors / 60;
+  double heldRate = heldSwitches / std::max(targetMinutes, 1e-9);
+  double falseRate = double(falseTracks) / std::max<uint64_t>(targetSteps, 1);
+
+  printf("%d robots x %d sensors, %d targets each, %.0f s, %s association\n", robots, sensors, targets,
+         seconds, config.association == sonar::Association::Assignment ? "assignment" : "JPDA");
+  printf("tracked %.1f%% of target-steps (heard %.1f%%), error %.0f mm rms\n", 100 * tracked, 100 * heard,
+         std::sqrt(squaredError / std::max<uint64_t>(trackedSteps, 1)));
+  printf("%llu identity switches, %llu of them (%.2f per target-minute) while held\n",
+         (unsigned long long)switches, (unsigned long long)heldSwitches, heldRate);
+  printf("%.2f false tracks per step, %.2f of them over %.0f mm from any target\n",
+         double(falseTracks) / std::max<uint64_t>(steps, 1), double(phantoms) / std::max<uint64_t>(steps, 1),
+         PHANTOM_BEYOND);
+  printf("within %.0f mm of a target in %.1f%% of target-steps; a reading was in %.1f%%\n", TRACKED_WITHIN,
+         100.0 * nearSteps / std::max<uint64_t>(targetSteps, 1),
+         100.0 * heardNearSteps / std::max<uint64_t>(targetSteps, 1));
+  printf("%.2f us per step (%u threads), %llu allocations in Add/Step\n",
+         elapsed * 1e6 * (pool.Threads() + 1) / std::max<uint64_t>(steps - warmup, 1), pool.Threads() + 1,
+         (unsigned long long)trackerAllocations);
+
+  bool pass = tracked >= TRACKED_OF_HEARD * heard && heldRate <= HELD_SWITCHES_PER_MINUTE &&
+              falseRate <= FALSE_PER_TARGET_STEP;
+  printf("%s: tracked %.0f%% of heard (want %.0f%%), %.2f held switches per target-minute (want at most "
+         "%.0f), %.3f false tracks per target-step (want at most %.2f)\n", pass ? "PASS" : "FAIL",
+         100 * tracked / std::max(heard, 1e-9), 100 * TRACKED_OF_HEARD, heldRate, HELD_SWITCHES_PER_MINUTE,
+         falseRate, FALSE_PER_TARGET_STEP);
+  return pass ? 0 : 1;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+/*
+ * Free-running ADC that cycles through a list of channels from its interrupt.
+ *
+ * The ADC converts continuously (about 9600 conversions/s with the /128 ADC clock), and the
+ * ADC ISR banks each result and moves the multiplexer on to the next channel, so analog
+ * sensors are sampled at a steady rate without loop() ever waiting on a conversion. Each 
+ * channel's samples are summed in groups of ADC_OVERSAMPLE, and the latest sum is published
+ * for AdcPipelineTake().
+ *
+ * In free-running mode the next conversion has already started (on the old channel) by the
+ * time the ISR runs, so a new multiplexer setting applies to the conversion after that. The
+ * ISR tracks which channel each conversion in the pipeline belongs to.
+ *
+ * The ISR is short (a few us), and it never touches timer 3, so it runs alongside the echo 
+ * capture: the capture time is latched by the hardware, not by the ISR. It does cost a few 
+ * percent of the CPU at this conversion rate.
+ *
+ * Arduino's analogRead() can't be used while the pipeline runs -- it waits for ADSC to clear, 
+ * which it never does in free-running mode. Use AdcPipelineRead() instead, which slips a 
+ * one-off conversion into the rotation.
+ *
+ * Enable with -DSONAR_IR.
+ */
+
+#include <stdint.h>
+
+const uint8_t ADC_MAX_CHANNELS = 4;
+
+//samples summed per published value; the sum has 13 bits
+const uint8_t ADC_OVERSAMPLE = 8;
+
+/*
+ * Starts converting the given ADC channels (0-13, as analogPinToChannel() gives them; 8-13
+ * are ADC8-ADC13), with AVcc as the reference. Returns false if there are too many.
+ */
+bool AdcPipelineBegin(const uint8_t* channels, uint8_t count);
+
+void AdcPipelineStop(void);
+
+/*
+ * If a new sum has been published for the given slot (index into the channel list) since the 
+ * last call, copies it to sum and returns true.
+ */
+bool AdcPipelineTake(uint8_t slot, uint16_t& sum);
+
+/*
+ * One conversion (10 bits) of any channel, taken in turn with the others. Blocks for up to 
+ * three conversion times (about 300 us) -- about what analogRead() takes.
+ */
+uint16_t AdcPipelineRead(uint8_t channel);
@@ -0,0 +1,16 @@
+#pragma once
+
+/*
+ * Synthetic interrupt load, for seeing how the echo capture methods hold up when the CPU has
+ * other things to do (see tools/capture_bench.py).
+ *
+ * Timer 1 fires a compare match interrupt hz times a second, and the ISR spins for busyUS.
+ * That stands in for the motor encoders, a servo, or a busy serial port: it steals the CPU
+ * at times unrelated to the echo, and holds off other interrupts while it does. Timer 1 is
+ * the Romi's motor PWM, so this is for the simulator and the bench only.
+ */
+
+#include <stdint.h>
+
+//starts the load; hz from 31 to 100000 or so, and busyUS well under the period
+void BenchLoadBegin(uint16_t hz, uint16_t busyUS);
@@ -0,0 +1,48 @@
+#pragma once
+
+/*
+ * Min-preserving decimation for slow links.
+ *
+ * We keep pinging at the full rate, but only report once per window: the minimum, maximum,
+ * and mean distance over the window, plus how many pings there were and how many of them
+ * gave a valid echo. Reporting just the mean (or every Nth sample) could hide a close 
+ * obstacle that only shows up in one or two pings; the minimum never does.
+ */
+
+#include <stdint.h>
+
+struct DecimatedWindow
+{
+  uint16_t samples;     //pings processed in the window
+  uint16_t valid;       //pings that gave a valid echo
+  uint32_t minMM10;     //these three are over the valid echoes only, and 0 if there were none
+  uint32_t maxMM10;
+  uint32_t meanMM10;
+};
+
+class Decimator
+{
+public:
+  Decimator(uint32_t windowMS) : window(windowMS) {Clear();}
+
+  //adds one reading; invalid readings only count toward samples
+  void Add(uint32_t distanceMM10, bool valid);
+
+  /*
+   * If the current window (started at the previous call that returned true) has ended,
+   * fills in the summary, starts a new window, and returns true.
+   */
+  bool Poll(uint32_t now, DecimatedWindow& summary);
+
+private:
+  void Clear(void);
+
+  uint32_t window;
+  uint32_t windowStart = 0;
+
+  uint16_t samples;
+  uint16_t valid;
+  uint32_t minMM10;
+  uint32_t maxMM10;
+  uint32_t sumMM10;
+};
@@ -0,0 +1,67 @@
+#pragma once
+
+/*
+ * Echo capture on pin 13 (ICP3) using the Input Capture feature of timer 3.
+ *
+ * The input capture first looks for a rising edge, then a falling edge.
+ * The difference between the two is the pulse width, which is a direct measurement 
+ * of the (round trip) timer counts to hear the echo.
+ *
+ * Very short pulses are usually the transducer ringing down or a reflection off the housing,
+ * not a real target. A falling edge that comes within the blanking interval of the rising
+ * edge is ignored (and counted), and we go back to waiting for a rising edge. If nothing
+ * valid arrives, EchoCaptureTimeout() puts the state machine back to IDLE, so a blanked
+ * ping shows up as a missing reading rather than a bogus 0 mm one.
+ */
+
+#include <avr/io.h>
+#include <stdint.h>
+
+//define the states for the echo capture
+enum PULSE_STATE {PLS_IDLE, PLS_WAITING_LOW, PLS_WAITING_HIGH, PLS_CAPTURED};
+
+extern volatile uint16_t pulseStart;
+extern volatile uint16_t pulseEnd;
+extern volatile PULSE_STATE pulseState;
+
+//timer 3 count when the capture was last armed (i.e., when the ping was sent)
+extern volatile uint16_t pingTime;
+
+/*
+ * Sets up the input capture to catch the next rising edge on pin 13 and puts
+ * the state machine in PLS_WAITING_LOW. Call this just before triggering a ping.
+ * 
+ * Safe to call from an ISR (it leaves the global interrupt flag as it found it).
+ */
+void ArmEchoCapture(void);
+
+/*
+ * Looks up the prescaler from the clock-select bits of TCCR3B.
+ * Returns 0 if the timer is stopped or on an external clock.
+ */
+uint16_t ReadTimer3Prescaler(void);
+
+//sets the blanking interval, in timer counts (0 turns blanking off)
+void SetEchoBlanking(uint16_t blankCounts);
+
+//number of echoes that were ignored because they ended within the blanking interval
+uint16_t EchoBlankedCount(void);
+
+/*
+ * If we've been waiting for an echo for at least timeoutCounts since the ping, gives up:
+ * disables the capture interrupt, returns the state to PLS_IDLE, and returns true.
+ */
+bool EchoCaptureTimeout(uint16_t timeoutCounts);
+
+#ifdef SONAR_CAPTURE_PCINT
+/*
+ * The same state machine, fed from a pin change interrupt on pin 11 (PB7, PCINT7) instead of
+ * ICP3, for comparison (see tools/capture_bench.py). The ISR reads TCNT3 itself, so each edge
+ * is late by the interrupt latency, and later still if another ISR is running at the time.
+ * Call it in place of ArmEchoCapture().
+ */
+void ArmPcintCapture(void);
+#endif
+
+//sets the clock-select bits of TCCR3B for the given prescaler (1, 8, 64, 256, or 1024)
+void SetTimer3Prescaler(uint16_t prescaler);
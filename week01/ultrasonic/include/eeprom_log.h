@@ -0,0 +1,77 @@
+#pragma once
+
+/*
+ * Store-and-forward logging of ranges to the 32U4's EEPROM, for running without a host.
+ *
+ * Readings are delta-coded into a 32-byte block in RAM: the block header holds the first
+ * reading's time (ms) and distance (mm) in full, and each later reading is the change in 
+ * time and distance as varints (zigzag for the distance) -- about 2 bytes a reading at a 
+ * steady ping rate. A full block is handed to the EEPROM-ready ISR, which writes it a byte 
+ * at a time in the background (each byte takes 3.4 ms), while the next block fills in the
+ * other RAM buffer. So logging never waits on the EEPROM.
+ *
+ * The blocks form a ring over the whole EEPROM, each with a sequence number, and the ring's
+ * head is found at startup by looking for the break in the sequence. The sequence number is
+ * cleared before the rest of a block is written and set after it, so a block the power went
+ * in the middle of reads as blank. Nothing is kept at a 
+ * fixed address, so every cell is written once per trip around the ring (a block's first
+ * byte, its sequence number, twice), and bytes that haven't changed aren't rewritten at all.
+ * At 100,000 writes per cell that's 50,000 laps.
+ *
+ * The EEPROM is only 1 KB: 32 blocks of about 12 readings, so a few hundred readings (the 
+ * newest ones). A reading still in RAM is lost if the power goes.
+ *
+ * Dump() sends the blocks as "#eeblk" lines of hex; tools/eeprom_dump.py decodes them.
+ *
+ * Enable with -DSONAR_EEPROM_LOG.
+ */
+
+#include <Arduino.h>
+#include <stdint.h>
+
+const uint8_t EEPROM_LOG_BLOCK = 32;
+const uint8_t EEPROM_LOG_HEADER = 8;  //seq, boot, time (4), distance (2)
+const uint8_t EEPROM_LOG_BLOCKS = (E2END + 1) / EEPROM_LOG_BLOCK;
+
+class EepromLog
+{
+public:
+  //finds the head of the ring and works out this boot's number
+  void Begin(void);
+
+  //logs a reading (distance in mm; 0 for no echo)
+  void Add(uint32_t timestamp, uint16_t distanceMM);
+
+  //writes out a part-filled block, waiting for the EEPROM if it's busy
+  void Flush(void);
+
+  bool Busy(void) const;
+
+  /*
+   * Sends every block written since the last dump (or since boot), oldest first, then an 
+   * "#eeend" line with the count. Flush() first to include the newest readings.
+   */
+  uint8_t Dump(Print& out);
+
+  //readings dropped because both buffers were full (the EEPROM couldn't keep up)
+  uint16_t Dropped(void) const {return dropped;}
+
+  uint8_t Boot(void) const {return boot;}
+
+private:
+  void StartBlock(uint32_t timestamp, uint16_t distanceMM);
+  bool Queue(void);
+
+  uint8_t boot = 0;
+  uint8_t nextSeq = 0;
+  uint8_t nextBlock = 0;
+  uint8_t undumped = 0;
+
+  uint8_t buffers[2][EEPROM_LOG_BLOCK];
+  uint8_t filling = 0;      //buffer being filled
+  uint8_t length = 0;       //bytes used in it (0 if it has no header yet)
+
+  uint32_t lastTime = 0;
+  uint16_t lastDistance = 0;
+  uint16_t dropped = 0;
+};
@@ -0,0 +1,29 @@
+#pragma once
+
+/*
+ * A thin, register-level hardware layer for the bare (no Arduino core) build.
+ *
+ * The sketch only really needs timer 3, one output pin, and a serial link, so that's all
+ * this provides:
+ *   - timer 3 runs free at F_CPU / 64 (4 us per count) from reset and doubles as the clock,
+ *     so timer 0 isn't used at all
+ *   - output goes to UART1 (pins 0 and 1) at 115200 baud; there is no USB stack, so use a 
+ *     USB-serial adapter (and double-tap reset to get into the bootloader for uploading)
+ *   - TRIG is on pin 14 (PB3) and the echo on pin 13 (PC7, ICP3)
+ */
+
+#include <stdint.h>
+
+const uint16_t HAL_TIMER3_PRESCALER = 64;
+
+void HalInit(void);
+
+//time since reset; wraps like the Arduino versions do
+uint32_t HalMicros(void);
+uint32_t HalMillis(void);
+
+//sends the data over UART1, waiting for room in the transmit register as needed
+void HalWrite(const uint8_t* data, uint8_t length);
+
+//sends a 10 us pulse on TRIG
+void HalTriggerPing(void);
@@ -0,0 +1,106 @@
+#pragma once
+
+/*
+ * A non-blocking path to the serial port.
+ *
+ * Serial.write() blocks once the port's transmit buffer is full: on the USB port that's
+ * whenever the host stops reading (up to 250 ms per write), and on the UART it's whenever we
+ * send faster than the baud rate. Either way loop() stalls, and pings and echoes go unhandled
+ * with it.
+ *
+ * Instead, records are written to the queue, which never blocks, and Pump() (called from
+ * loop()) passes them on only as far as availableForWrite() says the port will take without
+ * waiting. When the queue is full, the policy decides what gives:
+ *
+ *   OUTPUT_DROP_OLDEST  make room by throwing away the oldest records (the freshest ranges
+ *                       are the ones that matter for avoiding things)
+ *   OUTPUT_DROP_NEWEST  throw away the new record (keeps a contiguous run from the start
+ *                       of the congestion, e.g., for logging)
+ *   OUTPUT_DECIMATE     once the queue is half full, only let in one record in every
+ *                       decimateKeep, so the rate falls smoothly; drop the newest if it
+ *                       still fills up
+ *
+ * Every record dropped either way is counted.
+ *
+ * Each write() is one record (as written by the Send...() functions with a RecordWriter) and
+ * is kept or dropped whole, so the host never sees half a line. Records that only make sense
+ * together (e.g., a "#lat" trace and the range it describes) can be grouped with
+ * BeginGroup()/EndGroup(), and are then kept or dropped together.
+ *
+ * A record that doesn't fit in the port's transmit buffer (63 bytes on the UART) goes out in
+ * pieces, as room appears. Once part of a record has been sent, the rest follows before
+ * anything else, and it can no longer be dropped; nor can the rest of its group.
+ */
+
+#include <Arduino.h>
+
+enum OUTPUT_POLICY : uint8_t
+{
+  OUTPUT_DROP_OLDEST,
+  OUTPUT_DROP_NEWEST,
+  OUTPUT_DECIMATE,
+};
+
+class OutputQueue : public Print
+{
+public:
+  //the ring is indexed with uint8_t, so the size is fixed
+  static const uint16_t CAPACITY = 256;
+
+  //the longest record; the length byte's top bit is taken
+  static const uint8_t MAX_RECORD = 127;
+
+  OutputQueue(Print& out, OUTPUT_POLICY policy, uint8_t decimateKeep = 4)
+    : out(out), policy(policy), decimateKeep(decimateKeep) {}
+
+  //queues one record; never blocks, and always reports the whole record as taken
+  size_t write(const uint8_t* data, size_t size);
+  size_t write(uint8_t c) {return write(&c, 1);}
+  using Print::write;
+
+  //room left in the queue, for anything that checks
+  int availableForWrite(void) {return CAPACITY - used;}
+
+  //the records written until EndGroup() are kept or dropped together
+  void BeginGroup(void);
+  void EndGroup(void) {grouping = false;}
+
+  //sends as many whole records as the port will take now; returns how many
+  uint8_t Pump(void);
+
+  uint16_t Queued(void) const {return used;}        //bytes, including a length byte per record
+  uint32_t Dropped(void) const {return dropped;}    //records (groups count as one)
+  uint32_t Decimated(void) const {return decimated;}
+
+private:
+  enum GROUP_STATE : uint8_t {GROUP_OPEN, GROUP_KEPT, GROUP_DROPPED};
+
+  //the length byte of a record that belongs with the one before it
+  static const uint8_t CONTINUES = 0x80;
+
+  //throws away the oldest record and any that belong with it
+  void DropOldest(void);
+
+  //whether the oldest record has started going out: it's partly sent, or it continues a
+  //group whose first records have been (groups are only ever dropped from their start, so
+  //a continuation only gets to the head by the record before it being sent)
+  bool HeadInFlight(void) const {return headSent || (buf[head] & CONTINUES);}
+
+  Print& out;
+  OUTPUT_POLICY policy;
+  uint8_t decimateKeep;
+  uint8_t decimateCount = 0;
+
+  uint8_t buf[CAPACITY];
+  uint8_t head = 0;       //oldest record's length byte
+  uint8_t tail = 0;       //where the next record goes
+  uint16_t used = 0;
+  uint8_t headSent = 0;   //bytes of the oldest record already written to the port
+
+  bool grouping = false;
+  GROUP_STATE groupState = GROUP_OPEN;
+  uint16_t groupBytes = 0;
+
+  uint32_t dropped = 0;
+  uint32_t decimated = 0;
+};
@@ -0,0 +1,36 @@
+#pragma once
+
+/*
+ * Fixed-rate pinging driven by timer 3.
+ *
+ * Scheduling pings from loop() means the spacing between samples depends on whatever
+ * else loop() is doing. Here, pings are fired from the output compare A interrupt of
+ * timer 3, which is advanced by exactly one period each time, so the samples are 
+ * uniformly spaced to within the interrupt latency (a few us). The TRIG pulse is ended
+ * by output compare B, so there's no busy-waiting in the ISR.
+ *
+ * Timer 3 is left free-running (normal mode), so the input capture and any other users
+ * of the timer are unaffected. The period must fit in 16 bits of timer counts 
+ * (about 262 ms with the default prescaler of 64).
+ */
+
+#include <avr/io.h>
+#include <stdint.h>
+
+/*
+ * Starts firing pings every periodCounts timer counts on the TRIG pin given by its
+ * port register and bit mask (e.g., from portOutputRegister(digitalPinToPort(pin))).
+ * The pin must already be an output.
+ */
+void PingTimerBegin(volatile uint8_t* trigPort, uint8_t trigMask, uint16_t periodCounts);
+
+void PingTimerStop(void);
+
+//number of pings that have been fired
+uint32_t PingTimerCount(void);
+
+//number of scheduled pings that were skipped because the previous echo was still in progress
+uint32_t PingTimerMissed(void);
+
+//timer counts needed for the TRIG pulse (at least 10 us)
+uint16_t TriggerPulseCounts(uint16_t prescaler);
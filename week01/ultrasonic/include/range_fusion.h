@@ -0,0 +1,68 @@
+#pragma once
+
+/*
+ * Combines an IR rangefinder and the ultrasonic sensor looking the same way into one range.
+ *
+ * The two complement each other: the IR updates every few ms and is good up close, but only
+ * reaches 80 cm and can miss dark surfaces; the ultrasonic reaches 4 m but updates at the 
+ * ping rate and can miss soft or angled ones. Each reading gets a standard deviation that 
+ * grows with distance (quadratically for the IR, whose curve flattens out, and linearly for
+ * the ultrasonic) and with its age, since the robot may have moved since; the estimate is 
+ * the inverse-variance weighted mean of the fresh ones.
+ *
+ * If the two disagree by more than three combined sigmas, one of them is seeing something
+ * the other isn't, and the estimate is the nearer one -- for obstacle avoidance, the safe 
+ * mistake.
+ *
+ * All integer: distances in tenths of a mm, sigmas in mm, times in ms.
+ */
+
+#include <stdint.h>
+
+enum FUSION_SOURCE : uint8_t
+{
+  FUSED_NONE,     //no fresh reading from either sensor
+  FUSED_IR,       //IR only
+  FUSED_SONAR,    //ultrasonic only
+  FUSED_BOTH,     //weighted mean of the two
+  FUSED_NEAREST,  //the two disagree; the nearer one
+};
+
+class RangeFusion
+{
+public:
+  /*
+   * maxSpeed is how fast (mm/s) the distance can change (e.g., the robot's top speed); 
+   * readings older than maxAge (ms) are ignored.
+   */
+  RangeFusion(uint16_t maxSpeed = 500, uint16_t maxAge = 500) : maxSpeed(maxSpeed), maxAge(maxAge) {}
+
+  //a reading of 0 (out of range or no echo) just marks the sensor as having nothing
+  void UpdateIr(uint32_t distanceMM10, uint32_t now) {Update(ir, distanceMM10, now);}
+  void UpdateSonar(uint32_t distanceMM10, uint32_t now) {Update(sonar, distanceMM10, now);}
+
+  //the estimate as of now, and where it came from
+  FUSION_SOURCE Estimate(uint32_t now, uint32_t& distanceMM10) const;
+
+private:
+  struct Reading
+  {
+    uint32_t mm10;
+    uint32_t time;
+  };
+
+  static void Update(Reading& r, uint32_t distanceMM10, uint32_t now)
+  {
+    r.mm10 = distanceMM10;
+    r.time = now;
+  }
+
+  //variance (mm^2) of a reading as of now, or 0 if it's too old or there isn't one
+  uint32_t Variance(const Reading& r, uint32_t baseMM, uint32_t growthMM, uint32_t now) const;
+
+  uint16_t maxSpeed;
+  uint16_t maxAge;
+
+  Reading ir = {0, 0};
+  Reading sonar = {0, 0};
+};
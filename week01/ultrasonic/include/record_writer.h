@@ -0,0 +1,72 @@
+#pragma once
+
+/*
+ * A lean, allocation-free formatter for the telemetry records.
+ *
+ * Serial.print() on a float pulls the whole float-to-ASCII machinery into flash, and
+ * every call to Serial.print() is a separate trip through the Print virtual functions.
+ * Instead, we build the whole record in a small stack buffer using integer-only routines
+ * and hand the finished line to the serial port in one write().
+ *
+ * Typical use:
+ *
+ *   RecordWriter rec;
+ *   rec.u32(millis()).tab().u32(counts).tab().fixed1(distanceMM10).eol();
+ *   Serial.write(rec.data(), rec.length());
+ */
+
+#include <stdint.h>
+
+class RecordWriter
+{
+public:
+  //big enough for a handful of 32-bit fields plus separators
+  static const uint8_t CAPACITY = 64;
+
+  RecordWriter(void) : len(0) {}
+
+  void reset(void) {len = 0;}
+
+  const uint8_t* data(void) const {return buf;}
+  uint8_t length(void) const {return len;}
+
+  //appends an unsigned decimal number
+  RecordWriter& u32(uint32_t value);
+
+  //appends a signed decimal number
+  RecordWriter& i32(int32_t value);
+
+  //appends a value held in tenths as "123.4"
+  RecordWriter& fixed1(uint32_t tenths);
+
+  //the same, signed
+  RecordWriter& sfixed1(int32_t tenths)
+  {
+    if(tenths < 0) ch('-');
+    return fixed1(tenths < 0 ? -(uint32_t)tenths : tenths);
+  }
+
+  //appends a single character; silently dropped if the buffer is full
+  RecordWriter& ch(char c)
+  {
+    if(len < CAPACITY) buf[len++] = c;
+    return *this;
+  }
+
+  //appends a string (e.g., a "#tag" for a metadata line)
+  RecordWriter& text(const char* s)
+  {
+    while(*s) ch(*s++);
+    return *this;
+  }
+
+  RecordWriter& tab(void) {return ch('\t');}
+  RecordWriter& eol(void) {return ch('\n');}
+
+private:
+  //writes a number that fits in 16 bits, zero-padded to at least minDigits
+  void u16(uint16_t value, uint8_t minDigits);
+
+  uint8_t buf[CAPACITY];
+  uint8_t len;
+};
@@ -0,0 +1,35 @@
+#pragma once
+
+/*
+ * Report-on-change filter for the telemetry.
+ *
+ * A reading is reported only if it differs from the last *reported* reading by more than
+ * the deadband (so slow drift is still reported eventually), or if nothing has been
+ * reported for maxSilenceMS (a heartbeat, so the host can tell we're still alive).
+ * A parked robot then sends one record per heartbeat instead of one per ping.
+ */
+
+#include <stdint.h>
+
+class ReportFilter
+{
+public:
+  ReportFilter(uint32_t deadbandMM10, uint32_t maxSilenceMS)
+    : deadband(deadbandMM10), maxSilence(maxSilenceMS) {}
+
+  //returns true if this reading should be sent, and if so, remembers it as the last one sent
+  bool ShouldReport(uint32_t distanceMM10, uint32_t now);
+
+  //number of readings that have been held back
+  uint32_t Suppressed(void) const {return suppressed;}
+
+private:
+  uint32_t deadband;
+  uint32_t maxSilence;
+
+  bool hasReported = false;
+  uint32_t lastDistance = 0;
+  uint32_t lastTime = 0;
+
+  uint32_t suppressed = 0;
+};
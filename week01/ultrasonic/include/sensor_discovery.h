@@ -0,0 +1,32 @@
+#pragma once
+
+/*
+ * Finds the sensors at startup, so the TRIG pins don't have to be edited into the source for
+ * each board.
+ *
+ * Each candidate pin gets a trigger pulse, and we watch the echo capture (ICP3, pin 13) for a
+ * rising edge. An HC-SR04 raises its echo line within a ms or so of being triggered whether
+ * or not anything is in range (with nothing there, it's a ~38 ms pulse), so a pin with a
+ * sensor on it answers quickly and a pin without one can be given up on after listenUS,
+ * rather than after a full echo timeout. A pin counts as a sensor only if it answers twice.
+ *
+ * There's only the one capture input to listen on (ICP1 would do, but timer 1's ICR1 is the
+ * PWM TOP for the Romi's motors), so the candidates are probed one after the other, with the
+ * echo lines diode-OR'd onto pin 13 as for SONAR_PAIR. Before each probe we wait for the line
+ * to go quiet, so a sensor that's still timing an echo can't answer for the next pin.
+ *
+ * The startup time is bounded: at most (2 * timeoutUS + listenUS) per probe, two probes for a
+ * sensor and one for an empty pin; in practice a few ms per empty pin and 5-80 ms per sensor.
+ *
+ * Pins that answer are left as outputs (LOW); the others are put back to inputs. The echo
+ * capture must already be set up (timer 3 running, blanking set), and interrupts enabled.
+ */
+
+#include <stdint.h>
+
+/*
+ * Probes the candidate pins in order and copies those with a sensor on them to found (up to
+ * maxFound), in the same order. Returns the number found.
+ */
+uint8_t DiscoverSensors(const uint8_t* candidates, uint8_t count, uint8_t* found, uint8_t maxFound,
+                        uint16_t listenUS, uint16_t timeoutUS);
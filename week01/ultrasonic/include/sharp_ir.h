@@ -0,0 +1,21 @@
+#pragma once
+
+/*
+ * Conversion from a Sharp GP2Y0A21 analog IR rangefinder's output to distance.
+ *
+ * The output voltage falls off roughly as 1/distance between 10 and 80 cm, and rises again
+ * below about 7 cm, so a reading can't be trusted outside that range. The curve is a table
+ * from the datasheet's typical characteristic (at 5 V AVcc), interpolated linearly; for a 
+ * different sensor (e.g., the 20 - 150 cm GP2Y0A02), replace the table.
+ */
+
+#include <stdint.h>
+
+const uint32_t SHARP_IR_MIN_MM10 = 1000;   //10 cm
+const uint32_t SHARP_IR_MAX_MM10 = 8000;   //80 cm
+
+/*
+ * Converts the sum of ADC_OVERSAMPLE readings (see adc_pipeline.h) to tenths of a mm. 
+ * Returns 0 if the reading is outside the sensor's range (too close or nothing there).
+ */
+uint32_t SharpIrToMM10(uint16_t adcSum);
@@ -0,0 +1,12 @@
+#pragma once
+
+/*
+ * Conversions shared by the Arduino sketch and the bare build.
+ */
+
+#include <stdint.h>
+
+//speed of sound, expressed as tenths of a mm of range per us of round-trip time: 
+//343 m/s = 0.343 mm/us, halved for the round trip, gives 1.715 tenths of a mm per us
+const uint32_t MM10_PER_US_NUM = 1715;
+const uint32_t MM10_PER_US_DEN = 1000;
@@ -0,0 +1,47 @@
+#pragma once
+
+/*
+ * Servo-swept scanning for an ultrasonic on a hobby servo.
+ *
+ * The servo pulse is generated by output compare C of timer 3 (timer 1 is left alone for
+ * the motors), so no extra libraries or timers are needed. The 20 ms frame has to fit in 16
+ * bits of timer counts, so the prescaler must be 8 or more.
+ *
+ * To keep the scan rate up, we pipeline: as soon as a ping is fired at one angle, the servo
+ * is commanded to the next one, so the servo moves while we wait for the echo. The next
+ * ping is allowed once both the echo has been processed and the servo has had time to settle
+ * (settleBaseUS + settleUSPerDeg * step, counted from the frame where the new pulse width
+ * takes effect), rather than after a fixed delay.
+ */
+
+#include <avr/io.h>
+#include <stdint.h>
+
+struct SweepConfig
+{
+  int16_t minAngle;         //degrees
+  int16_t maxAngle;         //degrees
+  int16_t step;             //degrees per ping
+  uint16_t minPulseUS;      //servo pulse width at minAngle
+  uint16_t maxPulseUS;      //servo pulse width at maxAngle
+  uint16_t settleBaseUS;    //fixed settle time per step
+  uint16_t settleUSPerDeg;  //additional settle time per degree of motion
+};
+
+/*
+ * Starts the servo pulses on the pin given by its port register and bit mask, 
+ * and moves to minAngle. The pin must already be an output.
+ */
+void SweepBegin(volatile uint8_t* servoPort, uint8_t servoMask, const SweepConfig& config);
+
+//true once the servo has had time to reach the commanded angle
+bool SweepSettled(void);
+
+//the angle the servo was last commanded to (i.e., where the next ping should be taken)
+int16_t SweepAngle(void);
+
+/*
+ * Commands the next step, reversing at the ends of the sweep. Call right after firing a ping.
+ * Returns true if the ping that was just fired is the last one of a scan.
+ */
+bool SweepStep(void);
@@ -0,0 +1,53 @@
+#pragma once
+
+/*
+ * Time-division ping slots for several robots sharing the same space.
+ *
+ * Time is divided into frames of slotCount slots, each slotUS long, and each robot pings
+ * only at the start of its own slot, so one robot's ping is never heard as another's echo.
+ * The frame is aligned by calling Sync() when the host's sync message (or a sync pulse
+ * on a GPIO shared by all robots) arrives; all robots receive it at (nearly) the same time.
+ * The host must send syncs at frame boundaries (i.e., a whole number of frames apart), 
+ * which lets the robots correct for clock drift. No pings are scheduled until the first sync.
+ *
+ * The slot should cover the longest echo we care about plus a guard time for sync jitter 
+ * and clock drift. Pings that would start more than lateLimitUS into the slot (e.g., because
+ * loop() was busy) are skipped rather than risk running into the next slot.
+ *
+ * This has no hardware dependencies, so it can be run on the host as well (see tools/tdma_sim.cpp).
+ */
+
+#include <stdint.h>
+
+class TdmaSchedule
+{
+public:
+  TdmaSchedule(uint8_t slot, uint8_t slotCount, uint32_t slotUS, uint32_t lateLimitUS)
+    : slot(slot), slotCount(slotCount), slotUS(slotUS), lateLimit(lateLimitUS) {}
+
+  //aligns the start of a frame to nowUS
+  void Sync(uint32_t nowUS);
+
+  //returns true (once per frame) if we're in our slot and should ping now
+  bool ShouldPing(uint32_t nowUS);
+
+  bool Synced(void) const {return synced;}
+
+  //number of our slots that went by without a ping because we were too late
+  uint32_t Skipped(void) const {return skipped;}
+
+  uint32_t FrameUS(void) const {return (uint32_t)slotCount * slotUS;}
+
+private:
+  uint8_t slot;
+  uint8_t slotCount;
+  uint32_t slotUS;
+  uint32_t lateLimit;
+
+  bool synced = false;
+  uint32_t nextPing = 0;
+
+  bool pinged = false;
+  uint32_t lastPing = 0;
+  uint32_t skipped = 0;
+};
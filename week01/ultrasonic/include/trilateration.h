@@ -0,0 +1,91 @@
+#pragma once
+
+/*
+ * Locates an obstacle from the ranges of two sensors side by side on the bumper.
+ *
+ * Both sensors face forward (+x) from the bumper line, at lateral offsets yLeft and yRight
+ * (+y to the left). An HC-SR04 hears its own ping, so each range is the straight-line
+ * distance from that sensor to the nearest surface in its cone; with two of them, the
+ * difference of the squared ranges fixes the lateral position and either range then gives
+ * the forward distance:
+ *
+ *   y = (yL + yR) / 2 + (rR^2 - rL^2) / (2 (yL - yR))
+ *   x = sqrt(rL^2 - (y - yL)^2)
+ *
+ * The two sensors can't ping at once (they'd hear each other), so the ranges are taken a
+ * ping apart, and the obstacle (or the robot) may have moved in between. Each reading is
+ * stamped with when the sound hit the target (the ping plus half the echo), and the other
+ * sensor's range is carried forward to that time along its rate of change (from its last
+ * two readings, limited to maxSpeed). Taking turns, each sensor's readings are two pings
+ * apart, so the rate is taken over a longer window than the pairing. Every reading from either sensor gives a new fix, so
+ * the position updates at the full pair rate.
+ *
+ * If the ranges differ by more than the baseline (plus a little noise), the two sensors are
+ * hearing different things and there's no fix. Points with the obstacle right on the line of
+ * a sensor are the least sensitive to noise; points far off to the side and close in, the most.
+ *
+ * All integer: distances in tenths of a mm (up to 4 m, so squares fit in 32 bits), times in us.
+ */
+
+#include <stdint.h>
+
+struct PairFix
+{
+  uint32_t timeUS;      //micros() when the newest reading hit the target
+  uint32_t leftMM10;    //both ranges, as of timeUS (0 for none)
+  uint32_t rightMM10;
+  int32_t xMM10;        //forward of the bumper
+  int32_t yMM10;        //left of the robot's centre line
+  bool located;         //false if either range is missing or they disagree
+};
+
+class Trilateration
+{
+public:
+  static const uint8_t LEFT = 0;
+  static const uint8_t RIGHT = 1;
+
+  /*
+   * yLeft and yRight are the sensors' lateral offsets (mm10, left positive). maxSpeed (mm/s)
+   * limits the closing speed used to carry a range forward; a range older than maxAgeUS
+   * isn't paired with at all. A sensor's rate comes from two of its readings at most
+   * rateWindowUS apart, which has to be more than the time between them (two pings, taking
+   * turns) or no range is ever carried forward.
+   */
+  Trilateration(int16_t yLeft, int16_t yRight, uint16_t maxSpeed = 2000, uint32_t maxAgeUS = 150000,
+                uint32_t rateWindowUS = 250000);
+
+  //a new reading from sensor (LEFT or RIGHT) at timeUS; 0 for no (valid) echo
+  void Update(uint8_t sensor, uint32_t timeUS, uint32_t rangeMM10);
+
+  //the position as of the latest reading
+  void Locate(PairFix& fix) const;
+
+  //number of pairs rejected because the ranges couldn't come from one point
+  uint16_t Disagreements(void) const {return disagreements;}
+
+private:
+  struct Track
+  {
+    uint32_t mm10;
+    uint32_t timeUS;
+    int16_t rate;       //mm10 per s, from the last two readings
+  };
+
+  //the range of track t carried forward to timeUS, or 0 if it's too old
+  uint32_t RangeAt(const Track& t, uint32_t timeUS) const;
+
+  int16_t yLeft;
+  int16_t yRight;
+  int16_t maxRate;      //mm10 per s
+  uint32_t maxAgeUS;
+  uint32_t rateWindowUS;
+
+  Track tracks[2] = {{0, 0, 0}, {0, 0, 0}};
+  uint8_t latest = LEFT;
+
+  mutable uint16_t disagreements = 0;
+};
+
+//the integer square root (floor) of a 32-bit number
+uint16_t ISqrt32(uint32_t value);
@@ -0,0 +1,68 @@
+#pragma once
+
+/*
+ * Wall following on a side-looking ultrasonic, run once per echo.
+ *
+ * Polling the distance from loop() and running the PID on a fixed tick means the controller
+ * mostly works on stale readings (the same one several times, or one that's most of a ping
+ * old), and its derivative and integral use a dt that has nothing to do with when the
+ * readings were taken. Here Update() is called exactly once per captured echo, with the time
+ * of the echo's falling edge (worked back from the timer 3 capture, so it's good to a timer
+ * count or two), and the PID uses the true time between those captures. A faster ping rate
+ * then directly means a tighter loop.
+ *
+ * The PID steers: the error is the distance to the wall minus the target, and the output is
+ * added to one wheel's effort and taken from the other's, about a constant forward effort.
+ * Gains are fixed point, in 1/256 of an effort unit per mm (P), per mm*s (I), and per mm/s
+ * (D). The integral is clamped so it can't wind up while the robot is out of reach of the
+ * wall, and both it and the derivative start over after a gap longer than maxGapUS.
+ *
+ * If there's no valid reading for maxGapUS, the wall is lost and the robot stops: it's only
+ * looking sideways, so it can't know what's ahead.
+ */
+
+#include <stdint.h>
+
+struct WallFollowConfig
+{
+  uint32_t targetMM10;      //distance to hold from the wall
+  bool wallOnLeft;          //which side the sensor faces
+  int16_t forwardEffort;    //common to both wheels
+  int16_t maxEffort;        //either wheel, e.g., 300 for the Romi
+  int16_t kp;               //1/256 effort per mm
+  int16_t ki;               //1/256 effort per mm*s
+  int16_t kd;               //1/256 effort per mm/s
+  int32_t maxIntegral;      //mm*ms
+  uint32_t maxGapUS;        //longest time between readings before starting over
+};
+
+class WallFollower
+{
+public:
+  WallFollower(const WallFollowConfig& config) : config(config) {}
+
+  /*
+   * Runs the controller on one echo: captureUS is micros() at its falling edge, and
+   * distanceMM10 is 0 if it wasn't a valid reading. Returns true if the efforts changed
+   * and should be sent to the motors.
+   */
+  bool Update(uint32_t captureUS, uint32_t distanceMM10, int16_t& leftEffort, int16_t& rightEffort);
+
+  //stops (and returns true, once) if there hasn't been a valid reading for maxGapUS
+  bool CheckLost(uint32_t nowUS, int16_t& leftEffort, int16_t& rightEffort);
+
+  //from the last call to Update() that ran the PID
+  uint32_t LastDtUS(void) const {return lastDtUS;}
+  int32_t LastErrorMM(void) const {return lastError;}
+
+private:
+  int16_t Clamp(int32_t effort) const;
+
+  WallFollowConfig config;
+
+  bool running = false;     //have a previous valid reading to take a dt from
+  uint32_t lastCaptureUS = 0;
+  uint32_t lastDtUS = 0;
+  int32_t lastError = 0;    //mm
+  int32_t integral = 0;     //mm*ms
+};
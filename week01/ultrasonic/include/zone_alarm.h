@@ -0,0 +1,59 @@
+#pragma once
+
+/*
+ * Distance zones that drive GPIO outputs directly from the echo capture ISR.
+ *
+ * Each zone asserts its output (HIGH) when the echo is shorter than enterCounts and releases
+ * it when the echo is longer than exitCounts; the gap between the two is the hysteresis.
+ * Because the comparison is done in timer counts in the same ISR that captures the falling
+ * edge, another MCU watching the pin sees the change within a few us of the echo ending.
+ *
+ * Enable with -DSONAR_ZONE_ALARM.
+ */
+
+#include <avr/io.h>
+#include <stdint.h>
+
+struct AlarmZone
+{
+  volatile uint8_t* port;
+  uint8_t mask;
+  uint16_t enterCounts;
+  uint16_t exitCounts;
+  bool active;
+};
+
+const uint8_t MAX_ALARM_ZONES = 4;
+
+extern AlarmZone alarmZones[MAX_ALARM_ZONES];
+extern volatile uint8_t alarmZoneCount;
+
+/*
+ * Adds a zone driving the pin given by its port register and bit mask. The pin must already 
+ * be an output. Thresholds are pulse widths in timer counts; exitCounts should be >= enterCounts.
+ * Returns false if all zones are in use.
+ */
+bool ZoneAlarmAdd(volatile uint8_t* port, uint8_t mask, uint16_t enterCounts, uint16_t exitCounts);
+
+/*
+ * Called from the capture ISR with the width of each completed echo. It's inline so the
+ * ISR doesn't pay for a full function call.
+ */
+static inline void ZoneAlarmUpdate(uint16_t widthCounts)
+{
+  for(uint8_t i = 0; i < alarmZoneCount; i++)
+  {
+    AlarmZone& zone = alarmZones[i];
+    if(!zone.active && widthCounts < zone.enterCounts)
+    {
+      *zone.port |= zone.mask;
+      zone.active = true;
+    }
+
+    else if(zone.active && widthCounts > zone.exitCounts)
+    {
+      *zone.port &= ~zone.mask;
+      zone.active = false;
+    }
+  }
+}
@@ -0,0 +1,156 @@
+#include <Arduino.h>
+#include "adc_pipeline.h"
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+//marks the one-off conversion requested by AdcPipelineRead()
+static const uint8_t ONE_OFF = 0xFF;
+
+static uint8_t channelList[ADC_MAX_CHANNELS];
+static uint8_t channelCount = 0;
+
+//slot of the conversion that just finished and of the one in progress
+static volatile uint8_t converting = 0;
+static volatile uint8_t queued = 0;
+
+//the next slot in the rotation
+static volatile uint8_t nextSlot = 0;
+
+static uint16_t sums[ADC_MAX_CHANNELS];
+static uint8_t counts[ADC_MAX_CHANNELS];
+static volatile uint16_t published[ADC_MAX_CHANNELS];
+static volatile uint8_t fresh = 0; //bit per slot
+
+static volatile uint8_t oneOffChannel = ONE_OFF;
+static volatile bool oneOffQueued = false;
+static volatile bool oneOffDone = false;
+static volatile uint16_t oneOffResult = 0;
+
+//channels are numbered as analogPinToChannel() gives them, the way analogRead() takes them:
+//bit 3 picks ADC8-ADC13, which is MUX5 with the low three bits in MUX2:0
+static inline void SelectChannel(uint8_t channel)
+{
+  ADMUX = _BV(REFS0) | (channel & 0x07);
+  if(channel & 0x08) ADCSRB |= _BV(MUX5);
+  else ADCSRB &= ~_BV(MUX5);
+}
+
+//picks the slot for the conversion after the one in progress, and sets the multiplexer for it
+static inline uint8_t QueueNext(void)
+{
+  if(oneOffChannel != ONE_OFF && !oneOffQueued)
+  {
+    oneOffQueued = true;
+    SelectChannel(oneOffChannel);
+    return ONE_OFF;
+  }
+
+  uint8_t slot = nextSlot;
+  nextSlot = slot + 1 < channelCount ? slot + 1 : 0;
+  SelectChannel(channelList[slot]);
+  return slot;
+}
+
+bool AdcPipelineBegin(const uint8_t* channels, uint8_t count)
+{
+  if(count == 0 || count > ADC_MAX_CHANNELS) return false;
+
+  AdcPipelineStop();
+
+  for(uint8_t i = 0; i < count; i++)
+  {
+    channelList[i] = channels[i];
+    sums[i] = 0;
+    counts[i] = 0;
+  }
+  channelCount = count;
+  fresh = 0;
+  nextSlot = 0;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    converting = QueueNext();
+    ADCSRB &= ~0x0F; //ADTS = 0: free running
+    ADCSRA = _BV(ADEN) | _BV(ADSC) | _BV(ADATE) | _BV(ADIF) | _BV(ADIE) 
+           | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0); //clock / 128
+
+    //the first conversion locks in its channel one ADC clock (128 cycles) after it starts;
+    //after that we can set up the second
+    delayMicroseconds(10);
+    queued = QueueNext();
+  }
+
+  return true;
+}
+
+void AdcPipelineStop(void)
+{
+  ADCSRA &= ~(_BV(ADATE) | _BV(ADIE));
+
+  //let any conversion in progress finish, so analogRead() starts clean
+  while(ADCSRA & _BV(ADSC)) {}
+  channelCount = 0;
+}
+
+bool AdcPipelineTake(uint8_t slot, uint16_t& sum)
+{
+  bool isFresh = false;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    if(fresh & (1 << slot))
+    {
+      sum = published[slot];
+      fresh &= ~(1 << slot);
+      isFresh = true;
+    }
+  }
+
+  return isFresh;
+}
+
+uint16_t AdcPipelineRead(uint8_t channel)
+{
+  if(!channelCount)
+  {
+    //pipeline isn't running, so a plain conversion will do
+    SelectChannel(channel);
+    ADCSRA |= _BV(ADSC);
+    while(ADCSRA & _BV(ADSC)) {}
+    return ADC;
+  }
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    oneOffDone = false;
+    oneOffQueued = false;
+    oneOffChannel = channel;
+  }
+
+  while(!oneOffDone) {}
+  return oneOffResult;
+}
+
+ISR(ADC_vect)
+{
+  uint16_t value = ADC;
+  uint8_t slot = converting;
+  converting = queued;
+  queued = QueueNext();
+
+  if(slot == ONE_OFF)
+  {
+    oneOffResult = value;
+    oneOffChannel = ONE_OFF;
+    oneOffDone = true;
+    return;
+  }
+
+  sums[slot] += value;
+  if(++counts[slot] == ADC_OVERSAMPLE)
+  {
+    published[slot] = sums[slot];
+    fresh |= 1 << slot;
+    sums[slot] = 0;
+    counts[slot] = 0;
+  }
+}
@@ -0,0 +1,89 @@
+#include "hal.h"
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <util/delay.h>
+
+static const uint32_t BAUD = 115200;
+
+//upper 16 bits of the 32-bit timer 3 count
+static volatile uint16_t timer3Overflows = 0;
+
+/*
+ * Starts timer 3 (normal mode, prescaler of 64) in .init3, right after the stack is set up
+ * and before the C runtime copies .data and clears .bss, so the clock counts from reset.
+ */
+extern "C" void HalStartClock(void) __attribute__((naked, used, section(".init3")));
+void HalStartClock(void)
+{
+  TCCR3A = 0;
+  TCNT3 = 0;
+  TCCR3B = _BV(CS31) | _BV(CS30);
+}
+
+void HalInit(void)
+{
+  //timer 3 is already running (see above); just take its overflows for the clock, including
+  //any that's pending
+  TIMSK3 = _BV(TOIE3);
+
+  //UART1, 8N1, double speed for a closer match to 115200 at 16 MHz
+  UCSR1A = _BV(U2X1);
+  UBRR1 = (F_CPU / (8 * BAUD)) - 1;
+  UCSR1C = _BV(UCSZ11) | _BV(UCSZ10);
+  UCSR1B = _BV(TXEN1) | _BV(RXEN1);
+
+  //TRIG (PB3) is an output, held LOW; the echo (PC7) is an input
+  PORTB &= ~_BV(PB3);
+  DDRB |= _BV(PB3);
+  DDRC &= ~_BV(PC7);
+  PORTC &= ~_BV(PC7);
+}
+
+static uint32_t Timer3Counts(void)
+{
+  uint16_t high, low;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    high = timer3Overflows;
+    low = TCNT3;
+
+    //an overflow that hasn't been serviced yet (we have interrupts off)
+    if((TIFR3 & _BV(TOV3)) && low < 0x8000) high++;
+  }
+
+  return ((uint32_t)high << 16) | low;
+}
+
+uint32_t HalMicros(void)
+{
+  return Timer3Counts() * (HAL_TIMER3_PRESCALER / (F_CPU / 1000000ul));
+}
+
+uint32_t HalMillis(void)
+{
+  //250 counts per ms at 4 us per count
+  return Timer3Counts() / (1000 / (HAL_TIMER3_PRESCALER / (F_CPU / 1000000ul)));
+}
+
+void HalWrite(const uint8_t* data, uint8_t length)
+{
+  while(length--)
+  {
+    while(!(UCSR1A & _BV(UDRE1))) {}
+    UDR1 = *data++;
+  }
+}
+
+void HalTriggerPing(void)
+{
+  PORTB |= _BV(PB3);
+  _delay_us(10);
+  PORTB &= ~_BV(PB3);
+}
+
+ISR(TIMER3_OVF_vect)
+{
+  timer3Overflows++;
+}
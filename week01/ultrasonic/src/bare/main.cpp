@@ -0,0 +1,114 @@
+/*
+ * The ultrasonic sketch without the Arduino core: just avr-libc and the thin HAL in hal.h.
+ *
+ * It does the same job as the default mode of hc-sr04.cpp (ping every PING_INTERVAL, capture
+ * the echo on ICP3, send timestamp, counts, us, and mm) with the same echo capture and record
+ * formatting code, but without millis(), digitalWrite(), USB, or the Print classes. Build it 
+ * with the a-star32U4-bare environment.
+ *
+ * With -DSONAR_BENCH_OUTPUT, both builds report their boot time and the cost of formatting 
+ * a record, so the two can be compared (along with the flash and RAM usage from pio run).
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+#include "hal.h"
+#include "echo_capture.h"
+#include "record_writer.h"
+#include "sonar_units.h"
+
+const uint32_t PING_INTERVAL = 100; //ms
+
+//same as in hc-sr04.cpp, but in timer counts directly (4 us per count)
+const uint16_t ECHO_BLANKING_COUNTS = 90 / 4;
+const uint16_t ECHO_TIMEOUT_COUNTS = 40000 / 4;
+
+static void WriteString(const char* s)
+{
+  RecordWriter rec;
+  while(*s) rec.ch(*s++);
+  HalWrite(rec.data(), rec.length());
+}
+
+#ifdef SONAR_BENCH_OUTPUT
+static void BenchmarkOutput(uint32_t bootUS)
+{
+  const uint16_t N = 100;
+  volatile uint8_t sink = 0;
+
+  cli();
+  uint16_t start = TCNT3;
+  for(uint16_t i = 0; i < N; i++)
+  {
+    RecordWriter rec;
+    rec.u32(123456ul + i).tab().u32(2900 + i).tab().u32(11600ul + 4 * i).tab().fixed1(19894ul + 7 * i).eol();
+    sink = rec.length();
+  }
+  uint16_t elapsed = TCNT3 - start;
+  sei();
+  (void)sink;
+
+  RecordWriter rec;
+  WriteString("#boot_us\t");
+  rec.u32(bootUS).eol();
+  HalWrite(rec.data(), rec.length());
+
+  WriteString("cycles/record = ");
+  rec.reset();
+  rec.u32((uint32_t)elapsed * HAL_TIMER3_PRESCALER / N).eol();
+  HalWrite(rec.data(), rec.length());
+}
+#endif
+
+int main(void)
+{
+  HalInit();
+  sei();
+
+#ifdef SONAR_BENCH_OUTPUT
+  //the clock started just after reset, so this includes the C runtime's startup and HalInit()
+  uint32_t bootUS = HalMicros();
+#endif
+
+  SetEchoBlanking(ECHO_BLANKING_COUNTS);
+
+  WriteString("setup\n");
+#ifdef SONAR_BENCH_OUTPUT
+  BenchmarkOutput(bootUS);
+#endif
+  WriteString("/setup\n");
+
+  uint32_t lastPing = HalMillis();
+
+  for(;;)
+  {
+    uint32_t currTime = HalMillis();
+    if((currTime - lastPing) >= PING_INTERVAL && pulseState == PLS_IDLE)
+    {
+      lastPing = currTime;
+      ArmEchoCapture();
+      HalTriggerPing();
+    }
+
+    EchoCaptureTimeout(ECHO_TIMEOUT_COUNTS);
+
+    if(pulseState == PLS_CAPTURED)
+    {
+      uint16_t pulseLengthTimerCounts;
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+      {
+        pulseLengthTimerCounts = pulseEnd - pulseStart;
+        pulseState = PLS_IDLE;
+      }
+
+      uint32_t pulseLengthUS = (uint32_t)pulseLengthTimerCounts * (HAL_TIMER3_PRESCALER / (F_CPU / 1000000ul));
+      uint32_t distanceMM10 = pulseLengthUS * MM10_PER_US_NUM / MM10_PER_US_DEN;
+
+      RecordWriter rec;
+      rec.u32(HalMillis()).tab().u32(pulseLengthTimerCounts).tab().u32(pulseLengthUS).tab().fixed1(distanceMM10).eol();
+      HalWrite(rec.data(), rec.length());
+    }
+  }
+}
@@ -0,0 +1,30 @@
+#include "bench_load.h"
+#include <Arduino.h>
+#include <avr/interrupt.h>
+
+//only in bench builds, so the vector is free otherwise (e.g., for the Servo library)
+#ifdef SONAR_BENCH_LOAD
+
+static volatile uint16_t loadBusyUS = 0;
+
+void BenchLoadBegin(uint16_t hz, uint16_t busyUS)
+{
+  //CTC on OCR1A; a prescaler of 8 covers 31 Hz (0xFFFF counts) and up
+  uint32_t top = F_CPU / 8 / hz - 1;
+  if(top > 0xFFFF) top = 0xFFFF;
+
+  noInterrupts();
+  loadBusyUS = busyUS;
+  TCCR1A = 0;
+  TCCR1B = _BV(WGM12) | _BV(CS11);
+  OCR1A = top;
+  TIFR1 = _BV(OCF1A);
+  TIMSK1 |= _BV(OCIE1A);
+  interrupts();
+}
+
+ISR(TIMER1_COMPA_vect)
+{
+  delayMicroseconds(loadBusyUS);
+}
+#endif
@@ -0,0 +1,43 @@
+#include "decimator.h"
+
+void Decimator::Clear(void)
+{
+  samples = 0;
+  valid = 0;
+  minMM10 = 0xFFFFFFFF;
+  maxMM10 = 0;
+  sumMM10 = 0;
+}
+
+void Decimator::Add(uint32_t distanceMM10, bool isValid)
+{
+  if(samples < 0xFFFF) samples++;
+  if(!isValid || valid == 0xFFFF) return;
+
+  valid++;
+  sumMM10 += distanceMM10;
+  if(distanceMM10 < minMM10) minMM10 = distanceMM10;
+  if(distanceMM10 > maxMM10) maxMM10 = distanceMM10;
+}
+
+bool Decimator::Poll(uint32_t now, DecimatedWindow& summary)
+{
+  if(now - windowStart < window) return false;
+
+  summary.samples = samples;
+  summary.valid = valid;
+  if(valid)
+  {
+    summary.minMM10 = minMM10;
+    summary.maxMM10 = maxMM10;
+    summary.meanMM10 = sumMM10 / valid;
+  }
+  else summary.minMM10 = summary.maxMM10 = summary.meanMM10 = 0;
+
+  //keep the windows on a fixed grid, unless we've fallen more than a window behind
+  windowStart += window;
+  if(now - windowStart >= window) windowStart = now;
+
+  Clear();
+  return true;
+}
@@ -0,0 +1,181 @@
+#include "echo_capture.h"
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+#ifdef SONAR_ZONE_ALARM
+#include "zone_alarm.h"
+#endif
+
+volatile uint16_t pulseStart = 0;
+volatile uint16_t pulseEnd = 0;
+
+//initialize to IDLE
+volatile PULSE_STATE pulseState = PLS_IDLE;
+
+volatile uint16_t pingTime = 0;
+
+static volatile uint16_t blanking = 0;
+static volatile uint16_t blankedCount = 0;
+
+uint16_t ReadTimer3Prescaler(void)
+{
+  switch(TCCR3B & 0x07)
+  {
+    case 1: return 1;
+    case 2: return 8;
+    case 3: return 64;
+    case 4: return 256;
+    case 5: return 1024;
+    default: return 0; //stopped or external clock
+  }
+}
+
+void SetTimer3Prescaler(uint16_t prescaler)
+{
+  uint8_t cs = 3;
+  switch(prescaler)
+  {
+    case 1: cs = 1; break;
+    case 8: cs = 2; break;
+    case 64: cs = 3; break;
+    case 256: cs = 4; break;
+    case 1024: cs = 5; break;
+  }
+
+  TCCR3B = (TCCR3B & ~0x07) | cs;
+}
+
+void ArmEchoCapture(void)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    TIFR3 = 0x20; //clear any interrupt flag that might be there
+
+    TIMSK3 |= 0x20; //enable the input capture interrupt
+    TCCR3B |= 0xC0; //set to capture the rising edge on pin 13; enable noise cancel
+
+    pingTime = TCNT3;
+    pulseState = PLS_WAITING_LOW;
+  }
+}
+
+#ifdef SONAR_CAPTURE_PCINT
+void ArmPcintCapture(void)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    PCIFR = _BV(PCIF0);      //clear any pending pin change
+    PCMSK0 |= _BV(PCINT7);  //pin 11
+    PCICR |= _BV(PCIE0);
+
+    pingTime = TCNT3;
+    pulseState = PLS_WAITING_LOW;
+  }
+}
+#endif
+
+void SetEchoBlanking(uint16_t blankCounts)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {blanking = blankCounts;}
+}
+
+uint16_t EchoBlankedCount(void)
+{
+  uint16_t count;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {count = blankedCount;}
+  return count;
+}
+
+bool EchoCaptureTimeout(uint16_t timeoutCounts)
+{
+  bool timedOut = false;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    if((pulseState == PLS_WAITING_LOW || pulseState == PLS_WAITING_HIGH) 
+        && (uint16_t)(TCNT3 - pingTime) >= timeoutCounts)
+    {
+      TIMSK3 &= ~0x20; //disable the input capture interrupt
+#ifdef SONAR_CAPTURE_PCINT
+      PCMSK0 &= ~_BV(PCINT7);
+#endif
+      pulseState = PLS_IDLE;
+      timedOut = true;
+    }
+  }
+
+  return timedOut;
+}
+
+/*
+ * ISR for input capture on pin 13. We can precisely capture the value of TIMER3
+ * by setting TCCR3B to capture either a rising or falling edge. This ISR
+ * then reads the captured value (stored in ICR3) and copies it to the appropriate
+ * variable.
+ */
+ISR(TIMER3_CAPT_vect)
+{
+  if(pulseState == PLS_WAITING_LOW) //we're waiting for a rising edge
+  {
+    pulseStart = ICR3; //copy the input capture register (timer count)
+    TCCR3B &= 0xBF;    //now set to capture falling edge on pin 13
+    pulseState = PLS_WAITING_HIGH;
+  }
+
+  else if(pulseState == PLS_WAITING_HIGH) //waiting for the falling edge
+  {
+    uint16_t capture = ICR3;
+
+    //too short to be a real target, so go back to looking for a rising edge
+    if((uint16_t)(capture - pulseStart) < blanking)
+    {
+      TCCR3B |= 0x40;
+      pulseState = PLS_WAITING_LOW;
+      blankedCount++;
+      return;
+    }
+
+    pulseEnd = capture;
+    pulseState = PLS_CAPTURED; //raise a flag to indicate that we have data
+
+#ifdef SONAR_ZONE_ALARM
+    ZoneAlarmUpdate(pulseEnd - pulseStart);
+#endif
+  }
+}
+
+#ifdef SONAR_CAPTURE_PCINT
+/*
+ * ISR for a pin change on pin 11. Any edge lands here, so we read the pin to see which it
+ * was; the timestamp is whatever TCNT3 says by the time we get to it.
+ */
+ISR(PCINT0_vect)
+{
+  uint16_t now = TCNT3;
+  bool high = PINB & _BV(PINB7);
+
+  if(pulseState == PLS_WAITING_LOW && high)
+  {
+    pulseStart = now;
+    pulseState = PLS_WAITING_HIGH;
+  }
+
+  else if(pulseState == PLS_WAITING_HIGH && !high)
+  {
+    if((uint16_t)(now - pulseStart) < blanking)
+    {
+      pulseState = PLS_WAITING_LOW;
+      blankedCount++;
+      return;
+    }
+
+    pulseEnd = now;
+    pulseState = PLS_CAPTURED;
+    PCMSK0 &= ~_BV(PCINT7);
+
+#ifdef SONAR_ZONE_ALARM
+    ZoneAlarmUpdate(pulseEnd - pulseStart);
+#endif
+  }
+}
+#endif
@@ -0,0 +1,236 @@
+#include "eeprom_log.h"
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+//never used as a sequence number, since it's what erased EEPROM reads as
+static const uint8_t NO_SEQ = 0xFF;
+
+//the block being written by the ISR: source buffer, EEPROM address, and bytes left
+static const uint8_t* volatile writeSource = 0;
+static volatile uint16_t writeAddress = 0;
+static volatile uint8_t writeLeft = 0;
+
+/*
+ * The block's sequence number is written around the rest of it: first cleared to NO_SEQ, then
+ * set once everything else is in. A block cut short by a power loss (the normal end of an
+ * untethered run) is then skipped, instead of read as valid with a mix of old and new bytes.
+ */
+enum SeqStage : uint8_t {SEQ_DONE, SEQ_CLEAR, SEQ_SET};
+static volatile SeqStage seqStage = SEQ_DONE;
+static volatile uint16_t seqAddress = 0;
+static volatile uint8_t seqValue = NO_SEQ;
+
+static inline uint8_t NextSeq(uint8_t seq)
+{
+  return seq >= NO_SEQ - 1 ? 0 : seq + 1;
+}
+
+static inline uint8_t PutVarint(uint8_t* p, uint32_t value)
+{
+  uint8_t n = 0;
+  while(value >= 0x80)
+  {
+    p[n++] = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  p[n++] = value;
+  return n;
+}
+
+void EepromLog::Begin(void)
+{
+  //the newest block is the one whose successor doesn't carry on the sequence
+  uint8_t newest = NO_SEQ;
+  uint8_t valid = 0;
+  for(uint8_t i = 0; i < EEPROM_LOG_BLOCKS; i++)
+  {
+    uint8_t seq = eeprom_read_byte((const uint8_t*)(i * EEPROM_LOG_BLOCK));
+    if(seq == NO_SEQ) continue;
+
+    valid++;
+    uint8_t next = (i + 1) % EEPROM_LOG_BLOCKS;
+    if(eeprom_read_byte((const uint8_t*)(next * EEPROM_LOG_BLOCK)) != NextSeq(seq)) newest = i;
+  }
+
+  if(newest != NO_SEQ)
+  {
+    const uint8_t* header = (const uint8_t*)(newest * EEPROM_LOG_BLOCK);
+    nextSeq = NextSeq(eeprom_read_byte(header));
+    boot = eeprom_read_byte(header + 1) + 1;
+    nextBlock = (newest + 1) % EEPROM_LOG_BLOCKS;
+  }
+
+  //we don't know what was dumped before the reset, so offer it all again
+  undumped = valid;
+  length = 0;
+}
+
+void EepromLog::StartBlock(uint32_t timestamp, uint16_t distanceMM)
+{
+  uint8_t* b = buffers[filling];
+  b[0] = NO_SEQ; //filled in when queued
+  b[1] = boot;
+  b[2] = timestamp;
+  b[3] = timestamp >> 8;
+  b[4] = timestamp >> 16;
+  b[5] = timestamp >> 24;
+  b[6] = distanceMM;
+  b[7] = distanceMM >> 8;
+  length = EEPROM_LOG_HEADER;
+}
+
+void EepromLog::Add(uint32_t timestamp, uint16_t distanceMM)
+{
+  if(!length) StartBlock(timestamp, distanceMM);
+  else
+  {
+    uint8_t record[10];
+    int16_t delta = distanceMM - lastDistance;
+    uint8_t n = PutVarint(record, timestamp - lastTime);
+    uint16_t zigzag = ((uint16_t)delta << 1) ^ (uint16_t)(delta >> 15);
+    n += PutVarint(record + n, zigzag);
+
+    if(length + n > EEPROM_LOG_BLOCK)
+    {
+      if(!Queue())
+      {
+        dropped++;
+        return;
+      }
+      StartBlock(timestamp, distanceMM);
+    }
+    else
+    {
+      uint8_t* b = buffers[filling];
+      for(uint8_t i = 0; i < n; i++) b[length++] = record[i];
+    }
+  }
+
+  lastTime = timestamp;
+  lastDistance = distanceMM;
+}
+
+bool EepromLog::Busy(void) const
+{
+  return writeLeft != 0 || seqStage != SEQ_DONE;
+}
+
+/*
+ * Hands the filling buffer to the ISR and switches to the other one. Fails if the ISR is
+ * still busy with the other one.
+ */
+bool EepromLog::Queue(void)
+{
+  if(Busy()) return false;
+
+  uint8_t* b = buffers[filling];
+  for(uint8_t i = length; i < EEPROM_LOG_BLOCK; i++) b[i] = 0xFF;
+  b[0] = nextSeq;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    seqAddress = nextBlock * EEPROM_LOG_BLOCK;
+    seqValue = nextSeq;
+    seqStage = SEQ_CLEAR;
+    writeSource = b + 1;
+    writeAddress = seqAddress + 1;
+    writeLeft = EEPROM_LOG_BLOCK - 1;
+    EECR |= _BV(EERIE);
+  }
+
+  nextSeq = NextSeq(nextSeq);
+  nextBlock = (nextBlock + 1) % EEPROM_LOG_BLOCKS;
+  if(undumped < EEPROM_LOG_BLOCKS) undumped++;
+
+  filling ^= 1;
+  length = 0;
+  return true;
+}
+
+void EepromLog::Flush(void)
+{
+  if(!length) return;
+
+  while(Busy()) {}
+  Queue();
+}
+
+uint8_t EepromLog::Dump(Print& out)
+{
+  while(Busy()) {}
+
+  static const char HEX_DIGITS[] = "0123456789abcdef";
+  uint8_t sent = 0;
+  uint8_t block = (nextBlock + EEPROM_LOG_BLOCKS - undumped) % EEPROM_LOG_BLOCKS;
+
+  for(; sent < undumped; sent++)
+  {
+    //one line per block: "#eeblk\t" and 64 hex digits
+    uint8_t line[7 + 2 * EEPROM_LOG_BLOCK + 1];
+    memcpy(line, "#eeblk\t", 7);
+    uint8_t n = 7;
+
+    const uint8_t* address = (const uint8_t*)(block * EEPROM_LOG_BLOCK);
+    for(uint8_t i = 0; i < EEPROM_LOG_BLOCK; i++)
+    {
+      uint8_t v = eeprom_read_byte(address + i);
+      line[n++] = HEX_DIGITS[v >> 4];
+      line[n++] = HEX_DIGITS[v & 0x0F];
+    }
+    line[n++] = '\n';
+    out.write(line, n);
+
+    block = (block + 1) % EEPROM_LOG_BLOCKS;
+  }
+
+  out.print("#eeend\t");
+  out.println(sent);
+
+  undumped = 0;
+  return sent;
+}
+
+/*
+ * Starts writing a byte, unless it already holds the right value, which saves both time and
+ * wear. Returns true if a write was started.
+ */
+static bool StartWrite(uint16_t address, uint8_t value)
+{
+  EEAR = address;
+  EECR |= _BV(EERE);
+  if(EEDR == value) return false;
+
+  EEDR = value;
+  EECR = (EECR & ~(_BV(EEPM1) | _BV(EEPM0))) | _BV(EEMPE); //erase and write
+  EECR |= _BV(EEPE);
+  return true;
+}
+
+//runs whenever the EEPROM is ready for another write: the cleared sequence number, the rest
+//of the block in order, then the sequence number
+ISR(EE_READY_vect)
+{
+  if(seqStage == SEQ_CLEAR)
+  {
+    seqStage = SEQ_SET;
+    if(StartWrite(seqAddress, NO_SEQ)) return;
+  }
+
+  while(writeLeft)
+  {
+    uint16_t address = writeAddress++;
+    uint8_t value = *writeSource++;
+    writeLeft--;
+    if(StartWrite(address, value)) return;
+  }
+
+  if(seqStage == SEQ_SET)
+  {
+    seqStage = SEQ_DONE;
+    if(StartWrite(seqAddress, seqValue)) return;
+  }
+
+  //done; stop the interrupt, since the EEPROM stays ready
+  EECR &= ~_BV(EERIE);
+}
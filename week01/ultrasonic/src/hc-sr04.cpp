@@ -10,53 +10,723 @@
  * of the (round trip) timer counts to hear the echo.
  * 
  * But note that the timing is in timer counts, which must be converted to time.
+ * 
+ * Build options (add to build_flags in platformio.ini):
+ *   -DSONAR_TIMED_PINGS  fire pings from a timer 3 compare match at exactly PING_INTERVAL,
+ *                        instead of whenever loop() notices that millis() has advanced
+ *   -DSONAR_SWEEP        sweep the sensor on a servo (signal on servoPin) and report
+ *                        angle and range for each ping, with a "#scan" line after each sweep
+ *   -DSONAR_ZONE_ALARM   drive alarmPin HIGH from the capture ISR while an obstacle is 
+ *                        within ALARM_ENTER_MM10 (released beyond ALARM_EXIT_MM10)
+ *   -DSONAR_REPORT_ON_CHANGE  only send a record when the distance moves by more than
+ *                        REPORT_DEADBAND_MM10, or at least every REPORT_MAX_SILENCE ms
+ *   -DSONAR_DECIMATE     keep pinging at full rate, but only send one record per 
+ *                        DECIMATE_WINDOW ms with the min, max, and mean distance
+ *   -DSONAR_TDMA         only ping in our own slot (TDMA_SLOT of TDMA_SLOT_COUNT) of a frame
+ *                        shared with other robots; the frame is aligned by an 'S' from the 
+ *                        host or a rising edge on syncPin (pin 7, INT6)
+ *   -DSONAR_IR           also read Sharp IR rangers (irPins) through a free-running ADC,
+ *                        and every FUSION_INTERVAL ms send a "#fuse" line per direction
+ *                        combining IR and ultrasonic (the ultrasonic looks along direction 0)
+ *   -DSONAR_EEPROM_LOG   don't wait for the host at startup; while no host is connected,
+ *                        log ranges (or window minimums) to EEPROM instead of sending
+ *                        them, and dump the log when one connects (see eeprom_log.h)
+ *   -DSONAR_TRACE        send a "#lat" line before each range record with the device's micros()
+ *                        at the echo's falling edge, when loop() picked it up, and when the
+ *                        record was written, and answer a 'T' from the host with a "#clk"
+ *                        line, so the host can map device time onto its own (host/tools)
+ *   -DSONAR_PAIR         two sensors side by side on the bumper (TRIG on trigPin and pairTrigPin,
+ *                        both echoes diode-OR'd onto pin 13), pinged in turn; each echo gives
+ *                        a range record with the sensor's index (0 left, 1 right) as a fifth
+ *                        field, then a "#pair" line with both ranges and the obstacle's (x, y)
+ *                        (see trilateration.h)
+ *   -DSONAR_WALL_FOLLOW  follow a wall with the sensor looking sideways: a PID runs once per
+ *                        echo on the time between echoes (see wall_follower.h) and drives
+ *                        the Romi's motors, with a "#ctl" line per update giving the dt and
+ *                        the latency from the echo's falling edge to the new motor efforts
+ *   -DSONAR_DISCOVER     at startup, probe the discoverPins for sensors (see sensor_discovery.h)
+ *                        and use the first one found as trigPin (and the first two as the
+ *                        left and right of SONAR_PAIR), reporting them in a "#sensors" line;
+ *                        if SONAR_PAIR finds only one, it pings that one alone as the left
+ *                        sensor and says so with an "#unpaired" line
+ *   -DSONAR_OUTPUT_QUEUE send records through a queue that never blocks (see output_queue.h),
+ *                        so a slow or absent host can't stall pinging; when it's full, records
+ *                        are dropped per SONAR_OUTPUT_POLICY, and a "#ovr" line reports the
+ *                        drop counts once a second while they're rising. Also doesn't wait
+ *                        for the host at startup
+ *   -DSONAR_CAPTURE_PULSEIN  time the echo with a blocking pulseIn() on pin 13 instead of ICP3
+ *   -DSONAR_CAPTURE_PCINT    time the echo from a pin change interrupt on pin 11 (PB7) 
+ *                        instead of ICP3; both are only for comparison (tools/capture_bench.py)
+ *   -DSONAR_BENCH_LOAD=US  add a synthetic interrupt load: a timer 1 ISR that spins for US
+ *                        microseconds, SONAR_BENCH_LOAD_HZ times a second (see bench_load.h)
+ *   -DSONAR_SIM          build for the simulator (tools/sim): output on Serial1 (the UART) 
+ *                        instead of USB, and sleep when idle so the simulator can measure CPU load
+ * 
+ * Some constants can also be set from build_flags, e.g., -DSONAR_PING_INTERVAL=50:
+ *   SONAR_PING_INTERVAL (ms), SONAR_BLANKING_US, SONAR_TIMER3_PRESCALER (1, 8, 64, 256, or 1024),
+ *   SONAR_OUTPUT_POLICY (OUTPUT_DROP_OLDEST, OUTPUT_DROP_NEWEST, or OUTPUT_DECIMATE)
  */
 
 #include <Arduino.h>
+#include <avr/sleep.h>
+#include "sonar_units.h"
+#include "record_writer.h"
+#include "echo_capture.h"
+#include "ping_timer.h"
+#include "sweep.h"
+#include "zone_alarm.h"
+#include "report_filter.h"
+#include "decimator.h"
+#include "tdma.h"
+#include "adc_pipeline.h"
+#include "sharp_ir.h"
+#include "range_fusion.h"
+#include "trilateration.h"
+#include "output_queue.h"
+#include "wall_follower.h"
+#include "sensor_discovery.h"
+#include "bench_load.h"
+
+#ifdef SONAR_WALL_FOLLOW
+#include <Romi32U4Motors.h>
+#endif
+#include "eeprom_log.h"
+
+#ifdef SONAR_SIM
+#define SONAR_SERIAL Serial1
+#else
+#define SONAR_SERIAL Serial
+#endif
+
+//where records go: straight to the port, or through the output queue
+#ifdef SONAR_OUTPUT_QUEUE
+#define SONAR_OUT output
+#else
+#define SONAR_OUT SONAR_SERIAL
+#endif
+
+#ifndef SONAR_OUTPUT_POLICY
+#define SONAR_OUTPUT_POLICY OUTPUT_DROP_OLDEST
+#endif
+
+#ifndef SONAR_PING_INTERVAL
+#define SONAR_PING_INTERVAL 100
+#endif
+
+#ifndef SONAR_BLANKING_US
+#define SONAR_BLANKING_US 90
+#endif
 
-volatile uint16_t pulseStart = 0;
-volatile uint16_t pulseEnd = 0;
+#if defined(SONAR_TIMED_PINGS) && defined(SONAR_SWEEP)
+#error "SONAR_SWEEP schedules its own pings; don't combine it with SONAR_TIMED_PINGS"
+#endif
 
-//define the states for the echo capture
-enum PULSE_STATE {PLS_IDLE, PLS_WAITING_LOW, PLS_WAITING_HIGH, PLS_CAPTURED};
+#if defined(SONAR_TDMA) && (defined(SONAR_TIMED_PINGS) || defined(SONAR_SWEEP))
+#error "SONAR_TDMA schedules its own pings; don't combine it with SONAR_TIMED_PINGS or SONAR_SWEEP"
+#endif
 
-//and initialize to IDLE
-volatile PULSE_STATE pulseState = PLS_IDLE;
+#if defined(SONAR_PAIR) && (defined(SONAR_TIMED_PINGS) || defined(SONAR_SWEEP) || defined(SONAR_TDMA))
+#error "SONAR_PAIR alternates between two trigger pins; don't combine it with SONAR_TIMED_PINGS, SONAR_SWEEP, or SONAR_TDMA"
+#endif
 
+#if defined(SONAR_WALL_FOLLOW) && (defined(SONAR_SWEEP) || defined(SONAR_PAIR))
+#error "SONAR_WALL_FOLLOW needs a fixed sensor (and pin 16 is a Romi motor direction pin); don't combine it with SONAR_SWEEP or SONAR_PAIR"
+#endif
+
+#if (defined(SONAR_CAPTURE_PULSEIN) || defined(SONAR_CAPTURE_PCINT)) && (defined(SONAR_TIMED_PINGS) \
+    || defined(SONAR_SWEEP) || defined(SONAR_TDMA) || defined(SONAR_PAIR) || defined(SONAR_WALL_FOLLOW) \
+    || defined(SONAR_TRACE) || defined(SONAR_DISCOVER))
+#error "SONAR_CAPTURE_PULSEIN and SONAR_CAPTURE_PCINT are for comparing capture methods, in the default ping mode only"
+#endif
+
+#if defined(SONAR_BENCH_LOAD) && defined(SONAR_WALL_FOLLOW)
+#error "SONAR_BENCH_LOAD takes timer 1, which drives the motors"
+#endif
+
+#if defined(SONAR_BENCH_LOAD) && !defined(SONAR_BENCH_LOAD_HZ)
+#define SONAR_BENCH_LOAD_HZ 1000
+#endif
+
+#if defined(SONAR_TIMED_PINGS) && defined(SONAR_TIMER3_PRESCALER)
+#if SONAR_PING_INTERVAL * (F_CPU / 1000) / SONAR_TIMER3_PRESCALER > 0xFFFF
+#error "SONAR_PING_INTERVAL is more timer 3 counts than SONAR_TIMED_PINGS can schedule; use a larger SONAR_TIMER3_PRESCALER"
+#endif
+#endif
+
+#ifdef SONAR_DISCOVER
+/*
+ * TRIG pins to look for sensors on, in order of preference (with SONAR_PAIR, left before
+ * right). Each is pulsed for 10 us at startup, so leave out anything that would mind: pins
+ * the other options use are only candidates when those options are off.
+ */
+const uint8_t discoverPins[] =
+{
+  14,
+#ifndef SONAR_WALL_FOLLOW
+  16,   //a Romi motor direction pin
+#endif
+  4,
+#ifndef SONAR_ZONE_ALARM
+  5,    //alarmPin
+#endif
+  6, 8,
+#ifndef SONAR_CAPTURE_PCINT
+  11,   //the PCINT echo input
+#endif
+#ifndef SONAR_SWEEP
+  12,   //servoPin
+#endif
+};
+
+//give up on a pin this long after triggering it; see sensor_discovery.h
+const uint16_t DISCOVER_LISTEN_US = 3000;
+
+const uint8_t MAX_SENSORS = 4;
+uint8_t sensorPins[MAX_SENSORS];
+uint8_t sensorCount = 0;
+
+//the first sensor found (left at the default if there aren't any)
+uint8_t trigPin = 14;
+#else
 //this may be most any pin, connect the pin to Trig on the sensor
 const uint8_t trigPin = 14;
+#endif
+
+#ifdef SONAR_SWEEP
+//connect the servo signal lead here
+const uint8_t servoPin = 12;
+
+//sweep 0 - 180 degrees in 5 degree steps; adjust the timing to match your servo
+const SweepConfig SWEEP_CONFIG = {0, 180, 5, 600, 2400, 2000, 2000};
+
+//angle at which the current ping was taken, and whether it finishes a scan
+int16_t pingAngle = 0;
+bool pingEndsScan = false;
+uint16_t scanCount = 0;
+#endif
+
+#ifdef SONAR_PAIR
+/*
+ * The second sensor's TRIG. Only the sensor that was just triggered drives its echo line, so
+ * the two can share ICP3 through a pair of diodes (with a pull-down on pin 13).
+ */
+const uint8_t pairTrigPin = 16;
+
+//which sensor (Trilateration::LEFT on trigPin, RIGHT on pairTrigPin) each ping is from
+uint8_t pairTrigPins[] = {trigPin, pairTrigPin};
+
+//the sensors' lateral offsets from the centre line, in tenths of a mm (left positive)
+const int16_t PAIR_LEFT_Y_MM10 = 750;
+const int16_t PAIR_RIGHT_Y_MM10 = -750;
+
+/*
+ * Taking turns, the other sensor's last reading is a ping old when it's paired, and each
+ * sensor's own readings are two pings apart; both get some slack for a late loop().
+ */
+const uint32_t PAIR_SLACK_US = 50000;
+Trilateration pair(PAIR_LEFT_Y_MM10, PAIR_RIGHT_Y_MM10, 2000, SONAR_PING_INTERVAL * 1000ul + PAIR_SLACK_US,
+                   2 * SONAR_PING_INTERVAL * 1000ul + PAIR_SLACK_US);
+
+uint8_t pairSensor = Trilateration::RIGHT;
+uint32_t pairPingUS = 0;
+
+//cleared when discovery finds only the left sensor, which then pings on its own
+bool pairBoth = true;
+#endif
+
+#ifdef SONAR_ZONE_ALARM
+//output to the motor controller
+const uint8_t alarmPin = 5;
+
+//zone thresholds, in tenths of a mm; the difference is the hysteresis
+const uint32_t ALARM_ENTER_MM10 = 3000;
+const uint32_t ALARM_EXIT_MM10 = 3500;
+#endif
+
+#ifdef SONAR_REPORT_ON_CHANGE
+const uint32_t REPORT_DEADBAND_MM10 = 50;  //5 mm
+const uint32_t REPORT_MAX_SILENCE = 1000;  //ms
+
+ReportFilter reportFilter(REPORT_DEADBAND_MM10, REPORT_MAX_SILENCE);
+#endif
+
+#ifdef SONAR_DECIMATE
+const uint32_t DECIMATE_WINDOW = 1000; //ms
+
+Decimator decimator(DECIMATE_WINDOW);
+#endif
+
+#ifdef SONAR_IR
+//one IR ranger per direction; the first looks the same way as the ultrasonic
+const uint8_t irPins[] = {A0, A2, A3};
+const uint8_t IR_COUNT = sizeof(irPins);
+
+//how fast the robot can close on an obstacle (mm/s), for ageing readings
+const uint16_t FUSION_MAX_SPEED = 500;
+const uint32_t FUSION_INTERVAL = 50; //ms
+
+RangeFusion fusion[IR_COUNT] = {RangeFusion(FUSION_MAX_SPEED), RangeFusion(FUSION_MAX_SPEED), 
+                                RangeFusion(FUSION_MAX_SPEED)};
+uint32_t lastFusion = 0;
+#endif
+
+#ifdef SONAR_WALL_FOLLOW
+/*
+ * Hold 200 mm from a wall on the left at a modest speed. The gains are a starting point for
+ * a Romi (efforts up to 300) pinging at 10-20 Hz; add some ki if it settles off the target.
+ */
+const WallFollowConfig WALL_FOLLOW_CONFIG = {2000, true, 120, 300, 16, 0, 32, 200000, 300000};
+
+WallFollower wallFollower(WALL_FOLLOW_CONFIG);
+Romi32U4Motors motors;
+#endif
+
+#ifdef SONAR_OUTPUT_QUEUE
+OutputQueue output(SONAR_SERIAL, SONAR_OUTPUT_POLICY);
+
+//how often to report the drop counts, if they've changed
+const uint32_t OUTPUT_STATS_INTERVAL = 1000; //ms
+uint32_t lastOutputStats = 0;
+uint32_t reportedDrops = 0;
+#endif
+
+//echoes outside of this range are not counted as valid readings
+const uint32_t MIN_VALID_MM10 = 200;    //2 cm
+const uint32_t MAX_VALID_MM10 = 40000;  //4 m
+
+#ifdef SONAR_EEPROM_LOG
+EepromLog eepromLog;
+
+//whether the host has the port open (DTR, for the USB serial port); updated in loop()
+bool hostPresent = false;
+
+//the USB core's check for the host includes a 10 ms delay, so it's only done this often
+const uint32_t HOST_CHECK_INTERVAL = 250; //ms
+uint32_t lastHostCheck = 0;
+#endif
+
+#ifdef SONAR_TDMA
+//give each robot a different slot, e.g., with -DTDMA_SLOT=2 in build_flags
+#ifndef TDMA_SLOT
+#define TDMA_SLOT 0
+#endif
+
+#ifndef TDMA_SLOT_COUNT
+#define TDMA_SLOT_COUNT 4
+#endif
+
+//the slot must hold the longest echo (ECHO_TIMEOUT_US) plus a guard for sync jitter
+const uint32_t TDMA_SLOT_US = 45000;
+const uint32_t TDMA_LATE_LIMIT_US = 2000;
+
+TdmaSchedule tdma(TDMA_SLOT, TDMA_SLOT_COUNT, TDMA_SLOT_US, TDMA_LATE_LIMIT_US);
+
+//all robots share this line; the host (or one robot) pulses it at the start of a frame
+const uint8_t syncPin = 7;
+volatile uint32_t syncTime = 0;
+volatile bool syncPending = false;
+
+void SyncISR(void)
+{
+  syncTime = micros();
+  syncPending = true;
+}
+#endif
+
+//echoes shorter than this are ignored as ring-down (about 1.5 cm); see echo_capture.h
+const uint32_t ECHO_BLANKING_US = SONAR_BLANKING_US;
+
+//give up on an echo after this long; the HC-SR04 reports no echo as a ~38 ms pulse
+const uint32_t ECHO_TIMEOUT_US = 40000;
+uint16_t echoTimeoutCounts = 0xFFFF;
 
 //for scheduling pings
 uint32_t lastPing = 0;
-const uint32_t PING_INTERVAL = 100; //ms
+const uint32_t PING_INTERVAL = SONAR_PING_INTERVAL; //ms
+
+//prescaler for timer 3, which is read from TCCR3B in setup()
+uint16_t timer3Prescaler = 64;
+
+#ifdef SONAR_CAPTURE_PULSEIN
+//the width of the last echo, as timed by pulseIn()
+uint32_t pulseInUS = 0;
+#endif
+
+#ifdef SONAR_TRACE
+//micros() at the falling edge of the echo being reported, and when loop() picked it up
+uint32_t traceCaptureUS = 0;
+uint32_t traceReadyUS = 0;
+#endif
+
 
 /*
- * Commands the ultrasonic to take a reading
+ * Converts a time (us) to timer 3 counts, saturating at 16 bits.
  */
-void CommandPing(int trigPin)
+uint16_t MicrosToTimerCounts(uint32_t us)
 {
-  cli(); //disable interrupts
+  uint32_t counts = us * (F_CPU / 1000000ul) / timer3Prescaler;
+  return counts > 0xFFFF ? 0xFFFF : counts;
+}
 
-  TIFR3 = 0x20; //clear any interrupt flag that might be there
+/*
+ * Converts a distance (tenths of a mm) to the echo width in timer 3 counts.
+ */
+uint16_t MM10ToTimerCounts(uint32_t distanceMM10)
+{
+  return MicrosToTimerCounts(distanceMM10 * MM10_PER_US_DEN / MM10_PER_US_NUM);
+}
 
-  TIMSK3 |= 0x20; //enable the input capture interrupt
-  TCCR3B |= 0xC0; //set to capture the rising edge on pin 13; enable noise cancel
+/*
+ * Sends one record: timestamp, timer counts, pulse length (us), and distance (mm, to 0.1 mm).
+ * 
+ * The record is formatted into a stack buffer with integer-only routines and sent with a
+ * single write(). Define SONAR_LEGACY_PRINT to get the original Serial.print() version
+ * (e.g., to compare flash usage).
+ */
+void SendRecord(Print& out, uint32_t timestamp, uint16_t counts, uint32_t pulseUS, uint32_t distanceMM10)
+{
+#ifdef SONAR_LEGACY_PRINT
+  out.print(timestamp);
+  out.print('\t');
+  out.print(counts);
+  out.print('\t');
+  out.print(pulseUS);
+  out.print('\t');
+  out.print(distanceMM10 / 10.0);
+  out.print('\n');
+#else
+  RecordWriter rec;
+  rec.u32(timestamp).tab().u32(counts).tab().u32(pulseUS).tab().fixed1(distanceMM10).eol();
+  out.write(rec.data(), rec.length());
+#endif
+}
 
-  sei(); //re-enable interrupts
+/*
+ * Sends a record from one of several sensors: the same fields as SendRecord(), then the
+ * sensor's index (for SONAR_PAIR, Trilateration::LEFT or RIGHT).
+ */
+void SendSensorRecord(Print& out, uint32_t timestamp, uint16_t counts, uint32_t pulseUS, uint32_t distanceMM10,
+                      uint8_t sensor)
+{
+  RecordWriter rec;
+  rec.u32(timestamp).tab().u32(counts).tab().u32(pulseUS).tab().fixed1(distanceMM10).tab().u32(sensor).eol();
+  out.write(rec.data(), rec.length());
+}
 
-  //update the state and command a ping
-  pulseState = PLS_WAITING_LOW;
-  
+/*
+ * Sends one point of a scan: timestamp, angle (degrees), and distance (mm, to 0.1 mm).
+ */
+void SendScanPoint(Print& out, uint32_t timestamp, int16_t angle, uint32_t distanceMM10)
+{
+  RecordWriter rec;
+  rec.u32(timestamp).tab().i32(angle).tab().fixed1(distanceMM10).eol();
+  out.write(rec.data(), rec.length());
+}
+
+/*
+ * Marks the end of a sweep: "#scan" and the scan number. 
+ */
+void SendScanEnd(Print& out, uint16_t scan)
+{
+  RecordWriter rec;
+  rec.text("#scan").tab().u32(scan).eol();
+  out.write(rec.data(), rec.length());
+}
+
+/*
+ * Sends one decimated window: timestamp, number of pings, number of valid echoes, then
+ * the min, max, and mean distance (mm, to 0.1 mm) over the valid echoes.
+ */
+void SendWindow(Print& out, uint32_t timestamp, const DecimatedWindow& w)
+{
+  RecordWriter rec;
+  rec.u32(timestamp).tab().u32(w.samples).tab().u32(w.valid).tab()
+     .fixed1(w.minMM10).tab().fixed1(w.maxMM10).tab().fixed1(w.meanMM10).eol();
+  out.write(rec.data(), rec.length());
+}
+
+/*
+ * Sends one fused range: "#fuse", timestamp, direction, distance (mm, to 0.1 mm), and 
+ * source (a FUSION_SOURCE). It's a metadata line, so existing parsers pass over it.
+ */
+void SendFused(Print& out, uint32_t timestamp, uint8_t direction, uint32_t distanceMM10, uint8_t source)
+{
+  RecordWriter rec;
+  rec.text("#fuse").tab().u32(timestamp).tab().u32(direction).tab().fixed1(distanceMM10).tab().u32(source).eol();
+  out.write(rec.data(), rec.length());
+}
+
+/*
+ * Sends one obstacle position: "#pair", timestamp, the left and right ranges (mm, to 0.1 mm;
+ * 0 for none), whether they locate one obstacle, and its x (forward) and y (left) in mm.
+ */
+void SendPair(Print& out, uint32_t timestamp, const PairFix& fix)
+{
+  RecordWriter rec;
+  rec.text("#pair").tab().u32(timestamp).tab().fixed1(fix.leftMM10).tab().fixed1(fix.rightMM10).tab()
+     .u32(fix.located).tab().sfixed1(fix.xMM10).tab().sfixed1(fix.yMM10).eol();
+  out.write(rec.data(), rec.length());
+}
+
+#ifdef SONAR_WALL_FOLLOW
+/*
+ * Sends one controller update: "#ctl", timestamp, the dt it used (us; 0 if it started over),
+ * the latency from the echo's falling edge to the motors (us), the error (mm), and the left
+ * and right efforts.
+ */
+void SendControl(Print& out, uint32_t timestamp, uint32_t dtUS, uint32_t latencyUS, int32_t errorMM,
+                 int16_t left, int16_t right)
+{
+  RecordWriter rec;
+  rec.text("#ctl").tab().u32(timestamp).tab().u32(dtUS).tab().u32(latencyUS).tab().i32(errorMM).tab()
+     .i32(left).tab().i32(right).eol();
+  out.write(rec.data(), rec.length());
+}
+
+/*
+ * The controller hook: runs the wall follower on each new echo, straight away, and passes
+ * the result to the motors.
+ */
+void OnEcho(uint32_t edgeUS, uint32_t distanceMM10)
+{
+  bool valid = distanceMM10 >= MIN_VALID_MM10 && distanceMM10 <= MAX_VALID_MM10;
+
+  int16_t left, right;
+  if(!wallFollower.Update(edgeUS, valid ? distanceMM10 : 0, left, right)) return;
+
+  motors.setEfforts(left, right);
+  uint32_t latencyUS = micros() - edgeUS;
+  SendControl(SONAR_OUT, millis(), wallFollower.LastDtUS(), latencyUS, wallFollower.LastErrorMM(), left, right);
+}
+#endif
+
+#ifdef SONAR_OUTPUT_QUEUE
+/*
+ * Sends the output queue's counters: "#ovr", timestamp, bytes queued, and the records
+ * dropped for lack of room and left out by decimation.
+ */
+void SendOutputStats(Print& out, uint32_t timestamp, const OutputQueue& q)
+{
+  RecordWriter rec;
+  rec.text("#ovr").tab().u32(timestamp).tab().u32(q.Queued()).tab().u32(q.Dropped()).tab()
+     .u32(q.Decimated()).eol();
+  out.write(rec.data(), rec.length());
+}
+#endif
+
+#ifdef SONAR_DISCOVER
+/*
+ * Sends the sensor table: "#sensors", how long discovery took (ms), and the TRIG pin of each
+ * sensor found.
+ */
+void SendSensors(Print& out, uint32_t elapsedMS, const uint8_t* pins, uint8_t count)
+{
+  RecordWriter rec;
+  rec.text("#sensors").tab().u32(elapsedMS);
+  for(uint8_t i = 0; i < count; i++) rec.tab().u32(pins[i]);
+  rec.eol();
+  out.write(rec.data(), rec.length());
+}
+#endif
+
+#ifdef SONAR_TRACE
+/*
+ * Sends a latency trace: "#lat", then micros() at the echo's falling edge, when loop() picked
+ * it up, and now. It goes just before the record it describes, which the host attaches it to.
+ */
+void SendTrace(Print& out, uint32_t captureUS, uint32_t readyUS)
+{
+  RecordWriter rec;
+  rec.text("#lat").tab().u32(captureUS).tab().u32(readyUS).tab().u32(micros()).eol();
+  out.write(rec.data(), rec.length());
+}
+
+/*
+ * Answers a clock request from the host with "#clk" and micros().
+ */
+void SendClock(Print& out)
+{
+  RecordWriter rec;
+  rec.text("#clk").tab().u32(micros()).eol();
+  out.write(rec.data(), rec.length());
+}
+#endif
+
+#if defined(SONAR_TDMA) || defined(SONAR_TRACE)
+/*
+ * Handles single-character commands from the host: 'S' marks the start of a TDMA frame,
+ * and 'T' asks for the time.
+ */
+void HandleHostInput(void)
+{
+  while(SONAR_SERIAL.available())
+  {
+    int c = SONAR_SERIAL.read();
+#ifdef SONAR_TDMA
+    if(c == 'S') tdma.Sync(micros());
+#endif
+#ifdef SONAR_TRACE
+    if(c == 'T') SendClock(SONAR_OUT);
+#endif
+  }
+}
+#endif
+
+/*
+ * Sends a range record or, if nobody is listening, logs the distance (SONAR_EEPROM_LOG).
+ */
+void ReportRange(uint32_t timestamp, uint16_t counts, uint32_t pulseUS, uint32_t distanceMM10)
+{
+#ifdef SONAR_EEPROM_LOG
+  if(!hostPresent)
+  {
+    bool valid = distanceMM10 >= MIN_VALID_MM10 && distanceMM10 <= MAX_VALID_MM10;
+    eepromLog.Add(timestamp, valid ? distanceMM10 / 10 : 0);
+    return;
+  }
+#endif
+
+#ifdef SONAR_TRACE
+#ifdef SONAR_OUTPUT_QUEUE
+  //the trace is no use without its record, and vice versa
+  output.BeginGroup();
+#endif
+  SendTrace(SONAR_OUT, traceCaptureUS, traceReadyUS);
+#endif
+
+  SendRecord(SONAR_OUT, timestamp, counts, pulseUS, distanceMM10);
+#if defined(SONAR_TRACE) && defined(SONAR_OUTPUT_QUEUE)
+  output.EndGroup();
+#endif
+}
+
+/*
+ * Sends a decimated window or, if nobody is listening, logs its minimum (SONAR_EEPROM_LOG).
+ */
+void ReportWindow(uint32_t timestamp, const DecimatedWindow& w)
+{
+#ifdef SONAR_EEPROM_LOG
+  if(!hostPresent)
+  {
+    eepromLog.Add(timestamp, w.minMM10 / 10);
+    return;
+  }
+#endif
+
+  SendWindow(SONAR_OUT, timestamp, w);
+}
+
+/*
+ * Sends the reading from the sensor that just pinged, tagged with the sensor, and the obstacle
+ * position or, if nobody is listening, logs the nearer of the two ranges (SONAR_EEPROM_LOG).
+ */
+void ReportPair(uint32_t timestamp, uint8_t sensor, uint16_t counts, uint32_t pulseUS, uint32_t distanceMM10,
+                const PairFix& fix)
+{
+#ifdef SONAR_EEPROM_LOG
+  if(!hostPresent)
+  {
+    uint32_t nearest = fix.leftMM10;
+    if(!nearest || (fix.rightMM10 && fix.rightMM10 < nearest)) nearest = fix.rightMM10;
+    eepromLog.Add(timestamp, nearest / 10);
+    return;
+  }
+#endif
+
+#ifdef SONAR_OUTPUT_QUEUE
+  //the trace, the record, and the position all describe the same echo
+  output.BeginGroup();
+#endif
+#ifdef SONAR_TRACE
+  SendTrace(SONAR_OUT, traceCaptureUS, traceReadyUS);
+#endif
+
+  SendSensorRecord(SONAR_OUT, timestamp, counts, pulseUS, distanceMM10, sensor);
+  SendPair(SONAR_OUT, timestamp, fix);
+#ifdef SONAR_OUTPUT_QUEUE
+  output.EndGroup();
+#endif
+}
+
+#ifdef SONAR_BENCH_OUTPUT
+/*
+ * A Print that throws everything away, so we can time the formatting without the USB.
+ */
+class NullPrint : public Print
+{
+public:
+  size_t write(uint8_t) {return 1;}
+  size_t write(const uint8_t*, size_t size) {return size;}
+};
+
+/*
+ * Times SendRecord() using timer 3 and reports the average cost in CPU cycles.
+ * Build once with and once without SONAR_LEGACY_PRINT to compare the two paths.
+ */
+void BenchmarkOutput(void)
+{
+  const uint16_t N = 100;
+  NullPrint sink;
+
+  noInterrupts();
+  uint16_t start = TCNT3;
+  for(uint16_t i = 0; i < N; i++)
+  {
+    SendRecord(sink, 123456ul + i, 2900 + i, 11600ul + 4 * i, 19894ul + 7 * i);
+  }
+  uint16_t elapsed = TCNT3 - start;
+  interrupts();
+
+  SONAR_SERIAL.print("cycles/record = ");
+  SONAR_SERIAL.println((uint32_t)elapsed * timer3Prescaler / N);
+}
+#endif
+
+/*
+ * Commands the ultrasonic to take a reading
+ */
+void CommandPing(int trigPin)
+{
+  //set up the input capture and update the state
+#if defined(SONAR_CAPTURE_PCINT)
+  ArmPcintCapture();
+#elif !defined(SONAR_CAPTURE_PULSEIN)
+  ArmEchoCapture();
+#endif
+
+  //command a ping
   digitalWrite(trigPin, HIGH); //command a ping by bringing TRIG HIGH
   delayMicroseconds(10);      //we'll allow a delay here for convenience; it's only 10 us
   digitalWrite(trigPin, LOW);  //must bring the TRIG pin back LOW to get it to send a ping
+
+#ifdef SONAR_CAPTURE_PULSEIN
+  //the way most sketches do it: wait right here for the whole echo
+  pulseInUS = pulseIn(13, HIGH, ECHO_TIMEOUT_US);
+  if(pulseInUS)
+  {
+    pulseStart = 0;
+    pulseEnd = MicrosToTimerCounts(pulseInUS);
+    pulseState = PLS_CAPTURED;
+  }
+#endif
 }
 
 void setup()
 {
-  Serial.begin(115200);
-  while(!Serial) {} //you must open the Serial Monitor to get past this step!
-  Serial.println("setup");
+#ifdef SONAR_BENCH_OUTPUT
+  //time since init() started the clock; the bare build (src/bare) counts from reset, so its
+  //figure also includes the C runtime's startup
+  uint32_t bootUS = micros();
+#endif
+
+  SONAR_SERIAL.begin(115200);
+#ifdef SONAR_EEPROM_LOG
+  //run without a host; the log is dumped when one connects
+  eepromLog.Begin();
+#elif !defined(SONAR_OUTPUT_QUEUE)
+  while(!SONAR_SERIAL) {} //you must open the Serial Monitor to get past this step!
+#endif
+  SONAR_SERIAL.println("setup");
 
   noInterrupts(); //disable interupts while we mess with the control registers
   
@@ -67,19 +737,159 @@ void setup()
 
   //note that the Arduino machinery has already set the prescaler elsewhere
   //so we'll print out the value of the register to figure out what it is
-  Serial.print("TCCR3B = ");
-  Serial.println(TCCR3B, HEX);
+#ifdef SONAR_TIMER3_PRESCALER
+  SetTimer3Prescaler(SONAR_TIMER3_PRESCALER);
+#endif
+
+  SONAR_SERIAL.print("TCCR3B = ");
+  SONAR_SERIAL.println(TCCR3B, HEX);
+  timer3Prescaler = ReadTimer3Prescaler();
+
+  SetEchoBlanking(MicrosToTimerCounts(ECHO_BLANKING_US));
+  echoTimeoutCounts = MicrosToTimerCounts(ECHO_TIMEOUT_US);
+
+#ifdef SONAR_BENCH_OUTPUT
+  SONAR_SERIAL.print("#boot_us\t");
+  SONAR_SERIAL.println(bootUS);
+  BenchmarkOutput();
+#endif
+
+#ifdef SONAR_DISCOVER
+  pinMode(13, INPUT);
+  uint32_t discoverStart = millis();
+  sensorCount = DiscoverSensors(discoverPins, sizeof(discoverPins), sensorPins, MAX_SENSORS, 
+                                DISCOVER_LISTEN_US, ECHO_TIMEOUT_US);
+  if(sensorCount) trigPin = sensorPins[0];
+#ifdef SONAR_PAIR
+  if(sensorCount) pairTrigPins[0] = sensorPins[0];
+  if(sensorCount >= 2) pairTrigPins[1] = sensorPins[1];
+  else if(sensorCount == 1)
+  {
+    //no partner: ping the one sensor on its own, whose "#pair" lines then never locate
+    pairBoth = false;
+    pairSensor = Trilateration::LEFT;
+  }
+#endif
+  SendSensors(SONAR_SERIAL, millis() - discoverStart, sensorPins, sensorCount);
+#ifdef SONAR_PAIR
+  if(!pairBoth) SONAR_SERIAL.println("#unpaired");
+#endif
+#endif
 
   pinMode(trigPin, OUTPUT);
+#ifdef SONAR_PAIR
+  if(pairBoth) pinMode(pairTrigPins[1], OUTPUT);
+#endif
   pinMode(13, INPUT); //explicitly make 13 an input, since it defaults to OUTPUT in Arduino World (LED)
+#ifdef SONAR_CAPTURE_PCINT
+  pinMode(11, INPUT);
+#endif
+
+#ifdef SONAR_BENCH_LOAD
+  BenchLoadBegin(SONAR_BENCH_LOAD_HZ, SONAR_BENCH_LOAD);
+#endif
 
   lastPing = millis();
 
-  Serial.println("/setup");
+#ifdef SONAR_TIMED_PINGS
+  //PING_INTERVAL in timer counts, which has to fit in 16 bits; if the core's prescaler is
+  //too small for that, ping as slowly as we can and say so
+  uint32_t pingPeriodCounts = PING_INTERVAL * (F_CPU / 1000ul) / timer3Prescaler;
+  if(pingPeriodCounts > 0xFFFF)
+  {
+    pingPeriodCounts = 0xFFFF;
+    SONAR_SERIAL.print("#interval_clamped_ms\t");
+    SONAR_SERIAL.println(pingPeriodCounts * timer3Prescaler / (F_CPU / 1000ul));
+  }
+  uint8_t trigPort = digitalPinToPort(trigPin);
+  PingTimerBegin(portOutputRegister(trigPort), digitalPinToBitMask(trigPin), pingPeriodCounts);
+#endif
+
+#ifdef SONAR_ZONE_ALARM
+  pinMode(alarmPin, OUTPUT);
+  uint8_t alarmPort = digitalPinToPort(alarmPin);
+  ZoneAlarmAdd(portOutputRegister(alarmPort), digitalPinToBitMask(alarmPin), 
+               MM10ToTimerCounts(ALARM_ENTER_MM10), MM10ToTimerCounts(ALARM_EXIT_MM10));
+#endif
+
+#ifdef SONAR_TDMA
+  pinMode(syncPin, INPUT);
+  attachInterrupt(digitalPinToInterrupt(syncPin), SyncISR, RISING);
+#endif
+
+#ifdef SONAR_IR
+  uint8_t irChannels[IR_COUNT];
+  for(uint8_t i = 0; i < IR_COUNT; i++) irChannels[i] = analogPinToChannel(irPins[i] - A0);
+  AdcPipelineBegin(irChannels, IR_COUNT);
+#endif
+
+#ifdef SONAR_SWEEP
+  pinMode(servoPin, OUTPUT);
+  uint8_t servoPort = digitalPinToPort(servoPin);
+  SweepBegin(portOutputRegister(servoPort), digitalPinToBitMask(servoPin), SWEEP_CONFIG);
+#endif
+
+  SONAR_SERIAL.println("/setup");
 }
 
 void loop() 
 {
+#ifdef SONAR_EEPROM_LOG
+  if(millis() - lastHostCheck >= HOST_CHECK_INTERVAL)
+  {
+    lastHostCheck = millis();
+
+    //a host just connected: send it what we logged while it was away
+    bool hostNow = SONAR_SERIAL;
+    if(hostNow && !hostPresent)
+    {
+      eepromLog.Flush();
+      eepromLog.Dump(SONAR_SERIAL);
+    }
+    hostPresent = hostNow;
+  }
+#endif
+
+#if defined(SONAR_TDMA) || defined(SONAR_TRACE)
+  HandleHostInput();
+#endif
+
+#if defined(SONAR_SWEEP)
+  //ping as soon as the last echo is done and the servo has settled, then
+  //immediately start moving to the next angle while we wait for the echo
+  if(pulseState == PLS_IDLE && SweepSettled())
+  {
+    pingAngle = SweepAngle();
+    CommandPing(trigPin);
+    pingEndsScan = SweepStep();
+  }
+#elif defined(SONAR_TDMA)
+  //a sync from the host (see HandleHostInput()) or on syncPin marks the start of a frame
+  if(syncPending)
+  {
+    noInterrupts();
+    uint32_t t = syncTime;
+    syncPending = false;
+    interrupts();
+    tdma.Sync(t);
+  }
+
+  //check for the echo first: ShouldPing() uses up the slot, so only ask when we can ping
+  if(pulseState == PLS_IDLE && tdma.ShouldPing(micros()))
+  {
+    CommandPing(trigPin);
+  }
+#elif defined(SONAR_PAIR)
+  //the same schedule, but taking turns, so each sensor pings every other PING_INTERVAL
+  uint32_t currTime = millis();
+  if((currTime - lastPing) >= PING_INTERVAL && pulseState == PLS_IDLE)
+  {
+    lastPing = currTime;
+    if(pairBoth) pairSensor ^= 1;
+    pairPingUS = micros();
+    CommandPing(pairTrigPins[pairSensor]);
+  }
+#elif !defined(SONAR_TIMED_PINGS)
   //schedule pings roughly every PING_INTERVAL milliseconds
   uint32_t currTime = millis();
   if((currTime - lastPing) >= PING_INTERVAL && pulseState == PLS_IDLE)
@@ -87,60 +897,147 @@ void loop()
     lastPing = currTime;
     CommandPing(trigPin); //command a ping
   }
+#endif
+
+#ifdef SONAR_WALL_FOLLOW
+  //nothing from the wall for too long: stop
+  int16_t stopLeft, stopRight;
+  if(wallFollower.CheckLost(micros(), stopLeft, stopRight)) motors.setEfforts(stopLeft, stopRight);
+#endif
+
+  //no (valid) echo, so free up the state machine for the next ping
+#ifdef SONAR_PAIR
+  //and don't pair with this sensor's last reading any more
+  if(EchoCaptureTimeout(echoTimeoutCounts)) pair.Update(pairSensor, micros(), 0);
+#else
+  EchoCaptureTimeout(echoTimeoutCounts);
+#endif
   
   if(pulseState == PLS_CAPTURED) //we got an echo
   {
-    //update the state to IDLE
-    pulseState = PLS_IDLE;
-
     /*
      * Calculate the length of the pulse (in timer counts!). Note that we turn off
      * interrupts for a VERY short period so that there is no risk of the ISR changing
-     * pulseEnd or pulseStart. The way the state machine works, this wouldn't 
-     * really be a problem, but best practice is to ensure that no side effects can occur.
+     * pulseEnd or pulseStart. With SONAR_TIMED_PINGS, a new ping can be fired from an ISR
+     * as soon as we go back to IDLE, so we read the pulse before updating the state.
      */
     noInterrupts();
     uint16_t pulseLengthTimerCounts = pulseEnd - pulseStart;
+#if defined(SONAR_TRACE) || defined(SONAR_WALL_FOLLOW)
+    //work back from now to the falling edge, which the timer caught
+    uint16_t sinceEdge = TCNT3 - pulseEnd;
+    uint32_t readyUS = micros();
+    uint32_t edgeUS = readyUS - (uint32_t)sinceEdge * timer3Prescaler / (F_CPU / 1000000ul);
+#endif
+#ifdef SONAR_TRACE
+    traceReadyUS = readyUS;
+    traceCaptureUS = edgeUS;
+#endif
+    pulseState = PLS_IDLE; //update the state to IDLE
     interrupts();
     
     //EDIT THIS LINE: convert pulseLengthTimerCounts, which is in timer counts, to time, in us
     //You'll need the clock frequency and the pre-scaler to convert timer counts to time
     
-    uint32_t pulseLengthUS = 0; //pulse length in us
+#ifdef SONAR_CAPTURE_PULSEIN
+    uint32_t pulseLengthUS = pulseInUS; //pulseIn() has already done it
+#else
+    uint32_t pulseLengthUS = (uint32_t)pulseLengthTimerCounts * timer3Prescaler / (F_CPU / 1000000ul); //pulse length in us
+#endif
+
+    //EDIT THIS LINE AFTER YOU CALIBRATE THE SENSOR: put your formula in for converting us -> mm
+    //distance is kept in tenths of a mm so that we never need floating point
+    uint32_t distanceMM10 = pulseLengthUS * MM10_PER_US_NUM / MM10_PER_US_DEN;
 
+#ifdef SONAR_WALL_FOLLOW
+    //before anything is sent, so the motors get the reading first
+    OnEcho(edgeUS, distanceMM10);
+#endif
 
-    //EDIT THIS LINE AFTER YOU CALIBRATE THE SENSOR: put your formula in for converting us -> cm
-    float distancePulse = 0;    //distance in cm
+#if defined(SONAR_IR) && !defined(SONAR_SWEEP) && !defined(SONAR_PAIR)
+    bool echoValid = distanceMM10 >= MIN_VALID_MM10 && distanceMM10 <= MAX_VALID_MM10;
+    fusion[0].UpdateSonar(echoValid ? distanceMM10 : 0, millis());
+#endif
 
-    Serial.print(millis());
-    Serial.print('\t');
-    Serial.print(pulseLengthTimerCounts);
-    Serial.print('\t');
-    Serial.print(pulseLengthUS);
-    Serial.print('\t');
-    Serial.print(distancePulse);
-    Serial.print('\n');
+#ifdef SONAR_SWEEP
+    SendScanPoint(SONAR_OUT, millis(), pingAngle, distanceMM10);
+    if(pingEndsScan) SendScanEnd(SONAR_OUT, scanCount++);
+#elif defined(SONAR_PAIR)
+    //the sound hit the target halfway through the echo; the sensor raises the echo line
+    //about when the burst goes out, so that's the ping plus half the pulse
+    bool pairValid = distanceMM10 >= MIN_VALID_MM10 && distanceMM10 <= MAX_VALID_MM10;
+    pair.Update(pairSensor, pairPingUS + pulseLengthUS / 2, pairValid ? distanceMM10 : 0);
+
+    PairFix fix;
+    pair.Locate(fix);
+    ReportPair(millis(), pairSensor, pulseLengthTimerCounts, pulseLengthUS, distanceMM10, fix);
+#elif defined(SONAR_DECIMATE)
+    decimator.Add(distanceMM10, distanceMM10 >= MIN_VALID_MM10 && distanceMM10 <= MAX_VALID_MM10);
+#elif defined(SONAR_REPORT_ON_CHANGE)
+    uint32_t now = millis();
+    if(reportFilter.ShouldReport(distanceMM10, now))
+    {
+      ReportRange(now, pulseLengthTimerCounts, pulseLengthUS, distanceMM10);
+    }
+#else
+    ReportRange(millis(), pulseLengthTimerCounts, pulseLengthUS, distanceMM10);
+#endif
   }
-}
 
-/*
- * ISR for input capture on pin 13. We can precisely capture the value of TIMER3
- * by setting TCCR3B to capture either a rising or falling edge. This ISR
- * then reads the captured value (stored in ICR3) and copies it to the appropriate
- * variable.
- */
-ISR(TIMER3_CAPT_vect)
-{
-  if(pulseState == PLS_WAITING_LOW) //we're waiting for a rising edge
+#ifdef SONAR_IR
+  //the ADC ISR publishes a new IR reading every few ms; the conversion is cheap enough to
+  //do for each one
+  uint32_t irTime = millis();
+  uint16_t irSum;
+  for(uint8_t i = 0; i < IR_COUNT; i++)
   {
-    pulseStart = ICR3; //copy the input capture register (timer count)
-    TCCR3B &= 0xBF;    //now set to capture falling edge on pin 13
-    pulseState = PLS_WAITING_HIGH;
+    if(AdcPipelineTake(i, irSum)) fusion[i].UpdateIr(SharpIrToMM10(irSum), irTime);
   }
 
-  else if(pulseState == PLS_WAITING_HIGH) //waiting for the falling edge
+  if(irTime - lastFusion >= FUSION_INTERVAL)
+  {
+    lastFusion = irTime;
+    for(uint8_t i = 0; i < IR_COUNT; i++)
+    {
+      uint32_t fusedMM10;
+      FUSION_SOURCE source = fusion[i].Estimate(irTime, fusedMM10);
+      SendFused(SONAR_OUT, irTime, i, fusedMM10, source);
+    }
+  }
+#endif
+
+#ifdef SONAR_DECIMATE
+  DecimatedWindow window;
+  if(decimator.Poll(millis(), window)) ReportWindow(millis(), window);
+#endif
+
+#ifdef SONAR_OUTPUT_QUEUE
+  //report drops while they're happening (the report may itself be dropped, but the counts
+  //are running totals, so the next one catches up)
+  uint32_t statsTime = millis();
+  uint32_t drops = output.Dropped() + output.Decimated();
+  if(statsTime - lastOutputStats >= OUTPUT_STATS_INTERVAL && drops != reportedDrops)
+  {
+    lastOutputStats = statsTime;
+    reportedDrops = drops;
+    SendOutputStats(output, statsTime, output);
+  }
+
+  //pass on as much as the port will take without blocking
+  output.Pump();
+#endif
+
+#ifdef SONAR_SIM
+  //nothing else to do until the next interrupt; the simulator counts the time spent asleep
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  cli();
+  if(pulseState != PLS_CAPTURED)
   {
-    pulseEnd = ICR3;
-    pulseState = PLS_CAPTURED; //raise a flag to indicate that we have data
+    sleep_enable();
+    sei(); //the instruction after sei() always runs, so an echo can't sneak in before we sleep
+    sleep_cpu();
+    sleep_disable();
   }
+  sei();
+#endif
 }
@@ -0,0 +1,106 @@
+#include "output_queue.h"
+
+void OutputQueue::BeginGroup(void)
+{
+  grouping = true;
+  groupState = GROUP_OPEN;
+  groupBytes = 0;
+}
+
+void OutputQueue::DropOldest(void)
+{
+  do
+  {
+    uint8_t entry = (buf[head] & ~CONTINUES) + 1;
+    head += entry;  //wraps with the ring
+    used -= entry;
+  } while(used && (buf[head] & CONTINUES));
+
+  dropped++;
+}
+
+size_t OutputQueue::write(const uint8_t* data, size_t size)
+{
+  //a group that's already been dropped swallows the rest of its records
+  if(grouping && groupState == GROUP_DROPPED) return size;
+
+  //anything longer than a record can be is cut short
+  uint8_t length = size > MAX_RECORD ? MAX_RECORD : size;
+  uint16_t entry = length + 1;
+
+  //decide once per record, or per group
+  bool deciding = !grouping || groupState == GROUP_OPEN;
+  if(deciding && policy == OUTPUT_DECIMATE && used > CAPACITY / 2)
+  {
+    if(++decimateCount < decimateKeep)
+    {
+      decimated++;
+      if(grouping) groupState = GROUP_DROPPED;
+      return size;
+    }
+    decimateCount = 0;
+  }
+
+  while(CAPACITY - used < entry)
+  {
+    //never eat into the group we're in the middle of writing, or into a record or group
+    //that's partly sent (the rest of it has to follow)
+    if(policy == OUTPUT_DROP_OLDEST && used > groupBytes && !HeadInFlight())
+    {
+      DropOldest();
+      continue;
+    }
+
+    //drop this record, taking back what's already queued of its group
+    if(grouping)
+    {
+      tail -= groupBytes;
+      used -= groupBytes;
+      groupState = GROUP_DROPPED;
+    }
+    dropped++;
+    return size;
+  }
+
+  buf[tail++] = length | (grouping && groupState == GROUP_KEPT ? CONTINUES : 0);
+  for(uint8_t i = 0; i < length; i++) buf[tail++] = data[i];
+  used += entry;
+
+  if(grouping)
+  {
+    groupState = GROUP_KEPT;
+    groupBytes += entry;
+  }
+
+  return size;
+}
+
+uint8_t OutputQueue::Pump(void)
+{
+  uint8_t sent = 0;
+  while(used)
+  {
+    uint8_t length = buf[head] & ~CONTINUES;
+    int room = out.availableForWrite();
+    if(room <= 0) break;
+
+    //as much of the rest of the record as the port will take, up to the end of the ring
+    uint8_t start = head + 1 + headSent;
+    uint8_t chunk = length - headSent;
+    if(chunk > room) chunk = room;
+    if((uint16_t)start + chunk > CAPACITY) chunk = CAPACITY - start;
+
+    //a short write (e.g., the USB port was closed) leaves the rest queued
+    size_t written = out.write(buf + start, chunk);
+    headSent += written;
+    if(written < chunk) break;
+    if(headSent < length) continue;
+
+    head += length + 1;
+    used -= length + 1;
+    headSent = 0;
+    sent++;
+  }
+
+  return sent;
+}
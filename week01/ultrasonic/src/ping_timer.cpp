@@ -0,0 +1,95 @@
+#include "ping_timer.h"
+#include "echo_capture.h"
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+static volatile uint8_t* pingPort = 0;
+static uint8_t pingMask = 0;
+
+static uint16_t pingPeriod = 0;
+static uint16_t trigCounts = 4;
+
+static volatile uint32_t pingCount = 0;
+static volatile uint32_t pingMissed = 0;
+
+uint16_t TriggerPulseCounts(uint16_t prescaler)
+{
+  //counts per 10 us, rounded up, plus one since the first tick may come right away
+  uint16_t countsPer10us = (10 * (F_CPU / 1000000ul) + prescaler - 1) / prescaler;
+  return countsPer10us + 1;
+}
+
+void PingTimerBegin(volatile uint8_t* trigPort, uint8_t trigMask, uint16_t periodCounts)
+{
+  uint16_t prescaler = ReadTimer3Prescaler();
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    pingPort = trigPort;
+    pingMask = trigMask;
+    pingPeriod = periodCounts;
+    trigCounts = TriggerPulseCounts(prescaler);
+
+    OCR3A = TCNT3 + periodCounts;
+    TIFR3 = _BV(OCF3A) | _BV(OCF3B); //clear any stale compare flags
+    TIMSK3 |= _BV(OCIE3A);
+  }
+}
+
+void PingTimerStop(void)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    TIMSK3 &= ~(_BV(OCIE3A) | _BV(OCIE3B));
+    if(pingPort) *pingPort &= ~pingMask;
+  }
+}
+
+uint32_t PingTimerCount(void)
+{
+  uint32_t count;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {count = pingCount;}
+  return count;
+}
+
+uint32_t PingTimerMissed(void)
+{
+  uint32_t missed;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {missed = pingMissed;}
+  return missed;
+}
+
+/*
+ * Fires a ping. OCR3A is advanced by the period (rather than set from TCNT3),
+ * so any latency in getting here doesn't accumulate.
+ */
+ISR(TIMER3_COMPA_vect)
+{
+  OCR3A += pingPeriod;
+
+  //don't start a new ping until the last one is processed; the sample is lost, but the
+  //schedule is not disturbed
+  if(pulseState != PLS_IDLE)
+  {
+    pingMissed++;
+    return;
+  }
+
+  ArmEchoCapture();
+
+  *pingPort |= pingMask; //bring TRIG HIGH
+  OCR3B = TCNT3 + trigCounts;
+  TIFR3 = _BV(OCF3B);
+  TIMSK3 |= _BV(OCIE3B);
+
+  pingCount++;
+}
+
+/*
+ * Ends the TRIG pulse.
+ */
+ISR(TIMER3_COMPB_vect)
+{
+  *pingPort &= ~pingMask; //must bring the TRIG pin back LOW to get it to send a ping
+  TIMSK3 &= ~_BV(OCIE3B);
+}
@@ -0,0 +1,58 @@
+#include "range_fusion.h"
+
+/*
+ * Sensor noise models, as sigma = base + growth, in mm. For the IR, growth is d^2 / 20000
+ * (13 mm at 40 cm, 37 mm at 80 cm); for the ultrasonic, 1% of d.
+ */
+static const uint32_t IR_BASE_MM = 5;
+static const uint32_t SONAR_BASE_MM = 3;
+
+uint32_t RangeFusion::Variance(const Reading& r, uint32_t baseMM, uint32_t growthMM, uint32_t now) const
+{
+  uint32_t age = now - r.time;
+  if(!r.mm10 || age > maxAge) return 0;
+
+  //how far things may have moved since (maxAge <= 65535 ms, maxSpeed <= 65535 mm/s)
+  uint32_t sigma = baseMM + growthMM + age * maxSpeed / 1000;
+  return sigma * sigma;
+}
+
+FUSION_SOURCE RangeFusion::Estimate(uint32_t now, uint32_t& distanceMM10) const
+{
+  uint32_t irMM = ir.mm10 / 10;
+  uint32_t sonarMM = sonar.mm10 / 10;
+  uint32_t irVar = Variance(ir, IR_BASE_MM, irMM * irMM / 20000, now);
+  uint32_t sonarVar = Variance(sonar, SONAR_BASE_MM, sonarMM / 100, now);
+
+  if(!irVar && !sonarVar) 
+  {
+    distanceMM10 = 0;
+    return FUSED_NONE;
+  }
+
+  if(!sonarVar)
+  {
+    distanceMM10 = ir.mm10;
+    return FUSED_IR;
+  }
+
+  if(!irVar)
+  {
+    distanceMM10 = sonar.mm10;
+    return FUSED_SONAR;
+  }
+
+  //3 sigma apart? (compared squared; diff is at most 4000 mm, so this fits in 32 bits)
+  uint32_t diff = irMM > sonarMM ? irMM - sonarMM : sonarMM - irMM;
+  if(diff * diff > 9 * (irVar + sonarVar))
+  {
+    distanceMM10 = ir.mm10 < sonar.mm10 ? ir.mm10 : sonar.mm10;
+    return FUSED_NEAREST;
+  }
+
+  //weight of the IR reading, out of 256; the variances are well under 2^24, so this fits
+  uint32_t irWeight = (sonarVar << 8) / (irVar + sonarVar);
+  int32_t delta = (int32_t)ir.mm10 - (int32_t)sonar.mm10;
+  distanceMM10 = sonar.mm10 + (delta * (int32_t)irWeight) / 256;
+  return FUSED_BOTH;
+}
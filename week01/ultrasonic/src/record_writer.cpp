@@ -0,0 +1,66 @@
+#include "record_writer.h"
+
+/*
+ * The AVR has no hardware divider, and a 32-bit divide is several times slower than a
+ * 16-bit one. So we only do 32-bit division when the value doesn't fit in 16 bits,
+ * and even then we only do it once (to peel off the low four digits).
+ */
+void RecordWriter::u16(uint16_t value, uint8_t minDigits)
+{
+  char digits[5];
+  uint8_t n = 0;
+
+  do
+  {
+    digits[n++] = '0' + (value % 10);
+    value /= 10;
+  } while(value);
+
+  while(n < minDigits) digits[n++] = '0';
+
+  //digits are generated least-significant first, so copy them out backwards
+  while(n) ch(digits[--n]);
+}
+
+RecordWriter& RecordWriter::u32(uint32_t value)
+{
+  if(value <= 0xFFFF) u16(value, 1);
+
+  else
+  {
+    uint32_t high = value / 10000;
+    uint16_t low = value - high * 10000;
+
+    //value < 2^32, so high < 429497 -- at most one more split is needed
+    if(high <= 0xFFFF) u16(high, 1);
+    else
+    {
+      uint16_t top = high / 10000;
+      u16(top, 1);
+      u16(high - (uint32_t)top * 10000, 4);
+    }
+
+    u16(low, 4);
+  }
+
+  return *this;
+}
+
+RecordWriter& RecordWriter::i32(int32_t value)
+{
+  if(value < 0)
+  {
+    ch('-');
+    return u32(-(uint32_t)value);
+  }
+
+  return u32(value);
+}
+
+RecordWriter& RecordWriter::fixed1(uint32_t tenths)
+{
+  uint32_t whole = tenths / 10;
+  u32(whole);
+  ch('.');
+  return ch('0' + (tenths - whole * 10));
+}
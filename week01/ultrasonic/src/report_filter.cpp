@@ -0,0 +1,18 @@
+#include "report_filter.h"
+
+bool ReportFilter::ShouldReport(uint32_t distanceMM10, uint32_t now)
+{
+  uint32_t change = distanceMM10 > lastDistance ? distanceMM10 - lastDistance 
+                                                : lastDistance - distanceMM10;
+
+  if(hasReported && change <= deadband && (now - lastTime) < maxSilence)
+  {
+    suppressed++;
+    return false;
+  }
+
+  hasReported = true;
+  lastDistance = distanceMM10;
+  lastTime = now;
+  return true;
+}
@@ -0,0 +1,65 @@
+#include "sensor_discovery.h"
+#include "echo_capture.h"
+#include <Arduino.h>
+
+//the echo capture input
+static const uint8_t ECHO_PIN = 13;
+
+static uint16_t ToTimerCounts(uint32_t us)
+{
+  uint32_t counts = us * (F_CPU / 1000000ul) / ReadTimer3Prescaler();
+  return counts > 0xFFFF ? 0xFFFF : counts;
+}
+
+/*
+ * Pings on pin once and returns true if a sensor answered. Waits for its echo to end, so the
+ * line is free for the next probe.
+ */
+static bool Probe(uint8_t pin, uint16_t listenCounts, uint16_t timeoutCounts, uint16_t timeoutUS)
+{
+  //the echo lines are shared, so let whatever is still echoing finish
+  uint32_t start = micros();
+  while(digitalRead(ECHO_PIN) == HIGH && micros() - start < timeoutUS) {}
+
+  pinMode(pin, OUTPUT);
+  ArmEchoCapture();
+  digitalWrite(pin, HIGH);
+  delayMicroseconds(10);
+  digitalWrite(pin, LOW);
+
+  while(pulseState == PLS_WAITING_LOW && (uint16_t)(TCNT3 - pingTime) < listenCounts) {}
+
+  //nothing: disarm the capture
+  if(pulseState == PLS_WAITING_LOW)
+  {
+    EchoCaptureTimeout(0);
+    return false;
+  }
+
+  while(!EchoCaptureTimeout(timeoutCounts) && pulseState != PLS_CAPTURED) {}
+  pulseState = PLS_IDLE;
+  return true;
+}
+
+uint8_t DiscoverSensors(const uint8_t* candidates, uint8_t count, uint8_t* found, uint8_t maxFound,
+                        uint16_t listenUS, uint16_t timeoutUS)
+{
+  uint16_t listenCounts = ToTimerCounts(listenUS);
+  uint16_t timeoutCounts = ToTimerCounts(timeoutUS);
+
+  uint8_t n = 0;
+  for(uint8_t i = 0; i < count && n < maxFound; i++)
+  {
+    uint8_t pin = candidates[i];
+    if(pin == ECHO_PIN) continue;
+
+    //twice, so a stray edge can't make a sensor out of nothing
+    if(Probe(pin, listenCounts, timeoutCounts, timeoutUS) && Probe(pin, listenCounts, timeoutCounts, timeoutUS))
+    {
+      found[n++] = pin;
+    }
+    else pinMode(pin, INPUT);
+  }
+
+  return n;
+}
@@ -0,0 +1,39 @@
+#include "sharp_ir.h"
+#include "adc_pipeline.h"
+#include <avr/pgmspace.h>
+
+struct SharpIrPoint
+{
+  uint16_t adc;       //10-bit reading
+  uint16_t mm10;
+};
+
+//GP2Y0A21 typical output, closest first (so adc is falling)
+static const SharpIrPoint SHARP_IR_TABLE[] PROGMEM =
+{
+  {471, 1000}, {338, 1500}, {266, 2000}, {188, 3000}, {153, 4000},
+  {123, 5000}, {102, 6000}, {92, 7000}, {82, 8000},
+};
+
+static const uint8_t SHARP_IR_POINTS = sizeof(SHARP_IR_TABLE) / sizeof(SHARP_IR_TABLE[0]);
+
+uint32_t SharpIrToMM10(uint16_t adcSum)
+{
+  //stay in the oversampled scale so the extra bits aren't thrown away
+  uint16_t nearAdc = pgm_read_word(&SHARP_IR_TABLE[0].adc) * ADC_OVERSAMPLE;
+  if(adcSum > nearAdc) return 0;
+
+  for(uint8_t i = 1; i < SHARP_IR_POINTS; i++)
+  {
+    uint16_t farAdc = pgm_read_word(&SHARP_IR_TABLE[i].adc) * ADC_OVERSAMPLE;
+    if(adcSum >= farAdc)
+    {
+      uint16_t nearMM10 = pgm_read_word(&SHARP_IR_TABLE[i - 1].mm10);
+      uint16_t farMM10 = pgm_read_word(&SHARP_IR_TABLE[i].mm10);
+      return nearMM10 + (uint32_t)(farMM10 - nearMM10) * (nearAdc - adcSum) / (nearAdc - farAdc);
+    }
+    nearAdc = farAdc;
+  }
+
+  return 0;
+}
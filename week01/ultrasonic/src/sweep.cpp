@@ -0,0 +1,154 @@
+#include "sweep.h"
+#include "echo_capture.h"
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+static const uint16_t SERVO_FRAME_US = 20000;
+
+static volatile uint8_t* servoPort = 0;
+static uint8_t servoMask = 0;
+
+static SweepConfig cfg;
+static uint16_t prescaler = 64;
+
+static int16_t angle = 0;
+static int8_t direction = 1;
+
+//servo pulse widths, in timer counts
+static volatile uint16_t pendingWidth = 0;
+static uint16_t activeWidth = 0;
+static uint16_t frameCounts = 5000;
+
+/*
+ * Whether the latest command has taken effect, and how long ago: whole frames since then,
+ * plus the timer 3 count at the start of the current frame. A full-range move can take
+ * longer to settle than the 16-bit timer takes to wrap, so it's timed in frames.
+ */
+static volatile bool applied = false;
+static volatile uint16_t framesSinceApplied = 0;
+static volatile uint16_t frameStart = 0;
+static uint32_t settleCounts = 0;
+static bool settled = false;
+
+//us in timer 3 counts (0.5 us each at prescaler 8)
+static uint32_t Counts(uint32_t us)
+{
+  return us * (F_CPU / 1000000ul) / prescaler;
+}
+
+//the same, saturating at what a 16-bit compare can reach
+static uint16_t ToCounts(uint32_t us)
+{
+  uint32_t counts = Counts(us);
+  return counts > 0xFFFF ? 0xFFFF : counts;
+}
+
+static uint16_t AngleToCounts(int16_t a)
+{
+  //signed, so that a servo mounted backwards (maxPulseUS < minPulseUS) works too
+  int32_t us = cfg.minPulseUS + ((int32_t)cfg.maxPulseUS - cfg.minPulseUS) 
+                                  * (a - cfg.minAngle) / (cfg.maxAngle - cfg.minAngle);
+  return ToCounts(us);
+}
+
+static void Command(int16_t a, uint16_t degrees)
+{
+  uint32_t settleUS = cfg.settleBaseUS + (uint32_t)cfg.settleUSPerDeg * degrees;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    angle = a;
+    pendingWidth = AngleToCounts(a);
+    settleCounts = Counts(settleUS);
+    applied = false;
+    settled = false;
+  }
+}
+
+void SweepBegin(volatile uint8_t* port, uint8_t mask, const SweepConfig& config)
+{
+  cfg = config;
+  prescaler = ReadTimer3Prescaler();
+  frameCounts = ToCounts(SERVO_FRAME_US);
+  direction = 1;
+
+  //the first move can be the full range
+  Command(cfg.minAngle, cfg.maxAngle - cfg.minAngle);
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    servoPort = port;
+    servoMask = mask;
+    *servoPort &= ~servoMask;
+
+    OCR3C = TCNT3 + frameCounts;
+    TIFR3 = _BV(OCF3C);
+    TIMSK3 |= _BV(OCIE3C);
+  }
+}
+
+bool SweepSettled(void)
+{
+  if(settled) return true;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    //the frames so far, plus however far into this one we are (a little over a frame if
+    //its compare interrupt is waiting on this block)
+    uint32_t elapsed = (uint32_t)framesSinceApplied * frameCounts + (uint16_t)(TCNT3 - frameStart);
+    if(applied && elapsed >= settleCounts) settled = true;
+  }
+
+  return settled;
+}
+
+int16_t SweepAngle(void)
+{
+  return angle;
+}
+
+bool SweepStep(void)
+{
+  bool endOfScan = false;
+  int16_t next = angle + direction * cfg.step;
+
+  if(next > cfg.maxAngle || next < cfg.minAngle)
+  {
+    direction = -direction;
+    next = angle + direction * cfg.step;
+    endOfScan = true;
+  }
+
+  Command(next, cfg.step);
+  return endOfScan;
+}
+
+/*
+ * Generates the servo pulse train. On the rising edge (start of a frame), we pick up any
+ * new pulse width, count the frame, and note when it started; the falling edge is scheduled
+ * from the width.
+ */
+ISR(TIMER3_COMPC_vect)
+{
+  if(*servoPort & servoMask)
+  {
+    *servoPort &= ~servoMask;
+    OCR3C += frameCounts - activeWidth;
+  }
+
+  else
+  {
+    *servoPort |= servoMask;
+
+    if(activeWidth != pendingWidth || !applied)
+    {
+      activeWidth = pendingWidth;
+      applied = true;
+      framesSinceApplied = 0;
+    }
+    else if(framesSinceApplied != 0xFFFF) framesSinceApplied++;
+    frameStart = OCR3C;
+
+    OCR3C += activeWidth;
+  }
+}
@@ -0,0 +1,39 @@
+#include "tdma.h"
+
+void TdmaSchedule::Sync(uint32_t nowUS)
+{
+  nextPing = nowUS + (uint32_t)slot * slotUS;
+
+  //if a resync just nudges the frame, we may already have pinged for this one
+  if(pinged && (int32_t)(nextPing - lastPing) < (int32_t)(FrameUS() / 2)) nextPing += FrameUS();
+
+  synced = true;
+}
+
+bool TdmaSchedule::ShouldPing(uint32_t nowUS)
+{
+  if(!synced) return false;
+
+  //signed difference, so that this works across the wrap of the us clock
+  int32_t late = (int32_t)(nowUS - nextPing);
+  if(late < 0) return false;
+
+  //we're in (or past) our slot either way, so move on to the next frame; we don't do
+  //any division, since this is called from every pass through loop()
+  uint32_t frame = FrameUS();
+  bool ping = (uint32_t)late <= lateLimit;
+  if(ping)
+  {
+    pinged = true;
+    lastPing = nowUS;
+  }
+  else skipped++;
+
+  do
+  {
+    nextPing += frame;
+    late -= frame;
+  } while(late >= 0);
+
+  return ping;
+}
@@ -0,0 +1,104 @@
+#include "trilateration.h"
+
+//ranges may disagree by this much more than the baseline (noise) and still be paired
+static const int32_t DISAGREE_TOLERANCE_MM10 = 100;
+
+uint16_t ISqrt32(uint32_t value)
+{
+  //one result bit per step, from the top
+  uint32_t root = 0;
+  uint32_t bit = 1ul << 30;
+  while(bit > value) bit >>= 2;
+
+  while(bit)
+  {
+    if(value >= root + bit)
+    {
+      value -= root + bit;
+      root = (root >> 1) + bit;
+    }
+    else root >>= 1;
+    bit >>= 2;
+  }
+
+  return root;
+}
+
+Trilateration::Trilateration(int16_t yLeft, int16_t yRight, uint16_t maxSpeed, uint32_t maxAgeUS,
+                             uint32_t rateWindowUS)
+  : yLeft(yLeft), yRight(yRight), maxRate(maxSpeed > 3276 ? 32767 : maxSpeed * 10), maxAgeUS(maxAgeUS),
+    rateWindowUS(rateWindowUS)
+{
+}
+
+void Trilateration::Update(uint8_t sensor, uint32_t timeUS, uint32_t rangeMM10)
+{
+  Track& t = tracks[sensor];
+
+  //the rate needs two valid readings close enough together; in mm10/s, from ms
+  uint32_t dtMS = (timeUS - t.timeUS) / 1000;
+  int32_t rate = 0;
+  if(rangeMM10 && t.mm10 && dtMS && timeUS - t.timeUS <= rateWindowUS)
+  {
+    rate = ((int32_t)rangeMM10 - (int32_t)t.mm10) * 1000 / (int32_t)dtMS;
+    if(rate > maxRate) rate = maxRate;
+    if(rate < -maxRate) rate = -maxRate;
+  }
+
+  t.mm10 = rangeMM10;
+  t.timeUS = timeUS;
+  t.rate = rate;
+  latest = sensor;
+}
+
+uint32_t Trilateration::RangeAt(const Track& t, uint32_t timeUS) const
+{
+  uint32_t age = timeUS - t.timeUS;
+  if(!t.mm10 || age > maxAgeUS) return 0;
+
+  //rate (mm10/s) * age (us), with the age in 64 us steps so it stays in 32 bits
+  int32_t carried = (int32_t)t.mm10 + (int32_t)t.rate * (int32_t)(age >> 6) / 15625;
+  return carried > 0 ? carried : 0;
+}
+
+void Trilateration::Locate(PairFix& fix) const
+{
+  const Track& ref = tracks[latest];
+  uint32_t other = RangeAt(tracks[latest ^ 1], ref.timeUS);
+
+  fix.timeUS = ref.timeUS;
+  fix.leftMM10 = latest == LEFT ? ref.mm10 : other;
+  fix.rightMM10 = latest == LEFT ? other : ref.mm10;
+  fix.xMM10 = 0;
+  fix.yMM10 = 0;
+  fix.located = false;
+
+  if(!fix.leftMM10 || !fix.rightMM10) return;
+
+  int32_t baseline = (int32_t)yLeft - yRight;
+  if(!baseline) return;
+
+  //no single point is that much nearer one sensor than the other
+  int32_t difference = (int32_t)fix.leftMM10 - (int32_t)fix.rightMM10;
+  if(difference < 0) difference = -difference;
+  if(difference > (baseline < 0 ? -baseline : baseline) + DISAGREE_TOLERANCE_MM10)
+  {
+    disagreements++;
+    return;
+  }
+
+  //ranges are at most 4 m (40000 mm10), so the squares fit in 32 bits
+  uint32_t left2 = fix.leftMM10 * fix.leftMM10;
+  uint32_t right2 = fix.rightMM10 * fix.rightMM10;
+  int32_t y = ((int32_t)yLeft + yRight) / 2 + (int32_t)(right2 - left2) / (2 * baseline);
+
+  //within the tolerance the ranges can be slightly inconsistent; put it on the nearer circle
+  int32_t dy = y - yLeft;
+  if(dy > 0xFFFF) dy = 0xFFFF;
+  if(dy < -0xFFFF) dy = -0xFFFF;
+  uint32_t dy2 = (uint32_t)(dy < 0 ? -dy : dy) * (uint32_t)(dy < 0 ? -dy : dy);
+
+  fix.xMM10 = dy2 < left2 ? ISqrt32(left2 - dy2) : 0;
+  fix.yMM10 = y;
+  fix.located = true;
+}
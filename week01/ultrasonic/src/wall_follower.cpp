@@ -0,0 +1,61 @@
+#include "wall_follower.h"
+
+int16_t WallFollower::Clamp(int32_t effort) const
+{
+  if(effort > config.maxEffort) return config.maxEffort;
+  if(effort < -config.maxEffort) return -config.maxEffort;
+  return effort;
+}
+
+bool WallFollower::Update(uint32_t captureUS, uint32_t distanceMM10, int16_t& leftEffort, int16_t& rightEffort)
+{
+  //no echo: keep going as we were; CheckLost() stops us if it goes on too long
+  if(!distanceMM10) return false;
+
+  int32_t error = ((int32_t)distanceMM10 - (int32_t)config.targetMM10) / 10;
+  uint32_t dt = captureUS - lastCaptureUS;
+
+  //the integral and derivative only mean something over a short, known gap
+  int32_t derivative = 0;
+  if(running && dt <= config.maxGapUS)
+  {
+    integral += error * (int32_t)(dt / 1000);
+    if(integral > config.maxIntegral) integral = config.maxIntegral;
+    if(integral < -config.maxIntegral) integral = -config.maxIntegral;
+
+    //mm/s, with dt in 64 us steps so it stays in 32 bits
+    if(dt >> 6) derivative = (error - lastError) * 15625 / (int32_t)(dt >> 6);
+    if(derivative > 32767) derivative = 32767;
+    if(derivative < -32767) derivative = -32767;
+    lastDtUS = dt;
+  }
+  else
+  {
+    integral = 0;
+    lastDtUS = 0;
+  }
+
+  running = true;
+  lastCaptureUS = captureUS;
+  lastError = error;
+
+  //too far from the wall turns towards it
+  int32_t steer = ((int32_t)config.kp * error + (int32_t)config.ki * (integral / 1000)
+                  + (int32_t)config.kd * derivative) / 256;
+  if(!config.wallOnLeft) steer = -steer;
+
+  leftEffort = Clamp(config.forwardEffort - steer);
+  rightEffort = Clamp(config.forwardEffort + steer);
+  return true;
+}
+
+bool WallFollower::CheckLost(uint32_t nowUS, int16_t& leftEffort, int16_t& rightEffort)
+{
+  if(!running || nowUS - lastCaptureUS <= config.maxGapUS) return false;
+
+  running = false;
+  integral = 0;
+  leftEffort = 0;
+  rightEffort = 0;
+  return true;
+}
@@ -0,0 +1,26 @@
+#include "zone_alarm.h"
+#include <util/atomic.h>
+
+AlarmZone alarmZones[MAX_ALARM_ZONES];
+volatile uint8_t alarmZoneCount = 0;
+
+bool ZoneAlarmAdd(volatile uint8_t* port, uint8_t mask, uint16_t enterCounts, uint16_t exitCounts)
+{
+  if(alarmZoneCount >= MAX_ALARM_ZONES) return false;
+  if(exitCounts < enterCounts) exitCounts = enterCounts;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    AlarmZone& zone = alarmZones[alarmZoneCount];
+    zone.port = port;
+    zone.mask = mask;
+    zone.enterCounts = enterCounts;
+    zone.exitCounts = exitCounts;
+    zone.active = false;
+    *port &= ~mask;
+
+    alarmZoneCount++; //only now will the ISR look at it
+  }
+
+  return true;
+}
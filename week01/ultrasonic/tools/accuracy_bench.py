@@ -0,0 +1,213 @@
+#!/usr/bin/env python3
+"""
+Ground-truth accuracy benchmark: how well do the firmware's counts -> us -> mm conversions
+match known distances?
+
+Each labeled dataset is a CSV with the columns
+
+    echo_us,true_mm,temp_c,material
+
+one row per ping: the echo width to replay (0 for no echo), the true distance to the target,
+the air temperature, and what the target was made of. Each firmware build is run in simavr
+(see tools/sim/echo_replay.c) against each dataset, and every record it sends is matched
+with the row it came from. For each build and dataset we report:
+
+    bias     mean of (reported - true) distance, mm
+    rms      root-mean-square error, mm
+    p50/p90/p99  percentiles of the absolute error, mm
+    dropout  fraction of target pings with no usable reading (no record, or beyond MAX_MM)
+    rec/s, cpu%  from the simulator, so accuracy and speed can be compared side by side
+
+The standard suite is synthesized from the physics (speed of sound 331.3 + 0.606 T m/s) with
+a noise and dropout model per material; it is written to tools/datasets the first time it's
+needed. Recorded datasets in the same format can be added with --dataset.
+
+    tools/accuracy_bench.py
+    tools/accuracy_bench.py --builds '{"p8": ["-DSONAR_TIMER3_PRESCALER=8"]}' --dataset bench.csv
+"""
+
+import argparse
+import concurrent.futures
+import csv
+import json
+import math
+import os
+import random
+import sys
+
+import sweep_bench
+
+DATASET_DIR = os.path.join(sweep_bench.PROJECT, 'tools', 'datasets')
+
+# readings beyond this are what the HC-SR04 reports when it hears nothing
+MAX_MM = 4000
+
+# builds to compare: name -> extra build flags (on top of the sim environment)
+BUILDS = {
+    'default': [],
+    'legacy_print': ['-DSONAR_LEGACY_PRINT'],
+    'prescaler8': ['-DSONAR_TIMER3_PRESCALER=8'],
+    'prescaler256': ['-DSONAR_TIMER3_PRESCALER=256'],
+}
+
+# material -> (timing noise in us, base dropout probability, extra dropout per meter)
+MATERIALS = {
+    'wall': (2.0, 0.002, 0.002),
+    'cardboard': (3.0, 0.005, 0.01),
+    'fabric': (6.0, 0.02, 0.08),
+    'foam': (10.0, 0.05, 0.2),
+}
+
+# name -> (distances in mm, temperature in C, material)
+SUITE = {
+    'wall_20C': (range(50, 3501, 50), 20, 'wall'),
+    'wall_0C': (range(50, 3501, 50), 0, 'wall'),
+    'wall_35C': (range(50, 3501, 50), 35, 'wall'),
+    'near_field': (range(20, 301, 10), 20, 'wall'),
+    'cardboard_20C': (range(100, 3001, 100), 20, 'cardboard'),
+    'fabric_20C': (range(100, 3001, 100), 20, 'fabric'),
+    'foam_20C': (range(100, 2001, 100), 20, 'foam'),
+}
+
+PINGS_PER_DISTANCE = 20
+
+
+def speed_of_sound(temp_c):
+    return 331.3 + 0.606 * temp_c  # m/s, which is also mm/ms
+
+
+def synthesize(path, distances, temp_c, material, seed):
+    noise, dropout, dropout_per_m = MATERIALS[material]
+    rng = random.Random(seed)
+    mm_per_us = speed_of_sound(temp_c) / 1000.0
+
+    with open(path, 'w') as f:
+        f.write('echo_us,true_mm,temp_c,material\n')
+        for mm in distances:
+            for _ in range(PINGS_PER_DISTANCE):
+                if rng.random() < dropout + dropout_per_m * mm / 1000.0:
+                    us = 0
+                else:
+                    us = max(1.0, 2 * mm / mm_per_us + rng.gauss(0, noise))
+                f.write('%.1f,%d,%.1f,%s\n' % (us, mm, temp_c, material))
+
+
+def standard_suite():
+    os.makedirs(DATASET_DIR, exist_ok=True)
+    paths = []
+    for i, (name, (distances, temp_c, material)) in enumerate(sorted(SUITE.items())):
+        path = os.path.join(DATASET_DIR, name + '.csv')
+        if not os.path.exists(path):
+            synthesize(path, distances, temp_c, material, seed=i + 1)
+        paths.append(path)
+    return paths
+
+
+def load_truth(path):
+    with open(path) as f:
+        return [float(row['true_mm']) if row.get('true_mm') else None for row in csv.DictReader(f)]
+
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return float('nan')
+    return sorted_values[int(round(p * (len(sorted_values) - 1)))]
+
+
+def score(pairs_path, truth):
+    errors = []
+    pings = dropped = 0
+
+    with open(pairs_path) as f:
+        for line in f:
+            index, _, record = line.rstrip('\n').partition('\t')
+            true_mm = truth[int(index)]
+            if true_mm is None:
+                continue
+
+            pings += 1
+            fields = record.split('\t')
+            if len(fields) < 4 or float(fields[3]) > MAX_MM:
+                dropped += 1
+                continue
+            errors.append(float(fields[3]) - true_mm)
+
+    abs_errors = sorted(abs(e) for e in errors)
+    n = len(errors)
+    return {
+        'pings': pings,
+        'dropout': dropped / pings if pings else float('nan'),
+        'bias': sum(errors) / n if n else float('nan'),
+        'rms': math.sqrt(sum(e * e for e in errors) / n) if n else float('nan'),
+        'p50': percentile(abs_errors, 0.5),
+        'p90': percentile(abs_errors, 0.9),
+        'p99': percentile(abs_errors, 0.99),
+    }
+
+
+def run_one(name, elf, dataset, seconds):
+    out_dir = os.path.join(sweep_bench.PROJECT, '.pio', 'accuracy', name)
+    pairs = os.path.join(out_dir, os.path.basename(dataset) + '.pairs')
+    args = [sweep_bench.SIMULATOR, elf, dataset, '--pairs', pairs]
+
+    # run long enough to get through the whole dataset once
+    rows = len(load_truth(dataset))
+    args += ['--seconds', str(seconds or rows * 0.1 + 1)]
+
+    result = sweep_bench.subprocess.run(args, stdout=sweep_bench.subprocess.PIPE, text=True)
+    sim = json.loads(result.stdout.strip().splitlines()[-1])
+    stats = score(pairs, load_truth(dataset))
+    stats.update(records_per_s=sim['records_per_s'], cpu_load=sim['cpu_load'])
+    return name, os.path.splitext(os.path.basename(dataset))[0], stats
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('--builds', help='JSON object (or @file) of build name -> extra flags')
+    parser.add_argument('--dataset', action='append', default=[], help='additional labeled dataset (CSV)')
+    parser.add_argument('--no-suite', action='store_true', help="don't run the standard suite")
+    parser.add_argument('--seconds', type=float, help='simulated time per run (default: one pass)')
+    parser.add_argument('--env', default='sim', help='PlatformIO environment to build')
+    parser.add_argument('--jobs', type=int, default=os.cpu_count(), help='parallel jobs')
+    parser.add_argument('--csv', help='also write the results to this file')
+    args = parser.parse_args()
+
+    builds = BUILDS
+    if args.builds:
+        text = open(args.builds[1:]).read() if args.builds.startswith('@') else args.builds
+        builds = json.loads(text)
+
+    datasets = ([] if args.no_suite else standard_suite()) + args.dataset
+    sweep_bench.ensure_simulator()
+
+    # build serially (the first build installs the libraries), then simulate in parallel
+    elves = {}
+    for name, flags in sorted(builds.items()):
+        elves[name], _, _ = sweep_bench.build(name, flags, args.env, group='accuracy')
+        os.makedirs(os.path.join(sweep_bench.PROJECT, '.pio', 'accuracy', name), exist_ok=True)
+
+    results = []
+    with concurrent.futures.ThreadPoolExecutor(args.jobs) as pool:
+        futures = [pool.submit(run_one, name, elf, d, args.seconds) for name, elf in elves.items() for d in datasets]
+        for future in concurrent.futures.as_completed(futures):
+            results.append(future.result())
+
+    results.sort()
+    header = ['build', 'dataset', 'pings', 'dropout%', 'bias', 'rms', 'p50', 'p90', 'p99', 'rec/s', 'cpu%']
+    rows = [[b, d, s['pings'], '%.1f' % (100 * s['dropout']), '%.2f' % s['bias'], '%.2f' % s['rms'],
+             '%.2f' % s['p50'], '%.2f' % s['p90'], '%.2f' % s['p99'],
+             '%.1f' % s['records_per_s'], '%.2f' % (100 * s['cpu_load'])] for b, d, s in results]
+
+    widths = [max(len(str(x)) for x in col) for col in zip(header, *rows)]
+    for row in [header] + rows:
+        print('  '.join(str(x).rjust(w) for x, w in zip(row, widths)))
+
+    if args.csv:
+        with open(args.csv, 'w', newline='') as f:
+            writer = csv.writer(f)
+            writer.writerow(header)
+            writer.writerows(rows)
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+"""
+Compares three ways of timing the echo: a blocking pulseIn(), this project's ICP3 input
+capture, and a pin change interrupt (PCINT), each with and without background interrupt load.
+
+Each method is built for the simulator (tools/sim/echo_replay.c) and run against the same
+echo dataset as sweep_bench.py, pinging as fast as the echoes allow. The load is a timer 1
+ISR that spins for a while at a rate unrelated to the pings (SONAR_BENCH_LOAD; see
+include/bench_load.h), standing in for encoders, a servo, or a busy serial port.
+
+For each method and load we report:
+
+    rec/s     readings per second actually achieved
+    cpu_us    CPU time per reading, us: the CPU load above that of the same load with no pings
+              (measured with a build that never pings), divided by the reading rate
+    lat50/99  from the echo's falling edge to the end of its record, us
+    bias/rms  of the pulse width the firmware reports minus the true width, us
+
+pulseIn() spins for the whole echo, so its cost per reading is the echo itself, and it counts
+loop iterations, so interrupts that land during the echo make it read short. The PCINT ISR
+reads the timer when it gets to run, so it reads long by however long another ISR held it
+off. ICP3 latches the timer in hardware on the edge and is unaffected by either.
+
+    tools/capture_bench.py
+    tools/capture_bench.py --loads '{"none": null, "servo": [50, 1500]}' --prescaler 64
+
+Needs PlatformIO and the simulator, as for sweep_bench.py.
+"""
+
+import argparse
+import concurrent.futures
+import csv
+import json
+import os
+import sys
+
+import sweep_bench
+
+# method -> (build flags, simulator echo pin)
+METHODS = {
+    'idle': ([], ('C', 7)),    # never pings; the baseline for each load
+    'icp3': ([], ('C', 7)),
+    'pcint': (['-DSONAR_CAPTURE_PCINT'], ('B', 7)),
+    'pulsein': (['-DSONAR_CAPTURE_PULSEIN'], ('C', 7)),
+}
+
+# load -> [interrupts per second, us per interrupt], or null for none; rates are kept off
+# round numbers so the load drifts across the echoes
+LOADS = {
+    'none': None,
+    'light': [997, 25],
+    'heavy': [4999, 60],
+}
+
+# long enough that the idle builds never ping
+IDLE_INTERVAL = 1000000
+
+
+def load_flags(load):
+    if not load:
+        return []
+    hz, us = load
+    return ['-DSONAR_BENCH_LOAD=%d' % us, '-DSONAR_BENCH_LOAD_HZ=%d' % hz]
+
+
+def simulate(elf, dataset, seconds, echo_pin):
+    args = [sweep_bench.SIMULATOR, elf, dataset, '--seconds', str(seconds),
+            '--echo', echo_pin[0], str(echo_pin[1])]
+    result = sweep_bench.subprocess.run(args, stdout=sweep_bench.subprocess.PIPE, text=True)
+    return json.loads(result.stdout.strip().splitlines()[-1])
+
+
+def run_one(method, load_name, elf, args):
+    return method, load_name, simulate(elf, args.dataset, args.seconds, METHODS[method][1])
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    choices = [m for m in METHODS if m != 'idle']
+    parser.add_argument('--methods', default=','.join(choices), help='comma-separated subset of %s' %
+                        ', '.join(choices))
+    parser.add_argument('--loads', help='JSON object (or @file) of load name -> [hz, us] or null')
+    parser.add_argument('--prescaler', type=int, default=8, help='timer 3 prescaler (8 is 0.5 us per count)')
+    parser.add_argument('--interval', type=int, default=0, help='SONAR_PING_INTERVAL, ms (0: as fast as possible)')
+    parser.add_argument('--dataset', help='echo dataset (CSV, first column is echo width in us)')
+    parser.add_argument('--seconds', type=float, default=20, help='simulated time per run')
+    parser.add_argument('--env', default='sim', help='PlatformIO environment to build')
+    parser.add_argument('--jobs', type=int, default=os.cpu_count(), help='parallel jobs')
+    parser.add_argument('--csv', help='also write the results to this file')
+    args = parser.parse_args()
+
+    loads = LOADS
+    if args.loads:
+        text = open(args.loads[1:]).read() if args.loads.startswith('@') else args.loads
+        loads = json.loads(text)
+
+    methods = [m for m in args.methods.split(',') if m]
+    for m in methods:
+        if m not in METHODS or m == 'idle':
+            parser.error('unknown method %s' % m)
+
+    if not args.dataset:
+        args.dataset = os.path.join(sweep_bench.SIM_DIR, 'synthetic_echoes.csv')
+        if not os.path.exists(args.dataset):
+            sweep_bench.make_dataset(args.dataset)
+
+    sweep_bench.ensure_simulator()
+
+    # build serially (the first build installs the libraries), then simulate in parallel
+    base = ['-DSONAR_SIM', '-DSONAR_TIMER3_PRESCALER=%d' % args.prescaler]
+    elves = {}
+    for load_name, load in sorted(loads.items()):
+        for method in methods:
+            name = '%s-%s' % (method, load_name)
+            flags = base + METHODS[method][0] + load_flags(load) + ['-DSONAR_PING_INTERVAL=%d' % args.interval]
+            elves[(method, load_name)], _, _ = sweep_bench.build(name, flags, args.env, group='capture')
+
+        name = 'idle-%s' % load_name
+        flags = base + load_flags(load) + ['-DSONAR_PING_INTERVAL=%d' % IDLE_INTERVAL]
+        elves[('idle', load_name)], _, _ = sweep_bench.build(name, flags, args.env, group='capture')
+
+    results = []
+    idle = {}
+    with concurrent.futures.ThreadPoolExecutor(args.jobs) as pool:
+        futures = [pool.submit(run_one, m, l, elf, args) for (m, l), elf in elves.items()]
+        for future in concurrent.futures.as_completed(futures):
+            method, load_name, stats = future.result()
+            if method == 'idle':
+                idle[load_name] = stats['cpu_load']
+            else:
+                results.append((method, load_name, stats))
+
+    for _, load_name, stats in results:
+        stats['idle_load'] = idle[load_name]
+
+    def cpu_us(s):
+        rate = s['records_per_s']
+        return (s['cpu_load'] - s['idle_load']) * 1e6 / rate if rate else float('nan')
+
+    results.sort(key=lambda r: (sorted(loads).index(r[1]), methods.index(r[0])))
+    header = ['method', 'load', 'load_cpu%', 'rec/s', 'cpu_us', 'lat50', 'lat99', 'bias_us', 'rms_us']
+    rows = [[m, l, '%.1f' % (100 * s['idle_load']), '%.1f' % s['records_per_s'], '%.0f' % cpu_us(s),
+             '%.0f' % s['latency_us']['p50'], '%.0f' % s['latency_us']['p99'],
+             '%.2f' % s['error_us']['mean'], '%.2f' % s['error_us']['rms']] for m, l, s in results]
+
+    widths = [max(len(str(x)) for x in col) for col in zip(header, *rows)]
+    for row in [header] + rows:
+        print('  '.join(str(x).rjust(w) for x, w in zip(row, widths)))
+
+    if args.csv:
+        with open(args.csv, 'w', newline='') as f:
+            writer = csv.writer(f)
+            writer.writerow(header)
+            writer.writerows(rows)
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,294 @@
+#!/usr/bin/env python3
+"""
+CPU, serial, and echo-time budget for a configuration: can N sensors pinging at R Hz each,
+with a given output format, run on the 32U4 without overloading it?
+
+Three resources are checked, each against a limit (a fraction of the whole):
+
+    cpu     cycles per second spent in ISRs, in loop() per ping, and formatting and sending
+            records, plus a fixed background load (timer 0 for millis(), USB frames)
+    serial  bytes per second of records against what the link can carry
+    echo    time the capture (ICP3) is busy listening: one echo at a time, each up to
+            the echo timeout, so N * R * timeout must fit in a second
+
+The CPU limit defaults to 70%, not 100%: the capture ISR's latency (and so the range
+jitter) grows as loop() gets busier, and USB needs time to service the host.
+
+Costs come from the COSTS table below. The defaults are estimates; replace them with
+measurements from the benchmark harness:
+
+    --bench-log FILE   a capture of a -DSONAR_BENCH_OUTPUT build's startup output; its
+                       "cycles/record" line sets the formatting cost for --format
+    --measure          builds the sim environment at two ping rates, runs both in simavr
+                       (see sweep_bench.py), and fits the background load and the all-in
+                       cost per ping from the CPU loads. Note that the simulator sends on
+                       the UART, so this measures the UART's per-byte cost, not USB's.
+    --costs FILE       JSON overriding entries of COSTS (e.g., saved with --save-costs)
+    --set KEY=VALUE    overrides one entry
+
+Sensors and rates can be lists, to get a table:
+
+    tools/cpu_budget.py --sensors 3 --rate 20
+    tools/cpu_budget.py --sensors 1,2,3,4 --rate 5,10,20 --format legacy
+    tools/cpu_budget.py --measure --save-costs costs.json
+
+The exit status is 1 if any configuration is over a limit.
+"""
+
+import argparse
+import json
+import os
+import sys
+
+F_CPU = 16000000
+
+# cycles, unless noted; defaults are estimates, see above
+COSTS = {
+    'background_load': 0.012,   # fraction of the CPU: timer 0 (~1 kHz) and USB start-of-frame
+    'capture_isr': 90,          # TIMER3_CAPT, twice per ping (rising and falling edge)
+    'ping_timer_isr': 60,       # TIMER3_COMPA, once per ping with --timed
+    'trig_end_isr': 40,         # TIMER3_COMPB, ends the TRIG pulse, once per ping with --timed
+    'ping_loop': 1600,          # loop() per ping: the TRIG pulse (10 us), units conversion
+    'record_raw': 1500,         # formatting one record (RecordWriter)
+    'record_legacy': 6000,      # formatting one record (Serial.print, -DSONAR_LEGACY_PRINT)
+    'record_on_change': 1600,   # as raw, plus the deadband test
+    'record_decimate': 2200,    # one window record (six fields)
+    'record_scan': 1300,        # one sweep point
+    'write_call': 1500,         # one write() to the serial port (USB: select endpoint, etc.)
+    'write_byte': 25,           # each byte written
+    'ping_measured': None,      # all-in cycles per ping from --measure; replaces the above
+    'measured_format': None,    # the output format ping_measured was measured with
+}
+
+# output format -> (records per ping, bytes per record); see SendRecord() and friends
+FORMATS = {
+    'raw': (1.0, 27),           # "12345678\t2900\t11600\t1989.4\n"
+    'legacy': (1.0, 28),        # same fields, distance with two decimals
+    'on_change': (1.0, 27),     # worst case; see --change-fraction
+    'decimate': (0.0, 36),      # one per sensor per window; see --window
+    'scan': (1.0, 20),          # "12345678\t90\t1989.4\n"
+}
+
+# bytes per second the link can carry
+LINKS = {
+    'usb': 40000,               # USB CDC with a host polling every frame; measure your own
+    'uart': 115200 / 10,        # 115200 baud, 8N1 (the sim environment)
+}
+
+ECHO_TIMEOUT_US = 40000         # see ECHO_TIMEOUT_US in hc-sr04.cpp
+
+
+def parse_list(text, kind):
+    values = []
+    for part in text.split(','):
+        if '-' in part and kind is int:
+            low, high = part.split('-')
+            values += range(int(low), int(high) + 1)
+        else:
+            values.append(kind(part))
+    return values
+
+
+def records_per_second(fmt, sensors, rate, args):
+    per_ping, _ = FORMATS[fmt]
+    if fmt == 'decimate':
+        return sensors * 1000.0 / args.window
+    if fmt == 'on_change':
+        per_ping = args.change_fraction
+    return sensors * rate * per_ping
+
+
+def cpu_breakdown(costs, fmt, sensors, rate, args):
+    """Returns [(item, fraction of the CPU)] for one configuration."""
+    pings = sensors * rate
+    records = records_per_second(fmt, sensors, rate, args)
+    _, size = FORMATS[fmt]
+
+    items = [('background', costs['background_load'])]
+    if costs['ping_measured'] is not None and costs['measured_format'] == fmt:
+        items.append(('per ping (measured)', pings * costs['ping_measured'] / F_CPU))
+        return items
+
+    # blanking happens in the capture ISR, and loop() polls for the echo timeout
+    isr = 2 * costs['capture_isr']
+    if args.timed:
+        isr += costs['ping_timer_isr'] + costs['trig_end_isr']
+    items += [
+        ('ISRs', pings * isr / F_CPU),
+        ('loop per ping', pings * costs['ping_loop'] / F_CPU),
+        ('formatting', records * costs['record_' + fmt] / F_CPU),
+        ('writing', records * (costs['write_call'] + size * costs['write_byte']) / F_CPU),
+    ]
+    return items
+
+
+def budget(costs, fmt, sensors, rate, args):
+    """Returns {resource: fraction used} for one configuration."""
+    _, size = FORMATS[fmt]
+    return {
+        'cpu': sum(x for _, x in cpu_breakdown(costs, fmt, sensors, rate, args)),
+        'serial': records_per_second(fmt, sensors, rate, args) * size / args.link_bps,
+        'echo': sensors * rate * args.timeout_us / 1e6,
+    }
+
+
+def fits(costs, fmt, sensors, rate, args):
+    used = budget(costs, fmt, sensors, rate, args)
+    return all(used[r] <= limit for r, limit in limits(args).items())
+
+
+def limits(args):
+    return {'cpu': args.cpu_limit, 'serial': args.serial_limit, 'echo': 1.0}
+
+
+def max_rate(costs, fmt, sensors, args):
+    """The highest rate (Hz, to 0.1) at which sensors still fit, by bisection."""
+    low, high = 0.0, 1000.0
+    while high - low > 0.05:
+        mid = (low + high) / 2
+        if fits(costs, fmt, sensors, mid, args):
+            low = mid
+        else:
+            high = mid
+    return low
+
+
+def max_sensors(costs, fmt, rate, args):
+    n = 0
+    while n < 64 and fits(costs, fmt, n + 1, rate, args):
+        n += 1
+    return n
+
+
+def bench_log_cycles(path):
+    """The "cycles/record = N" figure from a SONAR_BENCH_OUTPUT capture."""
+    with open(path, errors='replace') as f:
+        for line in f:
+            if line.startswith('cycles/record'):
+                return int(line.split('=')[1])
+    raise ValueError('no "cycles/record" line in %s' % path)
+
+
+def measure(fmt, args):
+    """
+    Runs the sim build at two ping intervals and fits load = background + pings/s * cost.
+    Returns (background load, cycles per ping).
+    """
+    import sweep_bench
+
+    if fmt == 'scan':
+        raise ValueError("--measure doesn't support the scan format (it needs the servo)")
+
+    dataset = os.path.join(sweep_bench.SIM_DIR, 'synthetic_echoes.csv')
+    if not os.path.exists(dataset):
+        sweep_bench.make_dataset(dataset)
+    sweep_bench.ensure_simulator()
+
+    points = []
+    for interval in args.measure_intervals:
+        config = {'prescaler': 64, 'interval': interval, 'blanking': 90,
+                  'scheduler': 'timed' if args.timed else 'loop', 'output': fmt}
+        elf, _, _ = sweep_bench.build(sweep_bench.config_name(config),
+                                      sweep_bench.build_flags(config), 'sim', group='budget')
+        stats = sweep_bench.simulate(config, elf, dataset, args.seconds)
+        points.append((stats['pings'] / stats['seconds'], stats['cpu_load']))
+        print('measured %s at %d ms: %.1f pings/s, load %.2f%%' %
+              (fmt, interval, points[-1][0], 100 * points[-1][1]), file=sys.stderr)
+
+    (r1, l1), (r2, l2) = points
+    per_ping = (l1 - l2) * F_CPU / (r1 - r2)
+    return l1 - r1 * per_ping / F_CPU, per_ping
+
+
+def print_table(header, rows):
+    widths = [max(len(str(x)) for x in col) for col in zip(header, *rows)]
+    for row in [header] + rows:
+        print('  '.join(str(x).rjust(w) for x, w in zip(row, widths)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('--sensors', default='1', help='number of sensors (list or range, e.g. 1-4)')
+    parser.add_argument('--rate', default='10', help='pings per second per sensor (list)')
+    parser.add_argument('--format', default='raw', choices=sorted(FORMATS), help='output format')
+    parser.add_argument('--timed', action='store_true', help='pings from the timer (SONAR_TIMED_PINGS)')
+    parser.add_argument('--link', default='usb', choices=sorted(LINKS), help='serial link')
+    parser.add_argument('--link-bps', type=float, help='bytes per second the link carries (overrides --link)')
+    parser.add_argument('--window', type=float, default=1000, help='decimation window, ms')
+    parser.add_argument('--change-fraction', type=float, default=1.0,
+                        help='fraction of pings that produce a record with on_change')
+    parser.add_argument('--timeout-us', type=float, default=ECHO_TIMEOUT_US,
+                        help='longest time the capture waits for one echo')
+    parser.add_argument('--cpu-limit', type=float, default=0.7, help='CPU budget (fraction)')
+    parser.add_argument('--serial-limit', type=float, default=0.8, help='serial budget (fraction)')
+    parser.add_argument('--costs', help='JSON file overriding entries of COSTS')
+    parser.add_argument('--set', action='append', default=[], metavar='KEY=VALUE', help='override one cost')
+    parser.add_argument('--bench-log', help='startup output of a SONAR_BENCH_OUTPUT build')
+    parser.add_argument('--measure', action='store_true', help='measure costs in simavr first')
+    parser.add_argument('--measure-intervals', default='20,100', help='ping intervals (ms) for --measure')
+    parser.add_argument('--seconds', type=float, default=10, help='simulated time per --measure run')
+    parser.add_argument('--save-costs', help='write the costs used to this JSON file')
+    args = parser.parse_args()
+
+    costs = dict(COSTS)
+    if args.costs:
+        with open(args.costs) as f:
+            costs.update(json.load(f))
+    for item in args.set:
+        key, value = item.split('=', 1)
+        if key not in COSTS:
+            parser.error('unknown cost %s' % key)
+        costs[key] = float(value)
+
+    if args.bench_log:
+        costs['record_' + args.format] = bench_log_cycles(args.bench_log)
+    if args.measure:
+        args.measure_intervals = parse_list(args.measure_intervals, int)
+        if len(args.measure_intervals) != 2:
+            parser.error('--measure-intervals needs two intervals')
+        costs['background_load'], costs['ping_measured'] = measure(args.format, args)
+        costs['measured_format'] = args.format
+    if args.save_costs:
+        with open(args.save_costs, 'w') as f:
+            json.dump(costs, f, indent=2)
+
+    if args.link_bps is None:
+        args.link_bps = LINKS[args.link]
+
+    sensor_counts = parse_list(args.sensors, int)
+    rates = parse_list(args.rate, float)
+    caps = limits(args)
+
+    header = ['sensors', 'rate', 'cpu%', 'serial%', 'echo%', 'headroom%', 'max_rate', 'status']
+    rows = []
+    overloaded = False
+    for n in sensor_counts:
+        for rate in rates:
+            used = budget(costs, args.format, n, rate, args)
+            headroom = min(caps[r] - used[r] for r in caps)
+            worst = min(caps, key=lambda r: caps[r] - used[r])
+            ok = headroom >= 0
+            overloaded |= not ok
+            rows.append([n, '%g' % rate, '%.1f' % (100 * used['cpu']), '%.1f' % (100 * used['serial']),
+                         '%.1f' % (100 * used['echo']), '%.1f' % (100 * headroom),
+                         '%.1f' % max_rate(costs, args.format, n, args),
+                         'ok' if ok else 'over (%s)' % worst])
+
+    print('format %s, %s link (%.0f B/s), limits: cpu %.0f%%, serial %.0f%%' %
+          (args.format, args.link, args.link_bps, 100 * args.cpu_limit, 100 * args.serial_limit))
+    print_table(header, rows)
+
+    # a single configuration also gets where its cycles go
+    if len(rows) == 1:
+        n, rate = sensor_counts[0], rates[0]
+        print()
+        print_table(['cpu', '%'], [[item, '%.2f' % (100 * x)] for item, x in
+                                   cpu_breakdown(costs, args.format, n, rate, args)])
+        print()
+        print('at %g Hz, at most %d sensors fit' % (rate, max_sensors(costs, args.format, rate, args)))
+
+    return 1 if overloaded else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
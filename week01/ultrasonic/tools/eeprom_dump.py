@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+"""
+Decodes the EEPROM log (-DSONAR_EEPROM_LOG) into CSV: boot,seq,ms,mm.
+
+The firmware sends the log as "#eeblk" lines of hex when a host connects; everything else
+in the input is ignored, so a whole capture of the serial output can be fed in:
+
+    tools/eeprom_dump.py capture.txt > log.csv
+    cat /dev/ttyACM0 | tools/eeprom_dump.py
+
+Blocks are sent again after a reset (the firmware can't tell whether they were received),
+so repeated blocks are only decoded once. A distance of 0 means there was no echo.
+"""
+
+import argparse
+import sys
+
+BLOCK = 32
+HEADER = 8
+NO_SEQ = 0xFF
+
+
+def varint(data, i):
+    value = shift = 0
+    while i < len(data):
+        b = data[i]
+        i += 1
+        value |= (b & 0x7F) << shift
+        shift += 7
+        if not b & 0x80:
+            return value, i
+    return None, i
+
+
+def decode_block(data):
+    """Returns (seq, boot, [(ms, mm), ...]) for one block, or None if it's blank."""
+    if len(data) != BLOCK or data[0] == NO_SEQ:
+        return None
+
+    seq, boot = data[0], data[1]
+    ms = int.from_bytes(data[2:6], 'little')
+    mm = int.from_bytes(data[6:8], 'little')
+    readings = [(ms, mm)]
+
+    # the unused tail of a block is 0xFF, which reads as a varint that never ends
+    i = HEADER
+    while i < BLOCK:
+        dt, i = varint(data, i)
+        dd, i = varint(data, i)
+        if dt is None or dd is None:
+            break
+        ms = (ms + dt) & 0xFFFFFFFF
+        mm = (mm + ((dd >> 1) ^ -(dd & 1))) & 0xFFFF
+        readings.append((ms, mm))
+
+    return seq, boot, readings
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('input', nargs='?', help='captured serial output (default: stdin)')
+    args = parser.parse_args()
+
+    source = open(args.input, errors='replace') if args.input else sys.stdin
+    seen = set()
+    print('boot,seq,ms,mm')
+
+    for line in source:
+        fields = line.rstrip('\r\n').split('\t')
+        if fields[0] == '#eeend':
+            print('# %s blocks' % fields[1], file=sys.stderr)
+            continue
+        if fields[0] != '#eeblk' or len(fields) < 2:
+            continue
+
+        try:
+            data = bytes.fromhex(fields[1])
+        except ValueError:
+            continue
+
+        block = decode_block(data)
+        if not block or data in seen:
+            continue
+        seen.add(data)
+
+        seq, boot, readings = block
+        for ms, mm in readings:
+            print('%d,%d,%d,%d' % (boot, seq, ms, mm))
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,322 @@
+/*
+ * Runs a SONAR_SIM build of the firmware in simavr and plays back recorded echoes.
+ *
+ * Every time the firmware finishes a TRIG pulse, we answer on the echo pin (pin 13, PC7,
+ * which is also ICP3) with the next pulse width from the dataset, after the usual ~450 us
+ * the HC-SR04 takes to send its burst. A width of 0 means no echo, which the sensor reports
+ * as a 38 ms pulse.
+ *
+ * While it runs, we keep track of:
+ *   - CPU load: the firmware sleeps when it has nothing to do (see SONAR_SIM), so the load 
+ *     is the fraction of cycles spent awake
+ *   - latency: from the falling edge of each echo to the end of the record it produced
+ *   - error: the pulse length the firmware reports (third field) minus the true width
+ * Latency and error only make sense when every echo produces one raw record, so they're
+ * skipped with --no-match (e.g., for report-on-change or decimated builds).
+ *
+ * The summary is written to stdout as one line of JSON; the firmware output can be saved 
+ * with --log. With --pairs, each matched record is also written along with the dataset row
+ * (counting from 0, not including the header) of the echo it came from; a ping that didn't 
+ * produce a record is written with an empty record.
+ *
+ * Usage: echo_replay firmware.elf dataset.csv [--seconds S] [--log file] [--pairs file] 
+ *                    [--no-match] [--trig PORT BIT] [--echo PORT BIT]
+ *
+ * Build (needs simavr 1.6 or later, for the timers' input capture IRQ, and libelf):
+ *   cc -O2 -o echo_replay echo_replay.c -lsimavr -lelf
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_irq.h>
+#include <simavr/sim_time.h>
+#include <simavr/avr_ioport.h>
+#include <simavr/avr_uart.h>
+#include <simavr/avr_timer.h>
+
+#define ECHO_DELAY_US 450
+#define NO_ECHO_US 38000
+
+typedef struct
+{
+  avr_t* avr;
+  avr_irq_t* echo;
+  avr_irq_t* icp;
+
+  double* widths;
+  size_t count;
+  size_t next;
+
+  int echoActive;
+  double echoWidth;
+  size_t echoIndex;
+  avr_cycle_count_t trigRise;
+
+  //the most recent echo that hasn't been matched to a record yet
+  int fallPending;
+  avr_cycle_count_t fallCycle;
+  double fallWidth;
+  size_t fallIndex;
+
+  int match;
+  FILE* log;
+  FILE* pairs;
+  char line[256];
+  size_t lineLength;
+
+  unsigned long pings;
+  unsigned long records;
+
+  double* latencies;
+  double* errors;
+  size_t matched;
+  size_t capacity;
+} Sim;
+
+static double* LoadWidths(const char* path, size_t* count)
+{
+  FILE* f = fopen(path, "r");
+  if(!f) return NULL;
+
+  size_t capacity = 1024, n = 0;
+  double* widths = malloc(capacity * sizeof(double));
+  char line[256];
+
+  while(fgets(line, sizeof(line), f))
+  {
+    //skip the header and comments; the echo width is always the first column
+    char* end;
+    double w = strtod(line, &end);
+    if(end == line) continue;
+
+    if(n == capacity) widths = realloc(widths, (capacity *= 2) * sizeof(double));
+    widths[n++] = w;
+  }
+
+  fclose(f);
+  *count = n;
+  return widths;
+}
+
+static void SetEcho(Sim* sim, int level)
+{
+  avr_raise_irq(sim->echo, level);
+  if(sim->icp) avr_raise_irq(sim->icp, level);
+}
+
+static avr_cycle_count_t EchoFall(avr_t* avr, avr_cycle_count_t when, void* param)
+{
+  Sim* sim = param;
+  SetEcho(sim, 0);
+
+  sim->echoActive = 0;
+  sim->fallPending = 1;
+  sim->fallCycle = when;
+  sim->fallWidth = sim->echoWidth;
+  sim->fallIndex = sim->echoIndex;
+  return 0;
+}
+
+static avr_cycle_count_t EchoRise(avr_t* avr, avr_cycle_count_t when, void* param)
+{
+  Sim* sim = param;
+  SetEcho(sim, 1);
+  avr_cycle_timer_register_usec(avr, (uint32_t)sim->echoWidth, EchoFall, sim);
+  return 0;
+}
+
+static void TrigChanged(struct avr_irq_t* irq, uint32_t value, void* param)
+{
+  Sim* sim = param;
+
+  if(value)
+  {
+    sim->trigRise = sim->avr->cycle;
+    return;
+  }
+
+  //the sensor fires on the falling edge of TRIG, and ignores it while it's busy
+  if(sim->echoActive) return;
+  if(avr_cycles_to_usec(sim->avr, sim->avr->cycle - sim->trigRise) < 10) return;
+
+  //the last echo never produced a record
+  if(sim->fallPending && sim->pairs) fprintf(sim->pairs, "%zu\t\n", sim->fallIndex);
+  sim->fallPending = 0;
+
+  double w = sim->widths[sim->next];
+  sim->echoIndex = sim->next;
+  sim->next = (sim->next + 1) % sim->count;
+
+  sim->echoActive = 1;
+  sim->echoWidth = w > 0 ? w : NO_ECHO_US;
+  sim->pings++;
+  avr_cycle_timer_register_usec(sim->avr, ECHO_DELAY_US, EchoRise, sim);
+}
+
+static void Record(Sim* sim, const char* line)
+{
+  sim->records++;
+  if(!sim->match || !sim->fallPending) return;
+
+  //the third field is the pulse length in us
+  unsigned long timestamp, counts, us;
+  if(sscanf(line, "%lu\t%lu\t%lu", &timestamp, &counts, &us) != 3) return;
+
+  if(sim->matched == sim->capacity)
+  {
+    sim->capacity = sim->capacity ? 2 * sim->capacity : 1024;
+    sim->latencies = realloc(sim->latencies, sim->capacity * sizeof(double));
+    sim->errors = realloc(sim->errors, sim->capacity * sizeof(double));
+  }
+
+  sim->latencies[sim->matched] = avr_cycles_to_usec(sim->avr, sim->avr->cycle - sim->fallCycle);
+  sim->errors[sim->matched] = (double)us - sim->fallWidth;
+  sim->matched++;
+  sim->fallPending = 0;
+
+  if(sim->pairs) fprintf(sim->pairs, "%zu\t%s\n", sim->fallIndex, line);
+}
+
+static void UartOutput(struct avr_irq_t* irq, uint32_t value, void* param)
+{
+  Sim* sim = param;
+  char c = (char)value;
+
+  if(sim->log) fputc(c, sim->log);
+
+  if(c != '\n')
+  {
+    if(sim->lineLength < sizeof(sim->line) - 1) sim->line[sim->lineLength++] = c;
+    return;
+  }
+
+  sim->line[sim->lineLength] = 0;
+  sim->lineLength = 0;
+
+  //records start with a digit; everything else is a status or metadata line
+  if(sim->line[0] >= '0' && sim->line[0] <= '9') Record(sim, sim->line);
+}
+
+static int CompareDoubles(const void* a, const void* b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+static double Percentile(const double* sorted, size_t n, double p)
+{
+  if(!n) return 0;
+  size_t i = (size_t)(p * (n - 1) + 0.5);
+  return sorted[i];
+}
+
+int main(int argc, char* argv[])
+{
+  if(argc < 3)
+  {
+    fprintf(stderr, "usage: %s firmware.elf dataset.csv [--seconds S] [--log file] [--pairs file] [--no-match] "
+                    "[--trig PORT BIT] [--echo PORT BIT]\n", argv[0]);
+    return 2;
+  }
+
+  Sim sim;
+  memset(&sim, 0, sizeof(sim));
+  sim.match = 1;
+
+  double seconds = 10;
+  char trigPort = 'B', echoPort = 'C';
+  int trigBit = 3, echoBit = 7; //pins 14 and 13
+
+  for(int i = 3; i < argc; i++)
+  {
+    if(!strcmp(argv[i], "--seconds") && i + 1 < argc) seconds = atof(argv[++i]);
+    else if(!strcmp(argv[i], "--log") && i + 1 < argc) sim.log = fopen(argv[++i], "w");
+    else if(!strcmp(argv[i], "--pairs") && i + 1 < argc) sim.pairs = fopen(argv[++i], "w");
+    else if(!strcmp(argv[i], "--no-match")) sim.match = 0;
+    else if(!strcmp(argv[i], "--trig") && i + 2 < argc) {trigPort = argv[++i][0]; trigBit = atoi(argv[++i]);}
+    else if(!strcmp(argv[i], "--echo") && i + 2 < argc) {echoPort = argv[++i][0]; echoBit = atoi(argv[++i]);}
+  }
+
+  sim.widths = LoadWidths(argv[2], &sim.count);
+  if(!sim.widths || !sim.count)
+  {
+    fprintf(stderr, "no echo widths in %s\n", argv[2]);
+    return 1;
+  }
+
+  elf_firmware_t firmware;
+  memset(&firmware, 0, sizeof(firmware));
+  if(elf_read_firmware(argv[1], &firmware))
+  {
+    fprintf(stderr, "can't read %s\n", argv[1]);
+    return 1;
+  }
+
+  sim.avr = avr_make_mcu_by_name("atmega32u4");
+  if(!sim.avr) return 1;
+  avr_init(sim.avr);
+  avr_load_firmware(sim.avr, &firmware);
+  if(!sim.avr->frequency) sim.avr->frequency = 16000000;
+
+  avr_irq_register_notify(avr_io_getirq(sim.avr, AVR_IOCTL_IOPORT_GETIRQ(trigPort), trigBit), 
+                          TrigChanged, &sim);
+  sim.echo = avr_io_getirq(sim.avr, AVR_IOCTL_IOPORT_GETIRQ(echoPort), echoBit);
+  //TIMER_IRQ_IN_ICP is an enum constant, not a macro, so it can't be tested with #ifdef
+  if(echoPort == 'C' && echoBit == 7)
+    sim.icp = avr_io_getirq(sim.avr, AVR_IOCTL_TIMER_GETIRQ('3'), TIMER_IRQ_IN_ICP);
+
+  //take the UART output ourselves instead of letting simavr print it
+  uint32_t flags = 0;
+  avr_ioctl(sim.avr, AVR_IOCTL_UART_GET_FLAGS('1'), &flags);
+  flags &= ~AVR_UART_FLAG_STDIO;
+  avr_ioctl(sim.avr, AVR_IOCTL_UART_SET_FLAGS('1'), &flags);
+  avr_irq_register_notify(avr_io_getirq(sim.avr, AVR_IOCTL_UART_GETIRQ('1'), UART_IRQ_OUTPUT), 
+                          UartOutput, &sim);
+
+  avr_cycle_count_t end = avr_usec_to_cycles(sim.avr, (uint64_t)(seconds * 1e6));
+  avr_cycle_count_t asleep = 0;
+  int state = cpu_Running;
+
+  while(sim.avr->cycle < end && state != cpu_Done && state != cpu_Crashed)
+  {
+    int wasAsleep = sim.avr->state == cpu_Sleeping;
+    avr_cycle_count_t before = sim.avr->cycle;
+    state = avr_run(sim.avr);
+    if(wasAsleep) asleep += sim.avr->cycle - before;
+  }
+
+  double elapsed = (double)sim.avr->cycle / sim.avr->frequency;
+
+  double meanError = 0, rmsError = 0;
+  for(size_t i = 0; i < sim.matched; i++)
+  {
+    meanError += sim.errors[i];
+    rmsError += sim.errors[i] * sim.errors[i];
+  }
+  if(sim.matched)
+  {
+    meanError /= sim.matched;
+    rmsError = sqrt(rmsError / sim.matched);
+  }
+
+  qsort(sim.latencies, sim.matched, sizeof(double), CompareDoubles);
+
+  printf("{\"state\": %d, \"seconds\": %.3f, \"pings\": %lu, \"records\": %lu, "
+         "\"records_per_s\": %.2f, \"cpu_load\": %.4f, \"matched\": %zu, "
+         "\"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}, "
+         "\"error_us\": {\"mean\": %.2f, \"rms\": %.2f}}\n",
+         state, elapsed, sim.pings, sim.records, sim.records / elapsed,
+         elapsed > 0 ? 1.0 - (double)asleep / sim.avr->cycle : 0, sim.matched,
+         Percentile(sim.latencies, sim.matched, 0.5), Percentile(sim.latencies, sim.matched, 0.9),
+         Percentile(sim.latencies, sim.matched, 0.99), 
+         sim.matched ? sim.latencies[sim.matched - 1] : 0, meanError, rmsError);
+
+  if(sim.log) fclose(sim.log);
+  if(sim.pairs) fclose(sim.pairs);
+  return state == cpu_Crashed ? 1 : 0;
+}
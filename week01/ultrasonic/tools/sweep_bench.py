@@ -0,0 +1,236 @@
+#!/usr/bin/env python3
+"""
+Builds the firmware for every combination in a matrix of configurations, runs each build
+in simavr against the same echo dataset, and tabulates the results.
+
+Builds and simulations both run in parallel (one job per host core by default). Each
+configuration gets its own build directory under .pio/sweep, so builds don't trample on
+each other and unchanged configurations are only rebuilt incrementally.
+
+The matrix is a JSON object mapping a parameter to the list of values to try; see
+MATRIX below for the parameters and the default. For example:
+
+    tools/sweep_bench.py --matrix '{"prescaler": [8, 64], "interval": [20, 50]}'
+
+Needs PlatformIO (pio) and the simulator (tools/sim/echo_replay.c, which this script
+compiles if it isn't there yet; it needs simavr and libelf).
+"""
+
+import argparse
+import concurrent.futures
+import csv
+import itertools
+import json
+import os
+import random
+import shutil
+import subprocess
+import sys
+
+PROJECT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+SIM_DIR = os.path.join(PROJECT, 'tools', 'sim')
+SIMULATOR = os.path.join(SIM_DIR, 'echo_replay')
+
+F_CPU = 16000000
+
+# parameter -> values to try
+MATRIX = {
+    'prescaler': [8, 64],                            # SONAR_TIMER3_PRESCALER
+    'interval': [20, 50, 100],                       # SONAR_PING_INTERVAL, ms
+    'blanking': [90],                                # SONAR_BLANKING_US
+    'scheduler': ['loop', 'timed'],                  # SONAR_TIMED_PINGS
+    'output': ['raw', 'legacy', 'on_change', 'decimate'],
+}
+
+OUTPUT_FLAGS = {
+    'raw': [],
+    'legacy': ['-DSONAR_LEGACY_PRINT'],
+    'on_change': ['-DSONAR_REPORT_ON_CHANGE'],
+    'decimate': ['-DSONAR_DECIMATE'],
+}
+
+# only these output modes give one record per echo, so latency and error can be matched
+MATCHED_OUTPUTS = {'raw', 'legacy'}
+
+
+def build_flags(config):
+    flags = ['-DSONAR_SIM',
+             '-DSONAR_TIMER3_PRESCALER=%d' % config['prescaler'],
+             '-DSONAR_PING_INTERVAL=%d' % config['interval'],
+             '-DSONAR_BLANKING_US=%d' % config['blanking']]
+    if config['scheduler'] == 'timed':
+        flags.append('-DSONAR_TIMED_PINGS')
+    flags += OUTPUT_FLAGS[config['output']]
+    flags += config.get('extra_flags', [])
+    return flags
+
+
+def config_name(config):
+    return '-'.join('%s%s' % (k[0], config[k]) for k in sorted(MATRIX) if k in config)
+
+
+def feasible(config):
+    """
+    The timed scheduler's period is a 16-bit compare on timer 3, so with a small prescaler
+    it can't reach a long interval (e.g., 50 ms at prescaler 8); the firmware won't build.
+    """
+    if config['scheduler'] != 'timed':
+        return True
+    return config['interval'] * (F_CPU // 1000) // config['prescaler'] <= 0xFFFF
+
+
+def expand(matrix):
+    keys = sorted(matrix)
+    for values in itertools.product(*(matrix[k] for k in keys)):
+        config = dict(zip(keys, values))
+        if feasible(config):
+            yield config
+        else:
+            print('skipping %s: the interval is too long for the timer at this prescaler' %
+                  config_name(config), file=sys.stderr)
+
+
+def make_dataset(path, count=2000, seed=1):
+    """
+    Writes a synthetic dataset: a target moving back and forth between 10 cm and 3 m with
+    a little timing noise and the occasional dropout. The first column is the echo width
+    in us (0 for no echo), which is all the simulator reads.
+    """
+    rng = random.Random(seed)
+    with open(path, 'w') as f:
+        f.write('echo_us,true_mm\n')
+        for i in range(count):
+            phase = (i % 400) / 400.0
+            mm = 100 + 2900 * (2 * phase if phase < 0.5 else 2 - 2 * phase)
+            us = mm / 0.1715
+            if rng.random() < 0.02:
+                f.write('0,%.1f\n' % mm)
+            else:
+                f.write('%.1f,%.1f\n' % (us + rng.gauss(0, 3), mm))
+
+
+def ensure_simulator():
+    if os.path.exists(SIMULATOR):
+        return
+    cc = os.environ.get('CC', 'cc')
+    subprocess.check_call([cc, '-O2', '-o', SIMULATOR, os.path.join(SIM_DIR, 'echo_replay.c'),
+                           '-lsimavr', '-lelf', '-lm'])
+
+
+def build(name, flags, env, group='sweep'):
+    """
+    Builds env with extra flags in its own build directory (.pio/<group>/<name>) and 
+    returns the path to the ELF file, and the flash and RAM usage if avr-size is around.
+    """
+    build_dir = os.path.join(PROJECT, '.pio', group, name)
+    environ = dict(os.environ,
+                   PLATFORMIO_BUILD_FLAGS=' '.join(flags),
+                   PLATFORMIO_BUILD_DIR=build_dir)
+    result = subprocess.run(['pio', 'run', '-e', env, '-d', PROJECT], env=environ,
+                            stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+    if result.returncode:
+        raise RuntimeError('build failed for %s:\n%s' % (name, result.stdout[-2000:]))
+
+    elf = os.path.join(build_dir, env, 'firmware.elf')
+    size = subprocess.run(['avr-size', elf], stdout=subprocess.PIPE, text=True) \
+        if shutil.which('avr-size') else None
+    flash = ram = None
+    if size and size.returncode == 0:
+        text, data, bss = (int(x) for x in size.stdout.splitlines()[1].split()[:3])
+        flash, ram = text + data, data + bss
+    return elf, flash, ram
+
+
+def simulate(config, elf, dataset, seconds, log_dir=None):
+    args = [SIMULATOR, elf, dataset, '--seconds', str(seconds)]
+    if config['output'] not in MATCHED_OUTPUTS:
+        args.append('--no-match')
+    if log_dir:
+        args += ['--log', os.path.join(log_dir, config_name(config) + '.log')]
+    result = subprocess.run(args, stdout=subprocess.PIPE, text=True)
+    return json.loads(result.stdout.strip().splitlines()[-1])
+
+
+def run_one(config, args):
+    elf, flash, ram = build(config_name(config), build_flags(config), args.env)
+    stats = simulate(config, elf, args.dataset, args.seconds, args.log_dir)
+    stats.update(flash=flash, ram=ram)
+    return config, stats
+
+
+COLUMNS = [
+    ('config', lambda c, s: config_name(c)),
+    ('flash', lambda c, s: s['flash'] if s['flash'] is not None else ''),
+    ('ram', lambda c, s: s['ram'] if s['ram'] is not None else ''),
+    ('rec/s', lambda c, s: '%.1f' % s['records_per_s']),
+    ('cpu%', lambda c, s: '%.2f' % (100 * s['cpu_load'])),
+    ('lat50us', lambda c, s: '%.0f' % s['latency_us']['p50'] if s['matched'] else '-'),
+    ('lat99us', lambda c, s: '%.0f' % s['latency_us']['p99'] if s['matched'] else '-'),
+    ('bias_us', lambda c, s: '%.2f' % s['error_us']['mean'] if s['matched'] else '-'),
+    ('rms_us', lambda c, s: '%.2f' % s['error_us']['rms'] if s['matched'] else '-'),
+]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('--matrix', help='JSON object (or @file) overriding entries of the default matrix')
+    parser.add_argument('--dataset', help='echo dataset (CSV, first column is echo width in us)')
+    parser.add_argument('--seconds', type=float, default=20, help='simulated time per configuration')
+    parser.add_argument('--env', default='sim', help='PlatformIO environment to build')
+    parser.add_argument('--jobs', type=int, default=os.cpu_count(), help='parallel jobs')
+    parser.add_argument('--csv', help='also write the results to this file')
+    parser.add_argument('--log-dir', help='save the firmware output of each run here')
+    args = parser.parse_args()
+
+    matrix = dict(MATRIX)
+    if args.matrix:
+        text = open(args.matrix[1:]).read() if args.matrix.startswith('@') else args.matrix
+        matrix.update(json.loads(text))
+
+    if not args.dataset:
+        args.dataset = os.path.join(SIM_DIR, 'synthetic_echoes.csv')
+        if not os.path.exists(args.dataset):
+            make_dataset(args.dataset)
+
+    if args.log_dir:
+        os.makedirs(args.log_dir, exist_ok=True)
+
+    ensure_simulator()
+
+    configs = list(expand(matrix))
+    print('%d configurations, %d jobs' % (len(configs), args.jobs), file=sys.stderr)
+
+    # the first build also installs the libraries, which mustn't happen in parallel
+    results = []
+    try:
+        results.append(run_one(configs[0], args))
+    except Exception as e:
+        print(e, file=sys.stderr)
+
+    with concurrent.futures.ThreadPoolExecutor(args.jobs) as pool:
+        futures = [pool.submit(run_one, c, args) for c in configs[1:]]
+        for future in concurrent.futures.as_completed(futures):
+            try:
+                results.append(future.result())
+            except Exception as e:
+                print(e, file=sys.stderr)
+
+    results.sort(key=lambda r: config_name(r[0]))
+    rows = [[f(c, s) for _, f in COLUMNS] for c, s in results]
+    header = [name for name, _ in COLUMNS]
+
+    widths = [max(len(str(x)) for x in col) for col in zip(header, *rows)]
+    for row in [header] + rows:
+        print('  '.join(str(x).rjust(w) for x, w in zip(row, widths)))
+
+    if args.csv:
+        with open(args.csv, 'w', newline='') as f:
+            writer = csv.writer(f)
+            writer.writerow(header)
+            writer.writerows(rows)
+
+    return 0 if len(results) == len(configs) else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
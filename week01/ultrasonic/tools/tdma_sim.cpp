@@ -0,0 +1,96 @@
+/*
+ * Runs several simulated robots through TdmaSchedule and checks that their echo windows
+ * never overlap.
+ *
+ * Each robot has its own clock (with an offset and a drift in ppm), receives the host sync
+ * with its own latency jitter, and only gets to check the schedule at the rate its loop()
+ * runs. We then look at every ping in a common time base and report any pair of pings
+ * that are closer together than the echo window.
+ *
+ * Build and run (from the project directory):
+ *   g++ -std=c++11 -O2 -Iinclude tools/tdma_sim.cpp src/tdma.cpp -o tdma_sim
+ *   ./tdma_sim [robots] [slotUS] [seconds]
+ */
+
+#include "tdma.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+struct Ping
+{
+  double time;  //us, in the common time base
+  int robot;
+};
+
+int main(int argc, char* argv[])
+{
+  int robots = argc > 1 ? atoi(argv[1]) : 4;
+  uint32_t slotUS = argc > 2 ? atoi(argv[2]) : 50000;
+  double seconds = argc > 3 ? atof(argv[3]) : 60;
+
+  const double ECHO_WINDOW_US = 40000;  //must match ECHO_TIMEOUT_US in the sketch
+  const double LOOP_PERIOD_US = 100;    //how often loop() checks the schedule
+  //allow pings to start up to 2 ms late, as long as the echo still fits in the slot
+  double slack = slotUS - ECHO_WINDOW_US;
+  const uint32_t LATE_LIMIT_US = slack > 2000 ? 2000 : (slack > 0 ? slack : 0);
+
+  //the host sends a sync roughly every second, on a frame boundary
+  double frameUS = (double)robots * slotUS;
+  const double SYNC_PERIOD_US = frameUS * (int)(1e6 / frameUS + 1);
+
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<double> offset(0, 1e9);
+  std::uniform_real_distribution<double> drift(-50e-6, 50e-6);       //16 MHz resonator, +/- 50 ppm
+  std::uniform_real_distribution<double> syncLatency(0, 1000);      //USB frames are 1 ms
+
+  std::vector<Ping> pings;
+  uint32_t skipped = 0;
+
+  for(int r = 0; r < robots; r++)
+  {
+    TdmaSchedule tdma(r, robots, slotUS, LATE_LIMIT_US);
+    double clockOffset = offset(rng);
+    double clockRate = 1 + drift(rng);
+    double nextSync = 0;
+
+    for(double t = 0; t < seconds * 1e6; t += LOOP_PERIOD_US)
+    {
+      uint32_t local = (uint32_t)(uint64_t)(clockOffset + t * clockRate);
+
+      if(t >= nextSync + syncLatency(rng))
+      {
+        tdma.Sync(local);
+        nextSync += SYNC_PERIOD_US;
+      }
+
+      if(tdma.ShouldPing(local)) pings.push_back({t, r});
+    }
+
+    skipped += tdma.Skipped();
+  }
+
+  std::sort(pings.begin(), pings.end(), [](const Ping& a, const Ping& b) {return a.time < b.time;});
+
+  uint32_t collisions = 0;
+  double minGap = 1e12;
+  for(size_t i = 1; i < pings.size(); i++)
+  {
+    double gap = pings[i].time - pings[i - 1].time;
+    if(pings[i].robot == pings[i - 1].robot) continue;
+    if(gap < minGap) minGap = gap;
+    if(gap < ECHO_WINDOW_US) collisions++;
+  }
+
+  double rate = pings.size() / seconds;
+  printf("robots: %d, slot: %u us, frame: %u us\n", robots, slotUS, robots * slotUS);
+  printf("pings: %zu (%.1f Hz combined, %.1f Hz per robot), skipped: %u\n", 
+          pings.size(), rate, rate / robots, skipped);
+  printf("closest pings from different robots: %.0f us\n", minGap);
+  printf("collisions (< %.0f us apart): %u\n", ECHO_WINDOW_US, collisions);
+
+  return collisions ? 1 : 0;
+}